@@ -6,6 +6,9 @@
 #include <sstream>
 
 #include "auth.pb.h"
+#include "batch.h"
+#include "fixed_layout.h"
+#include "serializer.h"
 
 using namespace network;
 
@@ -151,19 +154,38 @@ int AuthServer::RunLoop() {
                     }
                     closesocket(sock);
                     FD_CLR(sock, &m_Conn.readfds);
+                    m_FrameReaders.erase(sock);
+                    m_LinkFeatures.erase(sock);
                 } else {
                     printf("recv %d bytes from client.\n", recvResult);
 
-                    m_RecvBuf.Set(m_RawRecvBuf, kRECV_BUF_SIZE);
-                    uint32_t packetSize = m_RecvBuf.ReadUInt32LE();
-                    MessageType messageType = static_cast<MessageType>(m_RecvBuf.ReadUInt32LE());
+                    // a packet may arrive in pieces, or several packets may arrive at once
+                    FrameReader& reader = m_FrameReaders[sock];
+                    reader.Append(m_RawRecvBuf, recvResult);
+
+                    const char* frame = nullptr;
+                    uint32 frameSize = 0;
+                    while (reader.NextFrame(frame, frameSize)) {
+                        m_RecvBuf.Set(frame, frameSize);
+                        uint32_t packetSize = m_RecvBuf.ReadUInt32LE();
+                        MessageType messageType = static_cast<MessageType>(m_RecvBuf.ReadUInt32LE());
 
-                    if (m_RecvBuf.Size() >= packetSize) {
                         uint32_t headerSize = sizeof(uint32_t) * 2;
                         uint32_t payloadSize = packetSize - headerSize;
                         HandleMessage(messageType, sock, payloadSize);
                     }
 
+                    if (reader.IsCorrupted()) {
+                        fprintf(stderr, "invalid packet size, dropping connection.\n");
+                        if (it != m_Conn.clients.end()) {
+                            it->second = false;
+                        }
+                        closesocket(sock);
+                        FD_CLR(sock, &m_Conn.readfds);
+                        m_FrameReaders.erase(sock);
+                        m_LinkFeatures.erase(sock);
+                    }
+
                     // #TEST
                     // Send message to other clients, and definitely NOT the listening socket
                     /*for (int i = 0; i < m_Conn.readfds.fd_count; i++) {
@@ -200,19 +222,76 @@ void AuthServer::HandleMessage(network::MessageType msgType, SOCKET sock, uint32
             HandleAuthenticateWebReq(payloadHead, payloadSize, sock);
         } break;
 
+        // received the link setup from ChatServer
+        case MessageType::kNEGOTIATE_PROTOCOL_REQ: {
+            C2S_NegotiateProtocolReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                fprintf(stderr, "malformed message.\n");
+                break;
+            }
+            uint32 accepted = req.features & kSUPPORTED_FEATURES;
+            m_LinkFeatures[sock] = accepted;
+
+            printf("negotiated link features 0x%x for socket %llu.\n", accepted, (uint64)sock);
+            AckNegotiateProtocol(sock, accepted);
+        } break;
+
+        // received a batch of requests from ChatServer, the acks go back in one batch as well
+        case MessageType::kBATCH: {
+            HandleBatch(payloadHead, payloadSize, sock);
+        } break;
+
         default:
             fprintf(stderr, "unknown message.\n");
             break;
     }
 }
 
+void AuthServer::HandleBatch(const void* payloadHead, uint32_t payloadSize, SOCKET sock) {
+    // m_RecvBuf is reused by each nested packet, so keep the payload aside
+    std::string payload(static_cast<const char*>(payloadHead), payloadSize);
+    BatchReader reader(payload.data(), payloadSize);
+
+    // SendResponse appends to the batch instead of sending while it is open
+    m_ReplyBatch.Begin();
+    m_ReplyBatching = true;
+
+    const char* frame = nullptr;
+    uint32 frameSize = 0;
+    while (reader.NextFrame(frame, frameSize)) {
+        m_RecvBuf.Set(frame, frameSize);
+        uint32_t packetSize = m_RecvBuf.ReadUInt32LE();
+        MessageType messageType = static_cast<MessageType>(m_RecvBuf.ReadUInt32LE());
+        if (messageType != MessageType::kBATCH) {
+            HandleMessage(messageType, sock, packetSize - sizeof(uint32_t) * 2);
+        }
+    }
+
+    if (reader.IsCorrupted()) {
+        fprintf(stderr, "malformed batch.\n");
+    }
+
+    m_ReplyBatching = false;
+    if (m_ReplyBatch.Count() == 0) {
+        return;
+    }
+    uint32 replySize = m_ReplyBatch.Finish();
+    int sendResult = send(sock, m_ReplyBatchBuf.ConstData(), replySize, 0);
+    if (sendResult == SOCKET_ERROR) {
+        fprintf(stderr, "send failed with error %d\n", WSAGetLastError());
+    }
+}
+
 void AuthServer::HandleCreateAccountWebReq(const void* payloadHead, uint32_t payloadSize, SOCKET sock) {
-    auth::CreateAccountWeb createAccountWebReq;
-    createAccountWebReq.ParseFromArray(payloadHead, payloadSize);
+    auth::CreateAccountWeb& createAccountWebReq = m_CreateAccountWebReq;
+    if (!createAccountWebReq.ParseFromArray(payloadHead, payloadSize)) {
+        fprintf(stderr, "malformed message.\n");
+        return;
+    }
 
     int64_t requestId = createAccountWebReq.requestid();
-    std::string email = createAccountWebReq.email();
-    std::string password = createAccountWebReq.plaintextpassword();
+    const std::string& email = createAccountWebReq.email();
+    const std::string& password = createAccountWebReq.plaintextpassword();
 
     uint64_t userId{0};
     CreateAccountFailureReason reason = dbHandler.CreateAccount(email, password, userId);
@@ -234,12 +313,15 @@ void AuthServer::HandleCreateAccountWebReq(const void* payloadHead, uint32_t pay
 }
 
 void AuthServer::HandleAuthenticateWebReq(const void* payloadHead, uint32_t payloadSize, SOCKET sock) {
-    auth::AuthenticateWeb authWebReq;
-    authWebReq.ParseFromArray(payloadHead, payloadSize);
+    auth::AuthenticateWeb& authWebReq = m_AuthenticateWebReq;
+    if (!authWebReq.ParseFromArray(payloadHead, payloadSize)) {
+        fprintf(stderr, "malformed message.\n");
+        return;
+    }
 
     int64_t requestId = authWebReq.requestid();
-    std::string email = authWebReq.email();
-    std::string password = authWebReq.plaintextpassword();
+    const std::string& email = authWebReq.email();
+    const std::string& password = authWebReq.plaintextpassword();
 
     uint64_t userId{0};
     network::AuthenticateAccountFailureReason reason = dbHandler.AuthenticateAccount(email, password, userId);
@@ -260,7 +342,14 @@ void AuthServer::HandleAuthenticateWebReq(const void* payloadHead, uint32_t payl
 }
 
 int AuthServer::AckCreateAccountWebSuccess(SOCKET sock, uint64_t requestId, uint64_t userId) {
-    auth::CreateAccountWebSuccess createAccountWebSuccess;
+    if (LinkFeatures(sock) & ProtocolFeature::kFEATURE_FIXED_LAYOUT) {
+        A2S_CreateAccountWebSuccessLayout layout;
+        layout.requestId = HostToLE64(requestId);
+        layout.userId = HostToLE64(userId);
+        return SendLayout(sock, MessageType::kCREATE_ACCOUNT_WEB_SUCCESS_ACK, layout);
+    }
+
+    auth::CreateAccountWebSuccess& createAccountWebSuccess = m_CreateAccountWebSuccess;
     createAccountWebSuccess.set_requestid(requestId);
     createAccountWebSuccess.set_userid(userId);
 
@@ -280,7 +369,14 @@ int AuthServer::AckCreateAccountWebSuccess(SOCKET sock, uint64_t requestId, uint
 
 int AuthServer::AckCreateAccountWebFailure(SOCKET sock, uint64_t requestId,
                                            network::CreateAccountFailureReason reason) {
-    auth::CreateAccountWebFailure createAccountWebFailure;
+    if (LinkFeatures(sock) & ProtocolFeature::kFEATURE_FIXED_LAYOUT) {
+        A2S_CreateAccountWebFailureLayout layout;
+        layout.requestId = HostToLE64(requestId);
+        layout.reason = HostToLE32(static_cast<uint32>(reason));
+        return SendLayout(sock, MessageType::kCREATE_ACCOUNT_WEB_FAILURE_ACK, layout);
+    }
+
+    auth::CreateAccountWebFailure& createAccountWebFailure = m_CreateAccountWebFailure;
     createAccountWebFailure.set_requestid(requestId);
     createAccountWebFailure.set_reason(static_cast<auth::CreateAccountWebFailure_FailureReason>(reason));
 
@@ -299,7 +395,14 @@ int AuthServer::AckCreateAccountWebFailure(SOCKET sock, uint64_t requestId,
 }
 
 int AuthServer::AckAuthenticateWebSuccess(SOCKET sock, uint64_t requestId, uint64_t userId) {
-    auth::AuthenticateWebSuccess authWebSuccess;
+    if (LinkFeatures(sock) & ProtocolFeature::kFEATURE_FIXED_LAYOUT) {
+        A2S_AuthenticateWebSuccessLayout layout;
+        layout.requestId = HostToLE64(requestId);
+        layout.userId = HostToLE64(userId);
+        return SendLayout(sock, MessageType::kAUTHENTICATE_ACCOUNT_WEB_SUCCESS_ACK, layout);
+    }
+
+    auth::AuthenticateWebSuccess& authWebSuccess = m_AuthenticateWebSuccess;
     authWebSuccess.set_requestid(requestId);
     authWebSuccess.set_userid(userId);
 
@@ -319,7 +422,14 @@ int AuthServer::AckAuthenticateWebSuccess(SOCKET sock, uint64_t requestId, uint6
 
 int AuthServer::AckAuthenticateWebFailure(SOCKET sock, uint64_t requestId,
                                           network::AuthenticateAccountFailureReason reason) {
-    auth::AuthenticateWebFailure authWebFailure;
+    if (LinkFeatures(sock) & ProtocolFeature::kFEATURE_FIXED_LAYOUT) {
+        A2S_AuthenticateWebFailureLayout layout;
+        layout.requestId = HostToLE64(requestId);
+        layout.reason = HostToLE32(static_cast<uint32>(reason));
+        return SendLayout(sock, MessageType::kAUTHENTICATE_ACCOUNT_WEB_FAILURE_ACK, layout);
+    }
+
+    auth::AuthenticateWebFailure& authWebFailure = m_AuthenticateWebFailure;
     authWebFailure.set_requestid(requestId);
     authWebFailure.set_reason(static_cast<auth::AuthenticateWebFailure_FailureReason>(reason));
 
@@ -337,8 +447,40 @@ int AuthServer::AckAuthenticateWebFailure(SOCKET sock, uint64_t requestId,
     return SendResponse(sock, packetSize);
 }
 
+// Send a fixed-layout payload, see fixed_layout.h
+template <typename Layout>
+int AuthServer::SendLayout(SOCKET sock, MessageType messageType, const Layout& layout) {
+    m_SendBuf.Reset();
+    uint32_t packetSize = sizeof(uint32_t) * 2 + sizeof(Layout);
+    m_SendBuf.WriteUInt32LE(packetSize);
+    m_SendBuf.WriteUInt32LE(static_cast<uint32_t>(messageType));
+    m_SendBuf.Append(&layout, sizeof(Layout));
+
+    return SendResponse(sock, packetSize);
+}
+
+int AuthServer::AckNegotiateProtocol(SOCKET sock, uint32 features) {
+    S2C_NegotiateProtocolAckMsg msg{features};
+    uint32 packetSize = Serialize(msg, m_SendBuf);
+    return SendResponse(sock, packetSize);
+}
+
+// The ProtocolFeature flags negotiated with a ChatServer, none if it never negotiated
+uint32 AuthServer::LinkFeatures(SOCKET sock) const {
+    std::map<SOCKET, uint32>::const_iterator it = m_LinkFeatures.find(sock);
+    if (it == m_LinkFeatures.end()) {
+        return ProtocolFeature::kFEATURE_NONE;
+    }
+    return it->second;
+}
+
 // Send response to client
 int AuthServer::SendResponse(SOCKET sock, uint32 packetSize) {
+    if (m_ReplyBatching) {
+        m_ReplyBatch.AddPacket(m_SendBuf.ConstData(), packetSize);
+        return 0;
+    }
+
     // https://learn.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-send
     int sendResult = send(sock, m_SendBuf.ConstData(), packetSize, 0);
     if (sendResult == SOCKET_ERROR) {
@@ -8,7 +8,10 @@
 #include <string>
 #include <vector>
 
+#include "auth.pb.h"
+#include "batch.h"
 #include "buffer.h"
+#include "frame_reader.h"
 #include "message.h"
 #include "db_handler.h"
 
@@ -33,13 +36,18 @@ public:
     int AckCreateAccountWebFailure(SOCKET sock, uint64_t requestId, network::CreateAccountFailureReason reason);
     int AckAuthenticateWebSuccess(SOCKET sock, uint64_t requestId, uint64_t userId);
     int AckAuthenticateWebFailure(SOCKET sock, uint64_t requestId, network::AuthenticateAccountFailureReason reason);
+    int AckNegotiateProtocol(SOCKET sock, uint32 features);
 
 private:
     int Initialize(uint16 port);
     int SendResponse(SOCKET sock, uint32 packetSize);
+    template <typename Layout>
+    int SendLayout(SOCKET sock, network::MessageType messageType, const Layout& layout);
+    uint32 LinkFeatures(SOCKET sock) const;
     void HandleMessage(network::MessageType msgType, SOCKET sock, uint32_t msgBytesSize);
     void HandleAuthenticateWebReq(const void* payloadHead, uint32_t payloadSize, SOCKET sock);
     void HandleCreateAccountWebReq(const void* payloadHead, uint32_t payloadSize, SOCKET sock);
+    void HandleBatch(const void* payloadHead, uint32_t payloadSize, SOCKET sock);
     void Shutdown();
 
 private:
@@ -50,10 +58,29 @@ private:
     static constexpr int kRECV_BUF_SIZE = 512;
     char m_RawRecvBuf[kRECV_BUF_SIZE];
     network::Buffer m_RecvBuf{kRECV_BUF_SIZE};
+    std::map<SOCKET, network::FrameReader> m_FrameReaders;  // reassembles packets per socket
 
     static constexpr int kSEND_BUF_SIZE = 512;
     network::Buffer m_SendBuf{kSEND_BUF_SIZE};
 
+    // the protocol features this server can enable for a ChatServer link
+    static constexpr uint32 kSUPPORTED_FEATURES =
+        network::ProtocolFeature::kFEATURE_BATCH | network::ProtocolFeature::kFEATURE_FIXED_LAYOUT;
+    std::map<SOCKET, uint32> m_LinkFeatures;  // SOCKET -> negotiated ProtocolFeature flags
+
+    // the acks to a kBATCH of requests, sent back in a single packet
+    network::Buffer m_ReplyBatchBuf{kSEND_BUF_SIZE};
+    network::BatchWriter m_ReplyBatch{m_ReplyBatchBuf};
+    bool m_ReplyBatching = false;
+
+    // the protobuf messages are reused, so their strings keep their capacity between requests
+    auth::CreateAccountWeb m_CreateAccountWebReq;
+    auth::AuthenticateWeb m_AuthenticateWebReq;
+    auth::CreateAccountWebSuccess m_CreateAccountWebSuccess;
+    auth::CreateAccountWebFailure m_CreateAccountWebFailure;
+    auth::AuthenticateWebSuccess m_AuthenticateWebSuccess;
+    auth::AuthenticateWebFailure m_AuthenticateWebFailure;
+
     // database
     DBHandler dbHandler;
 };
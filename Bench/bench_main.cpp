@@ -0,0 +1,245 @@
+// Micro benchmarks of the encoding paths, each printed as nanoseconds per operation. Run the Release x64 build.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "auth.pb.h"
+#include "buffer.h"
+#include "byte_order.h"
+#include "fixed_layout.h"
+
+using namespace network;
+
+// written by every timed loop, so the optimizer cannot drop the work
+static volatile uint32 g_Sink = 0;
+
+// every operator new of the process, protobuf's included, goes through the replacements below
+static uint64 g_Allocations = 0;
+
+void* operator new(size_t size) {
+    g_Allocations++;
+    void* ptr = malloc(size ? size : 1);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+
+void operator delete(void* ptr, size_t size) noexcept { free(ptr); }
+
+// Run fn iterations times, returns the nanoseconds per iteration
+template <typename Fn>
+static double TimeNs(uint32 iterations, Fn fn) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (uint32 i = 0; i < iterations; i++) {
+        fn();
+    }
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+// the byte-wise codecs Buffer used before the memcpy ones
+static void WriteBytewise(uint8* dst, const uint32* values, uint32 count) {
+    for (uint32 i = 0; i < count; i++) {
+        dst[i * 4] = static_cast<uint8>(values[i]);
+        dst[i * 4 + 1] = static_cast<uint8>(values[i] >> 8);
+        dst[i * 4 + 2] = static_cast<uint8>(values[i] >> 16);
+        dst[i * 4 + 3] = static_cast<uint8>(values[i] >> 24);
+    }
+}
+
+static void ReadBytewise(const uint8* src, uint32* outValues, uint32 count) {
+    for (uint32 i = 0; i < count; i++) {
+        outValues[i] = static_cast<uint32>(src[i * 4]) | static_cast<uint32>(src[i * 4 + 1]) << 8 |
+                       static_cast<uint32>(src[i * 4 + 2]) << 16 | static_cast<uint32>(src[i * 4 + 3]) << 24;
+    }
+}
+
+// uint32 array I/O (the length arrays of the fixed wire format): the byte-wise loop, one WriteUInt32LE per value,
+// the bulk WriteUInt32Array (a memcpy on a little-endian host), and the swaps a big-endian host goes through,
+// scalar and SIMD (ByteSwap32Array)
+static void BenchUInt32Arrays() {
+    printf("uint32 array I/O, ns per array\n");
+    printf("%8s %10s %10s %10s %10s %10s\n", "count", "bytewise", "per value", "bulk", "swap", "simd swap");
+
+    const uint32 kCOUNTS[] = {4, 16, 64, 256, 1024};
+    for (uint32 count : kCOUNTS) {
+        std::vector<uint32> values(count);
+        for (uint32 i = 0; i < count; i++) {
+            values[i] = i * 2654435761u;
+        }
+        std::vector<uint32> outValues(count);
+        std::vector<uint8> bytes(count * sizeof(uint32));
+        Buffer buf(count * sizeof(uint32));
+        uint32 iterations = 4 * 1024 * 1024 / count;
+
+        double bytewise = TimeNs(iterations, [&]() {
+            WriteBytewise(bytes.data(), values.data(), count);
+            ReadBytewise(bytes.data(), outValues.data(), count);
+            g_Sink = g_Sink + outValues[count - 1];
+        });
+        double perValue = TimeNs(iterations, [&]() {
+            buf.Reset();
+            for (uint32 i = 0; i < count; i++) {
+                buf.WriteUInt32LE(values[i]);
+            }
+            for (uint32 i = 0; i < count; i++) {
+                outValues[i] = buf.ReadUInt32LE();
+            }
+            g_Sink = g_Sink + outValues[count - 1];
+        });
+        double bulk = TimeNs(iterations, [&]() {
+            buf.Reset();
+            buf.WriteUInt32Array(values.data(), count);
+            buf.ReadUInt32Array(outValues.data(), count);
+            g_Sink = g_Sink + outValues[count - 1];
+        });
+        double swap = TimeNs(iterations, [&]() {
+            for (uint32 i = 0; i < count; i++) {
+                outValues[i] = ByteSwap32(values[i]);
+            }
+            memcpy(bytes.data(), outValues.data(), bytes.size());
+            memcpy(outValues.data(), bytes.data(), bytes.size());
+            for (uint32 i = 0; i < count; i++) {
+                outValues[i] = ByteSwap32(outValues[i]);
+            }
+            g_Sink = g_Sink + outValues[count - 1];
+        });
+        double simdSwap = TimeNs(iterations, [&]() {
+            ByteSwap32Array(outValues.data(), values.data(), count);
+            memcpy(bytes.data(), outValues.data(), bytes.size());
+            memcpy(outValues.data(), bytes.data(), bytes.size());
+            ByteSwap32Array(outValues.data(), outValues.data(), count);
+            g_Sink = g_Sink + outValues[count - 1];
+        });
+        printf("%8u %10.1f %10.1f %10.1f %10.1f %10.1f\n", count, bytewise, perValue, bulk, swap, simdSwap);
+    }
+}
+
+// The auth messages of one AuthenticateWeb round trip, as ChatServer and AuthServer encode and decode them
+struct AuthRoundTrip {
+    auth::AuthenticateWeb request;
+    auth::AuthenticateWebSuccess response;
+};
+
+static void RunAuthRoundTrip(AuthRoundTrip& messages, const std::string& email, const std::string& password,
+                             char* packet, int64 requestId) {
+    // ChatServer -> AuthServer
+    messages.request.set_requestid(requestId);
+    messages.request.set_email(email);
+    messages.request.set_plaintextpassword(password);
+    int size = static_cast<int>(messages.request.ByteSizeLong());
+    messages.request.SerializeToArray(packet, size);
+    messages.request.ParseFromArray(packet, size);
+
+    // AuthServer -> ChatServer
+    messages.response.set_requestid(messages.request.requestid());
+    messages.response.set_userid(requestId + 1);
+    size = static_cast<int>(messages.response.ByteSizeLong());
+    messages.response.SerializeToArray(packet, size);
+    messages.response.ParseFromArray(packet, size);
+    g_Sink = g_Sink + static_cast<uint32>(messages.response.userid());
+}
+
+// The allocations of an auth round trip with fresh auth:: messages per request, and with the messages the servers
+// keep as members (their strings keep their capacity)
+static void BenchAuthAllocations() {
+    const uint32 kITERATIONS = 200000;
+    const std::string email = "alice@gmail.com";
+    const std::string password = "a password longer than the small string buffer";
+    char packet[256];
+
+    printf("\nauth round trip, per round trip\n");
+    printf("%8s %10s %10s\n", "messages", "allocs", "ns");
+
+    int64 requestId = 0;
+    uint64 allocations = g_Allocations;
+    double fresh = TimeNs(kITERATIONS, [&]() {
+        AuthRoundTrip messages;
+        RunAuthRoundTrip(messages, email, password, packet, requestId++);
+    });
+    double freshAllocations = static_cast<double>(g_Allocations - allocations) / kITERATIONS;
+    printf("%8s %10.2f %10.1f\n", "fresh", freshAllocations, fresh);
+
+    AuthRoundTrip members;
+    allocations = g_Allocations;
+    double reused = TimeNs(kITERATIONS, [&]() { RunAuthRoundTrip(members, email, password, packet, requestId++); });
+    double reusedAllocations = static_cast<double>(g_Allocations - allocations) / kITERATIONS;
+    printf("%8s %10.2f %10.1f\n", "reused", reusedAllocations, reused);
+}
+
+// The A2S acks encoded and decoded as protobuf (the reused messages) and as their fixed layouts, the two encodings
+// of the ChatServer <-> AuthServer link. Only the payload is timed, the packet header is the same for both.
+static void BenchAuthAcks() {
+    const uint32 kITERATIONS = 1000000;
+    char payload[64];
+
+    printf("\nA2S acks, per encode + decode\n");
+    printf("%24s %10s %10s\n", "encoding", "bytes", "ns");
+
+    auth::AuthenticateWebSuccess success;
+    uint64 requestId = 0;
+    int size = 0;
+    double protoSuccess = TimeNs(kITERATIONS, [&]() {
+        success.set_requestid(static_cast<int64>(requestId));
+        success.set_userid(static_cast<int64>(requestId + 1));
+        size = static_cast<int>(success.ByteSizeLong());
+        success.SerializeToArray(payload, size);
+        success.ParseFromArray(payload, size);
+        g_Sink = g_Sink + static_cast<uint32>(success.userid());
+        requestId = (requestId + 1) & 0xffff;  // a socket number
+    });
+    printf("%24s %10d %10.1f\n", "protobuf success", size, protoSuccess);
+
+    double layoutSuccess = TimeNs(kITERATIONS, [&]() {
+        A2S_AuthenticateWebSuccessLayout layout;
+        layout.requestId = HostToLE64(requestId);
+        layout.userId = HostToLE64(requestId + 1);
+        memcpy(payload, &layout, sizeof(layout));
+        const A2S_AuthenticateWebSuccessLayout* ack =
+            LayoutOf<A2S_AuthenticateWebSuccessLayout>(payload, sizeof(layout));
+        g_Sink = g_Sink + static_cast<uint32>(HostToLE64(ack->userId));
+        requestId = (requestId + 1) & 0xffff;
+    });
+    printf("%24s %10d %10.1f\n", "fixed layout success", static_cast<int>(sizeof(A2S_AuthenticateWebSuccessLayout)),
+           layoutSuccess);
+
+    auth::AuthenticateWebFailure failure;
+    double protoFailure = TimeNs(kITERATIONS, [&]() {
+        failure.set_requestid(static_cast<int64>(requestId));
+        failure.set_reason(auth::AuthenticateWebFailure_FailureReason_INVALID_CREDENTIALS);
+        size = static_cast<int>(failure.ByteSizeLong());
+        failure.SerializeToArray(payload, size);
+        failure.ParseFromArray(payload, size);
+        g_Sink = g_Sink + static_cast<uint32>(failure.reason());
+        requestId = (requestId + 1) & 0xffff;
+    });
+    printf("%24s %10d %10.1f\n", "protobuf failure", size, protoFailure);
+
+    double layoutFailure = TimeNs(kITERATIONS, [&]() {
+        A2S_AuthenticateWebFailureLayout layout;
+        layout.requestId = HostToLE64(requestId);
+        layout.reason = HostToLE32(static_cast<uint32>(auth::AuthenticateWebFailure_FailureReason_INVALID_CREDENTIALS));
+        memcpy(payload, &layout, sizeof(layout));
+        const A2S_AuthenticateWebFailureLayout* ack =
+            LayoutOf<A2S_AuthenticateWebFailureLayout>(payload, sizeof(layout));
+        g_Sink = g_Sink + HostToLE32(ack->reason);
+        requestId = (requestId + 1) & 0xffff;
+    });
+    printf("%24s %10d %10.1f\n", "fixed layout failure", static_cast<int>(sizeof(A2S_AuthenticateWebFailureLayout)),
+           layoutFailure);
+}
+
+int main(int argc, char** argv) {
+    BenchUInt32Arrays();
+    BenchAuthAllocations();
+    BenchAuthAcks();
+    return 0;
+}
@@ -3,6 +3,12 @@
 #include <WS2tcpip.h>
 
 #include <iostream>
+#include <mutex>
+
+#include "batch.h"
+#include "compression.h"
+#include "fixed_layout.h"
+#include "serializer.h"
 
 using namespace network;
 
@@ -25,7 +31,8 @@ ChatClient::ChatClient(const std::string& host, uint16 port) {
     // init networking stuff
     int result = Initialize(host, port);
     if (result == 0) {
-        //
+        // ask for the optional protocol features, requests use the fixed format until the server acks
+        ReqNegotiateProtocol(kSUPPORTED_FEATURES);
     }
 }
 
@@ -109,16 +116,25 @@ int ChatClient::Initialize(const std::string& host, uint16 port) {
     return result;
 }
 
-// Send request to server
-int ChatClient::SendRequest(network::Message* msg) {
-    int result = send(m_ConnectSocket, m_SendBuf.ConstData(), msg->header.packetSize, 0);
+// Send the request serialized in m_SendBuf to server
+int ChatClient::SendRequest(network::MessageType messageType, uint32 packetSize) {
+    const char* packet = m_SendBuf.ConstData();
+    if (m_Features & ProtocolFeature::kFEATURE_COMPRESSION) {
+        uint32 compressedSize = CompressPacket(packet, packetSize, m_CompressBuf);
+        if (compressedSize > 0) {
+            packet = m_CompressBuf.ConstData();
+            packetSize = compressedSize;
+        }
+    }
+
+    int result = send(m_ConnectSocket, packet, packetSize, 0);
     if (result == SOCKET_ERROR) {
         printf("send failed with error: %d\n", WSAGetLastError());
         closesocket(m_ConnectSocket);
         WSACleanup();
         return result;
     } else {
-        printf("\tsent msg %d (%d bytes) to the server!\n", msg->header.messageType, result);
+        printf("\tsent msg %d (%d bytes) to the server!\n", messageType, result);
     }
 
     return result;
@@ -155,16 +171,28 @@ int ChatClient::RecvResponse() {
         return 0;
     }
 
-    m_RecvBuf.Set(m_RawRecvBuf, kRECV_BUF_SIZE);
-    uint32_t packetSize = m_RecvBuf.ReadUInt32LE();
-    MessageType messageType = static_cast<MessageType>(m_RecvBuf.ReadUInt32LE());
+    // a packet may arrive in pieces, or several packets may arrive at once
+    m_FrameReader.Append(m_RawRecvBuf, bytesReceived);
 
-    printf("\trecv msg %d (%d bytes) from the server!\n", messageType, bytesReceived);
+    const char* frame = nullptr;
+    uint32 frameSize = 0;
+    while (m_FrameReader.NextFrame(frame, frameSize)) {
+        if (!LoadPacket(m_RecvBuf, frame, frameSize)) {
+            printf("malformed packet from the server\n");
+            continue;
+        }
+        uint32 packetSize = 0;
+        MessageType messageType = ReadPacketHeader(m_RecvBuf, packetSize);
 
-    if (m_RecvBuf.Size() >= packetSize) {
+        printf("\trecv msg %d (%d bytes) from the server!\n", messageType, packetSize);
         HandleMessage(messageType);
     }
 
+    if (m_FrameReader.IsCorrupted()) {
+        printf("invalid packet size from the server\n");
+        m_FrameReader.Reset();
+    }
+
     // the blocking version
     // Receive until the peer closes the connection
     // do {
@@ -189,46 +217,183 @@ int ChatClient::RecvResponse() {
 }
 
 int ChatClient::ReqCreateAccount(const std::string& userName, const std::string& password) {
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);  // requests are also sent from the recv thread
     m_MyUserName = userName;
 
     C2S_CreateAccountReqMsg msg{userName, password};
-    msg.Serialize(m_SendBuf);
+    uint32 packetSize = Serialize(msg, m_SendBuf, m_WireFormat);
 
-    return SendRequest(&msg);
+    return SendRequest(msg.kTYPE, packetSize);
 }
 
 // [send] C2S_AuthenticateAccountReqMsg
 int ChatClient::ReqAuthAccount(const std::string& userName, const std::string& password) {
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
     m_MyUserName = userName;
 
     C2S_AuthenticateAccountReqMsg msg{userName, password};
-    msg.Serialize(m_SendBuf);
+    uint32 packetSize = Serialize(msg, m_SendBuf, m_WireFormat);
 
-    return SendRequest(&msg);
+    return SendRequest(msg.kTYPE, packetSize);
 }
 
 // [send] C2S_JoinRoomReqMsg
 int ChatClient::ReqJoinRoom(const std::string& roomName) {
-    C2S_JoinRoomReqMsg msg{m_MyUserName, roomName};
-    msg.Serialize(m_SendBuf);
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
+    // the members cached from an earlier join are kept, the server then only sends what changed since
+    uint32 knownVersion = 0;
+    std::map<std::string, uint32>::const_iterator it = m_RoomVersions.find(roomName);
+    if (it != m_RoomVersions.end() && m_JoinedRoomMap.count(roomName) != 0) {
+        knownVersion = it->second;
+    }
 
-    return SendRequest(&msg);
+    C2S_JoinRoomReqMsg msg{roomName, knownVersion};
+    uint32 packetSize = Serialize(msg, m_SendBuf, m_WireFormat);
+
+    return SendRequest(msg.kTYPE, packetSize);
 }
 
 // [send] C2S_LeaveRoomReqMsg
 int ChatClient::ReqLeaveRoom(const std::string& roomName) {
-    C2S_LeaveRoomReqMsg msg{roomName, m_MyUserName};
-    msg.Serialize(m_SendBuf);
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
+    uint32 roomId = RoomId(roomName);
+    if (roomId == kINVALID_ID) {
+        printf("not in room #%s\n", roomName.c_str());
+        return -1;
+    }
+
+    C2S_LeaveRoomReqMsg msg{roomId};
+    uint32 packetSize = Serialize(msg, m_SendBuf, m_WireFormat);
 
-    return SendRequest(&msg);
+    return SendRequest(msg.kTYPE, packetSize);
 }
 
 // [send] C2S_ChatInRoomReqMsg
 int ChatClient::ReqChatInRoom(const std::string& roomName, const std::string chat) {
-    C2S_ChatInRoomReqMsg msg{roomName, m_MyUserName, chat};
-    msg.Serialize(m_SendBuf);
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
+    uint32 roomId = RoomId(roomName);
+    if (roomId == kINVALID_ID) {
+        printf("not in room #%s\n", roomName.c_str());
+        return -1;
+    }
+
+    C2S_ChatInRoomReqMsg msg{roomId, chat};
+    uint32 packetSize = Serialize(msg, m_SendBuf, m_WireFormat);
+
+    return SendRequest(msg.kTYPE, packetSize);
+}
+
+// [send] C2S_ChatInRoomReqMsg x N in one kBATCH packet
+int ChatClient::ReqChatInRoomBatch(const std::string& roomName, const std::vector<std::string>& chats) {
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
+    uint32 roomId = RoomId(roomName);
+    if (roomId == kINVALID_ID) {
+        printf("not in room #%s\n", roomName.c_str());
+        return -1;
+    }
+
+    BatchWriter batch{m_SendBuf};
+    batch.Begin();
+    for (const std::string& chat : chats) {
+        batch.Add(C2S_ChatInRoomReqMsg{roomId, chat}, m_WireFormat);
+    }
+    uint32 packetSize = batch.Finish();
+
+    return SendRequest(MessageType::kBATCH, packetSize);
+}
+
+// [send] C2S_ListMembersReqMsg
+int ChatClient::ReqListMembers(uint32 roomId, uint32 cursor) {
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
+
+    C2S_ListMembersReqMsg msg{roomId, cursor};
+    uint32 packetSize = Serialize(msg, m_SendBuf, m_WireFormat);
+
+    return SendRequest(msg.kTYPE, packetSize);
+}
+
+// [send] C2S_CreateRoomReqMsg
+int ChatClient::ReqCreateRoom(const std::string& roomName) {
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
+    C2S_CreateRoomReqMsg msg{roomName};
+    uint32 packetSize = Serialize(msg, m_SendBuf, m_WireFormat);
+
+    return SendRequest(msg.kTYPE, packetSize);
+}
+
+// [send] C2S_DeleteRoomReqMsg
+int ChatClient::ReqDeleteRoom(const std::string& roomName) {
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
+    uint32 roomId = RoomId(roomName);
+    if (roomId == kINVALID_ID) {
+        printf("unknown room #%s\n", roomName.c_str());
+        return -1;
+    }
+
+    C2S_DeleteRoomReqMsg msg{roomId};
+    uint32 packetSize = Serialize(msg, m_SendBuf, m_WireFormat);
+
+    return SendRequest(msg.kTYPE, packetSize);
+}
+
+// [send] C2S_RoomHistoryReqMsg
+// scrolls back: the first call gets the newest chats, each next one the page before
+int ChatClient::ReqRoomHistory(const std::string& roomName, uint32 pageSize) {
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
+    uint32 roomId = RoomId(roomName);
+    if (roomId == kINVALID_ID) {
+        printf("unknown room #%s\n", roomName.c_str());
+        return -1;
+    }
 
-    return SendRequest(&msg);
+    C2S_RoomHistoryReqMsg msg{roomId};
+    std::map<uint32, uint64>::const_iterator it = m_HistoryCursors.find(roomId);
+    msg.beforeSequence = it != m_HistoryCursors.end() ? it->second : 0;
+    msg.pageSize = pageSize;
+    uint32 packetSize = Serialize(msg, m_SendBuf, m_WireFormat);
+
+    return SendRequest(msg.kTYPE, packetSize);
+}
+
+// [send] C2S_SearchRoomReqMsg
+// the newest matches only
+int ChatClient::ReqSearchRoom(const std::string& roomName, const std::string& text) {
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
+    uint32 roomId = RoomId(roomName);
+    if (roomId == kINVALID_ID) {
+        printf("unknown room #%s\n", roomName.c_str());
+        return -1;
+    }
+
+    C2S_SearchRoomReqMsg msg{roomId, text};
+    uint32 packetSize = Serialize(msg, m_SendBuf, m_WireFormat);
+
+    return SendRequest(msg.kTYPE, packetSize);
+}
+
+// [send] C2S_DirectMessageReqMsg
+// the recipient must have been seen in a room or have sent this client a direct message, the server only knows ids
+int ChatClient::ReqDirectMessage(const std::string& userName, const std::string& chat) {
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
+    uint32 userId = UserId(userName);
+    if (userId == kINVALID_ID) {
+        printf("unknown user '%s'\n", userName.c_str());
+        return -1;
+    }
+
+    C2S_DirectMessageReqMsg msg{userId, chat};
+    uint32 packetSize = Serialize(msg, m_SendBuf, m_WireFormat);
+
+    return SendRequest(msg.kTYPE, packetSize);
+}
+
+// [send] C2S_NegotiateProtocolReqMsg
+int ChatClient::ReqNegotiateProtocol(uint32 features) {
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
+    C2S_NegotiateProtocolReqMsg msg{features};
+    uint32 packetSize = Serialize(msg, m_SendBuf);
+
+    return SendRequest(msg.kTYPE, packetSize);
 }
 
 // print the rooms
@@ -255,87 +420,108 @@ void ChatClient::PrintUsersInRoom(const std::string& roomName) const {
     std::cout << "---------------------\n";
 }
 
+// the chat log records of a RoomHistory or SearchRoom ack, oldest first
+void ChatClient::PrintChatRecords(const std::string& records) const {
+    size_t offset = 0;
+    while (records.size() - offset >= sizeof(ChatLogRecordHeader)) {
+        ChatLogRecordHeader header;
+        memcpy(&header, records.data() + offset, sizeof(header));
+        uint32 recordSize = HostToLE32(header.recordSize);
+        if (recordSize < sizeof(header) || recordSize > records.size() - offset) {
+            printf("malformed chat record.\n");
+            break;
+        }
+        std::string chat(records.data() + offset + sizeof(header), recordSize - sizeof(header));
+        printf("  [%llu] '%s': %s\n", HostToLE64(header.sequence), UserName(HostToLE32(header.userId)).c_str(),
+               chat.c_str());
+        offset += recordSize;
+    }
+}
+
 // Handle received messages
+// the ids and cursors it caches are read by the requests of the input thread, and some messages send requests (or
+// nest other messages) while the lock is held
 void ChatClient::HandleMessage(network::MessageType msgType) {
+    std::lock_guard<std::recursive_mutex> lock(m_Mutex);
     switch (msgType) {
         // auth ACK
         case MessageType::kCREATE_ACCOUNT_SUCCESS_ACK: {
-            // S2C_CreateAccountSuccessAckMsg
-            uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string userName = m_RecvBuf.ReadString(userNameLength);
-            uint64 userId = m_RecvBuf.ReadUInt64LE();
+            S2C_CreateAccountSuccessAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
             m_ClientState = ClientState::kONLINE;
-            printf("create account OK, user id: %llu\n", userId);
+            printf("create account OK, user id: %llu\n", ack.userId);
         } break;
 
         case MessageType::kCREATE_ACCOUNT_FAILURE_ACK: {
-            // S2C_CreateAccountFailureAckMsg
-            uint16 failureReason = m_RecvBuf.ReadUInt16LE();
-            uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string userName = m_RecvBuf.ReadString(userNameLength);
+            S2C_CreateAccountFailureAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
 
             m_ClientState = ClientState::kOFFLINE;
-            std::string reason = AuthenticateWebFailureMap[static_cast<CreateAccountFailureReason>(failureReason)];
-            printf("auth failed for %s, reason: %s\n", userName.c_str(), reason.c_str());
+            std::string reason = AuthenticateWebFailureMap[static_cast<CreateAccountFailureReason>(ack.failureReason)];
+            printf("auth failed for %s, reason: %s\n", ack.email.c_str(), reason.c_str());
         } break;
 
         case MessageType::kAUTHENTICATE_ACCOUNT_SUCCESS_ACK: {
-            // S2C_AuthenticateAccountSuccessAckMsg
-            uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string userName = m_RecvBuf.ReadString(userNameLength);
-
-            uint32 roomListLength = m_RecvBuf.ReadUInt32LE();
-            std::vector<uint32> roomNameLengths;
-            for (size_t i = 0; i < roomListLength; i++) {
-                roomNameLengths.push_back(m_RecvBuf.ReadUInt32LE());
-            }
-
-            std::vector<std::string> roomNames;
-            for (size_t i = 0; i < roomListLength; i++) {
-                std::string roomName = m_RecvBuf.ReadString(roomNameLengths[i]);
-                roomNames.push_back(roomName);
+            S2C_AuthenticateAccountSuccessAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
             }
-            printf("auth OK for %s\n", userName.c_str());
-            PrintRooms(roomNames);
+            printf("auth OK for %s\n", ack.email.c_str());
+            PrintRooms(ack.roomNames);
         } break;
 
         case MessageType::kAUTHENTICATE_ACCOUNT_FAILURE_ACK: {
-            // S2C_AuthenticateAccountFailureAckMsg
-            uint16 failureReason = m_RecvBuf.ReadUInt16LE();
-            uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string userName = m_RecvBuf.ReadString(userNameLength);
+            S2C_AuthenticateAccountFailureAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
 
             m_ClientState = ClientState::kOFFLINE;
             std::string reason =
-                AuthenticateAccountFailureMap[static_cast<AuthenticateAccountFailureReason>(failureReason)];
-            printf("auth failed for %s, reason: %s\n", userName.c_str(), reason.c_str());
+                AuthenticateAccountFailureMap[static_cast<AuthenticateAccountFailureReason>(ack.failureReason)];
+            printf("auth failed for %s, reason: %s\n", ack.email.c_str(), reason.c_str());
         } break;
 
         // join room ACK
         case MessageType::kJOIN_ROOM_ACK: {
-            uint16 status = m_RecvBuf.ReadUInt16LE();
-            if (status == MessageStatus::kSUCCESS) {
-                uint32 roomNameLength = m_RecvBuf.ReadUInt32LE();
-                std::string roomName = m_RecvBuf.ReadString(roomNameLength);
-
-                uint32 userListLength = m_RecvBuf.ReadUInt32LE();
-                std::vector<uint32> userNameLengths;
-                for (size_t i = 0; i < userListLength; i++) {
-                    userNameLengths.push_back(m_RecvBuf.ReadUInt32LE());
+            S2C_JoinRoomAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
+            if (ack.joinStatus == MessageStatus::kSUCCESS && ack.userIds.size() == ack.userNames.size()) {
+                const std::string& roomName = ack.roomName;
+
+                // remember the ids the server will use from now on
+                m_RoomIds[roomName] = ack.roomId;
+                m_RoomNames[ack.roomId] = roomName;
+                m_RoomVersions[roomName] = ack.version;
+                for (size_t i = 0; i < ack.userIds.size(); i++) {
+                    m_UserNames[ack.userIds[i]] = ack.userNames[i];
                 }
 
-                std::set<std::string> userNames;
-                for (size_t i = 0; i < userListLength; i++) {
-                    std::string userName = m_RecvBuf.ReadString(userNameLengths[i]);
-                    userNames.insert(userName);
-                }
-                // update JoinedRoomNames & JoinedRoomMap
+                // update JoinedRoomNames & JoinedRoomMap, a snapshot replaces the cached members, a delta patches them
                 m_JoinedRoomNames.insert(roomName);
-                std::map<std::string, std::set<std::string>>::iterator it = m_JoinedRoomMap.find(roomName);
-                if (it != m_JoinedRoomMap.end()) {
-                    (it->second).merge(userNames);
-                } else {
-                    m_JoinedRoomMap.insert(std::make_pair(roomName, userNames));
+                std::set<std::string>& usersInRoom = m_JoinedRoomMap[roomName];
+                if (ack.syncMode == MembershipSync::kSYNC_SNAPSHOT) {
+                    usersInRoom.clear();
+                }
+                for (uint32 userId : ack.leftUserIds) {
+                    usersInRoom.erase(UserName(userId));
+                }
+                usersInRoom.insert(ack.userNames.begin(), ack.userNames.end());
+
+                // a snapshot only has the first page, stream the rest
+                if (ack.syncMode == MembershipSync::kSYNC_SNAPSHOT && ack.nextCursor != kEND_CURSOR) {
+                    ReqListMembers(ack.roomId, ack.nextCursor);
                 }
 
                 printf("join room #%s OK\n", roomName.c_str());
@@ -348,40 +534,72 @@ void ChatClient::HandleMessage(network::MessageType msgType) {
                 PrintUsersInRoom(roomName);
             } else {
                 m_ClientState = ClientState::kOFFLINE;
-                printf("join room failed, status: %d\n", status);
+                printf("join room failed, status: %d\n", ack.joinStatus);
+            }
+        } break;
+
+        // list members ACK, one page
+        case MessageType::kLIST_MEMBERS_ACK: {
+            S2C_ListMembersAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
+            if (ack.listStatus != MessageStatus::kSUCCESS || ack.userIds.size() != ack.userNames.size()) {
+                printf("list members failed, status: %d\n", ack.listStatus);
+                break;
+            }
+
+            std::string roomName = RoomName(ack.roomId);
+            std::set<std::string>& usersInRoom = m_JoinedRoomMap[roomName];
+            for (size_t i = 0; i < ack.userIds.size(); i++) {
+                m_UserNames[ack.userIds[i]] = ack.userNames[i];
+                usersInRoom.insert(ack.userNames[i]);
+            }
+
+            if (ack.nextCursor != kEND_CURSOR) {
+                ReqListMembers(ack.roomId, ack.nextCursor);
+            } else {
+                PrintUsersInRoom(roomName);
             }
         } break;
 
         // join room NTF
         case MessageType::kJOIN_ROOM_NTF: {
-            uint32 roomNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string roomName = m_RecvBuf.ReadString(roomNameLength);
-            uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string userName = m_RecvBuf.ReadString(userNameLength);
+            S2C_JoinRoomNtfMsg ntf;
+            if (!Deserialize(m_RecvBuf, ntf)) {
+                printf("malformed message.\n");
+                break;
+            }
+
+            m_UserNames[ntf.userId] = ntf.userName;
+            std::string roomName = RoomName(ntf.roomId);
+            m_RoomVersions[roomName] = ntf.version;
 
-            printf("'%s' has joined room #%s\n", userName.c_str(), roomName.c_str());
+            printf("'%s' has joined room #%s\n", ntf.userName.c_str(), roomName.c_str());
             // update JoinedRoomMap
             std::map<std::string, std::set<std::string>>::iterator it = m_JoinedRoomMap.find(roomName);
             if (it != m_JoinedRoomMap.end()) {
-                (it->second).insert(userName);
+                (it->second).insert(ntf.userName);
             }
             PrintUsersInRoom(roomName);
         } break;
 
         // leave room ACK
         case MessageType::kLEAVE_ROOM_ACK: {
-            uint16 status = m_RecvBuf.ReadUInt16LE();
-            if (status == MessageStatus::kSUCCESS) {
-                uint32 roomNameLength = m_RecvBuf.ReadUInt32LE();
-                std::string roomName = m_RecvBuf.ReadString(roomNameLength);
-                uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-                std::string userName = m_RecvBuf.ReadString(userNameLength);
+            S2C_LeaveRoomAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
+            if (ack.leaveStatus == MessageStatus::kSUCCESS) {
+                std::string roomName = RoomName(ack.roomId);
 
                 // update JoinedRoomNames & JoinedRoomMap
                 m_JoinedRoomNames.erase(roomName);
                 std::map<std::string, std::set<std::string>>::iterator it = m_JoinedRoomMap.find(roomName);
                 if (it != m_JoinedRoomMap.end()) {
-                    (it->second).erase(userName);
+                    (it->second).erase(m_MyUserName);
                 }
 
                 printf("leaved room #%s OK\n", roomName.c_str());
@@ -392,16 +610,21 @@ void ChatClient::HandleMessage(network::MessageType msgType) {
                 printf("\n");
             } else {
                 m_ClientState = ClientState::kOFFLINE;
-                printf("leave room failed, status: %d\n", status);
+                printf("leave room failed, status: %d\n", ack.leaveStatus);
             }
         } break;
 
         // leave room NTF
         case MessageType::kLEAVE_ROOM_NTF: {
-            uint32 roomNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string roomName = m_RecvBuf.ReadString(roomNameLength);
-            uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string userName = m_RecvBuf.ReadString(userNameLength);
+            S2C_LeaveRoomNtfMsg ntf;
+            if (!Deserialize(m_RecvBuf, ntf)) {
+                printf("malformed message.\n");
+                break;
+            }
+
+            std::string roomName = RoomName(ntf.roomId);
+            std::string userName = UserName(ntf.userId);
+            m_RoomVersions[roomName] = ntf.version;
 
             printf("'%s' has left room #%s\n", userName.c_str(), roomName.c_str());
             // update JoinedRoomMap
@@ -414,30 +637,202 @@ void ChatClient::HandleMessage(network::MessageType msgType) {
 
         // chat in room ACK
         case MessageType::kCHAT_IN_ROOM_ACK: {
-            uint16 status = m_RecvBuf.ReadUInt16LE();
-            if (status == MessageStatus::kSUCCESS) {
-                uint32 roomNameLength = m_RecvBuf.ReadUInt32LE();
-                std::string roomName = m_RecvBuf.ReadString(roomNameLength);
-                uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-                std::string userName = m_RecvBuf.ReadString(userNameLength);
-
+            S2C_ChatInRoomAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
+            if (ack.chatStatus == MessageStatus::kSUCCESS) {
                 printf("chat OK.\n");
             } else {
                 m_ClientState = ClientState::kOFFLINE;
-                printf("chat failed, status: %d\n", status);
+                printf("chat failed, status: %d\n", ack.chatStatus);
             }
         } break;
 
         // chat in room NTF
         case MessageType::kCHAT_IN_ROOM_NTF: {
-            uint32 roomNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string roomName = m_RecvBuf.ReadString(roomNameLength);
-            uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string userName = m_RecvBuf.ReadString(userNameLength);
-            uint32 chatLength = m_RecvBuf.ReadUInt32LE();
-            std::string chat = m_RecvBuf.ReadString(chatLength);
-
-            printf("'%s' - #%s: %s\n", userName.c_str(), roomName.c_str(), chat.c_str());
+            S2C_ChatInRoomNtfMsg ntf;
+            if (!Deserialize(m_RecvBuf, ntf)) {
+                printf("malformed message.\n");
+                break;
+            }
+
+            printf("'%s' - #%s: %s\n", UserName(ntf.userId).c_str(), RoomName(ntf.roomId).c_str(), ntf.chat.c_str());
+        } break;
+
+        // create room ACK
+        case MessageType::kCREATE_ROOM_ACK: {
+            S2C_CreateRoomAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
+            if (ack.createStatus == MessageStatus::kSUCCESS) {
+                m_RoomIds[ack.roomName] = ack.roomId;
+                m_RoomNames[ack.roomId] = ack.roomName;
+                printf("create room #%s OK\n", ack.roomName.c_str());
+            } else {
+                printf("create room #%s failed, status: %d\n", ack.roomName.c_str(), ack.createStatus);
+            }
+        } break;
+
+        // delete room ACK
+        case MessageType::kDELETE_ROOM_ACK: {
+            S2C_DeleteRoomAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
+            if (ack.deleteStatus == MessageStatus::kSUCCESS) {
+                // the name may be given to a new room, forget everything cached under it
+                std::string roomName = RoomName(ack.roomId);
+                m_RoomIds.erase(roomName);
+                m_RoomNames.erase(ack.roomId);
+                m_HistoryCursors.erase(ack.roomId);
+                m_RoomVersions.erase(roomName);
+                m_JoinedRoomMap.erase(roomName);
+                printf("delete room #%s OK\n", roomName.c_str());
+            } else {
+                printf("delete room failed, status: %d\n", ack.deleteStatus);
+            }
+        } break;
+
+        // room history ACK
+        case MessageType::kROOM_HISTORY_ACK: {
+            S2C_RoomHistoryAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
+            if (ack.historyStatus != MessageStatus::kSUCCESS) {
+                printf("room history failed, status: %d\n", ack.historyStatus);
+                break;
+            }
+            for (size_t i = 0; i < ack.userIds.size() && i < ack.userNames.size(); i++) {
+                m_UserNames[ack.userIds[i]] = ack.userNames[i];
+            }
+
+            std::string roomName = RoomName(ack.roomId);
+            printf("#%s history, %u chats:\n", roomName.c_str(), ack.recordCount);
+            PrintChatRecords(ack.records);
+
+            // the next request goes further back, or starts over from the newest once the oldest was seen
+            m_HistoryCursors[ack.roomId] = ack.nextBeforeSequence;
+            if (ack.nextBeforeSequence == 0) {
+                printf("#%s has no older chats.\n", roomName.c_str());
+            }
+        } break;
+
+        // search room ACK
+        case MessageType::kSEARCH_ROOM_ACK: {
+            S2C_SearchRoomAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
+            if (ack.searchStatus != MessageStatus::kSUCCESS) {
+                printf("search failed, status: %d\n", ack.searchStatus);
+                break;
+            }
+            for (size_t i = 0; i < ack.userIds.size() && i < ack.userNames.size(); i++) {
+                m_UserNames[ack.userIds[i]] = ack.userNames[i];
+            }
+            printf("#%s search, %u chats:\n", RoomName(ack.roomId).c_str(), ack.recordCount);
+            PrintChatRecords(ack.records);
+        } break;
+
+        // presence NTF, the membership changes of a room since the last one
+        case MessageType::kPRESENCE_NTF: {
+            S2C_PresenceNtfMsg ntf;
+            if (!Deserialize(m_RecvBuf, ntf)) {
+                printf("malformed message.\n");
+                break;
+            }
+
+            std::string roomName = RoomName(ntf.roomId);
+            m_RoomVersions[roomName] = ntf.version;
+            std::map<std::string, std::set<std::string>>::iterator it = m_JoinedRoomMap.find(roomName);
+            for (size_t i = 0; i < ntf.joinedUserIds.size() && i < ntf.joinedUserNames.size(); i++) {
+                m_UserNames[ntf.joinedUserIds[i]] = ntf.joinedUserNames[i];
+                printf("'%s' has joined room #%s\n", ntf.joinedUserNames[i].c_str(), roomName.c_str());
+                if (it != m_JoinedRoomMap.end()) {
+                    (it->second).insert(ntf.joinedUserNames[i]);
+                }
+            }
+            for (uint32 userId : ntf.leftUserIds) {
+                std::string userName = UserName(userId);
+                printf("'%s' has left room #%s\n", userName.c_str(), roomName.c_str());
+                if (it != m_JoinedRoomMap.end()) {
+                    (it->second).erase(userName);
+                }
+            }
+            PrintUsersInRoom(roomName);
+        } break;
+
+        // direct message ACK
+        case MessageType::kDIRECT_MESSAGE_ACK: {
+            S2C_DirectMessageAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
+            if (ack.directStatus == MessageStatus::kSUCCESS) {
+                printf("direct message to '%s' OK.\n", UserName(ack.toUserId).c_str());
+            } else {
+                printf("direct message failed, status: %d\n", ack.directStatus);
+            }
+        } break;
+
+        // direct message NTF
+        case MessageType::kDIRECT_MESSAGE_NTF: {
+            S2C_DirectMessageNtfMsg ntf;
+            if (!Deserialize(m_RecvBuf, ntf)) {
+                printf("malformed message.\n");
+                break;
+            }
+            m_UserNames[ntf.fromUserId] = ntf.fromUserName;
+            printf("'%s' - direct: %s\n", ntf.fromUserName.c_str(), ntf.chat.c_str());
+        } break;
+
+        // negotiate protocol ACK
+        case MessageType::kNEGOTIATE_PROTOCOL_ACK: {
+            S2C_NegotiateProtocolAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
+            m_Features = ack.features;
+            if (ack.features & ProtocolFeature::kFEATURE_COMPACT_WIRE) {
+                m_WireFormat = WireFormat::kCOMPACT;
+            }
+            printf("protocol features: 0x%x\n", ack.features);
+        } break;
+
+        // a kBATCH packet, every nested packet is handled as if it had arrived alone
+        case MessageType::kBATCH: {
+            // m_RecvBuf is reused by each nested packet, so keep the payload aside
+            uint32 payloadSize = static_cast<uint32>(m_RecvBuf.Size() - sizeof(PacketHeader));
+            std::string payload(m_RecvBuf.ConstData() + sizeof(PacketHeader), payloadSize);
+            BatchReader reader(payload.data(), payloadSize);
+
+            const char* frame = nullptr;
+            uint32 frameSize = 0;
+            while (reader.NextFrame(frame, frameSize)) {
+                if (!LoadPacket(m_RecvBuf, frame, frameSize)) {
+                    printf("malformed packet.\n");
+                    continue;
+                }
+                uint32 packetSize = 0;
+                MessageType nestedType = ReadPacketHeader(m_RecvBuf, packetSize);
+                if (nestedType != MessageType::kBATCH) {
+                    HandleMessage(nestedType);
+                }
+            }
+
+            if (reader.IsCorrupted()) {
+                printf("malformed batch.\n");
+            }
         } break;
 
         default:
@@ -446,6 +841,32 @@ void ChatClient::HandleMessage(network::MessageType msgType) {
     }
 }
 
+// The id of a room this client has joined, kINVALID_ID if unknown
+uint32 ChatClient::RoomId(const std::string& roomName) const {
+    std::map<std::string, uint32>::const_iterator it = m_RoomIds.find(roomName);
+    return it != m_RoomIds.end() ? it->second : kINVALID_ID;
+}
+
+std::string ChatClient::RoomName(uint32 roomId) const {
+    std::map<uint32, std::string>::const_iterator it = m_RoomNames.find(roomId);
+    return it != m_RoomNames.end() ? it->second : "?";
+}
+
+std::string ChatClient::UserName(uint32 userId) const {
+    std::map<uint32, std::string>::const_iterator it = m_UserNames.find(userId);
+    return it != m_UserNames.end() ? it->second : "?";
+}
+
+// The id of a user this client has seen, kINVALID_ID if unknown
+uint32 ChatClient::UserId(const std::string& userName) const {
+    for (const std::pair<const uint32, std::string>& kv : m_UserNames) {
+        if (kv.second == userName) {
+            return kv.first;
+        }
+    }
+    return kINVALID_ID;
+}
+
 // Shutdown and cleanup include:
 // 1. shutdown socket
 // 2. close socket
@@ -4,11 +4,13 @@
 #include <WinSock2.h>
 
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
 #include <vector>
 
 #include "buffer.h"
+#include "frame_reader.h"
 #include "message.h"
 
 // the client state
@@ -31,16 +33,29 @@ public:
     int ReqJoinRoom(const std::string& roomName);
     int ReqLeaveRoom(const std::string& roomName);
     int ReqChatInRoom(const std::string& roomName, const std::string chat);
+    int ReqChatInRoomBatch(const std::string& roomName, const std::vector<std::string>& chats);
+    int ReqListMembers(uint32 roomId, uint32 cursor);
+    int ReqCreateRoom(const std::string& roomName);
+    int ReqDeleteRoom(const std::string& roomName);
+    int ReqRoomHistory(const std::string& roomName, uint32 pageSize);  // the next older page at each call
+    int ReqSearchRoom(const std::string& roomName, const std::string& text);
+    int ReqDirectMessage(const std::string& userName, const std::string& chat);
+    int ReqNegotiateProtocol(uint32 features);
 
     // Print
     void PrintRooms(const std::vector<std::string>& roomNames) const;
     void PrintUsersInRoom(const std::string& roomName) const;
+    void PrintChatRecords(const std::string& records) const;
 
 private:
     int Initialize(const std::string& host, uint16 port);
-    int SendRequest(network::Message* msg);
+    int SendRequest(network::MessageType messageType, uint32 packetSize);
 
     void HandleMessage(network::MessageType msgType);
+    uint32 RoomId(const std::string& roomName) const;
+    std::string RoomName(uint32 roomId) const;
+    std::string UserName(uint32 userId) const;
+    uint32 UserId(const std::string& userName) const;
 
     int Shutdown();
 
@@ -53,14 +68,31 @@ private:
     static constexpr int kRECV_BUF_SIZE = 512;
     char m_RawRecvBuf[kRECV_BUF_SIZE];
     network::Buffer m_RecvBuf{kSEND_BUF_SIZE};
+    network::FrameReader m_FrameReader;  // reassembles packets larger than kRECV_BUF_SIZE
 
     static constexpr int kSEND_BUF_SIZE = 512;
     network::Buffer m_SendBuf{kSEND_BUF_SIZE};
+    network::Buffer m_CompressBuf{kSEND_BUF_SIZE};  // the compressed form of the request being sent
+    std::recursive_mutex m_Mutex;                   // guards the send buffers and the state below, see HandleMessage
+
+    // the protocol features this client asks for
+    static constexpr uint32 kSUPPORTED_FEATURES = network::ProtocolFeature::kFEATURE_COMPACT_WIRE |
+                                                  network::ProtocolFeature::kFEATURE_BATCH |
+                                                  network::ProtocolFeature::kFEATURE_COMPRESSION;
+    uint32 m_Features = network::ProtocolFeature::kFEATURE_NONE;      // the features the server acked
+    network::WireFormat m_WireFormat = network::WireFormat::kFIXED;  // switched once the server acks
 
     // logic variables
     ClientState m_ClientState = ClientState::kOFFLINE;
     std::string m_MyUserName;                 // userName and email are the same, we will use them interchangeably
     std::set<std::string> m_JoinedRoomNames;  // rooms already joined
     std::map<std::string, std::set<std::string>>
-        m_JoinedRoomMap;  // roomName (string) -> userNames (set of string), only joined rooms
+        m_JoinedRoomMap;  // roomName (string) -> userNames (set of string), kept after leaving for a delta rejoin
+
+    // the server refers to rooms and users by id, learned from JoinRoom ack/ntf
+    std::map<std::string, uint32> m_RoomIds;       // roomName -> roomId
+    std::map<uint32, std::string> m_RoomNames;     // roomId -> roomName
+    std::map<uint32, std::string> m_UserNames;     // userId -> userName
+    std::map<std::string, uint32> m_RoomVersions;  // roomName -> the membership version m_JoinedRoomMap is at
+    std::map<uint32, uint64> m_HistoryCursors;     // roomId -> the beforeSequence of the next older history page
 };
\ No newline at end of file
@@ -50,11 +50,14 @@ int main(int argc, char** argv) {
         password = argv[2];
     }
 
+    // the recipient of the direct messages, this user by default
+    std::string peerName = argc > 3 ? argv[3] : userName;
+
     ChatClient client{"127.0.0.1", DEFAULT_PORT};
 
     std::thread t{RecvLoop, &client};
 
-    std::cout << "Press 0~5 to execute test step. Press 'q' to quit." << std::endl;
+    std::cout << "Press 0~9 or 'd' to execute test step. Press 'q' to quit." << std::endl;
 
     // Send messages to the server when a key is pressed
 
@@ -87,6 +90,27 @@ int main(int argc, char** argv) {
                     std::cout << "ReqChatInRoom" << std::endl;
                     client.ReqChatInRoom("network", MumboJumbo());
                     break;
+                case '6':
+                    std::cout << "ReqCreateRoom #graphics #network" << std::endl;
+                    client.ReqCreateRoom("graphics");
+                    client.ReqCreateRoom("network");
+                    break;
+                case '7':
+                    std::cout << "ReqDeleteRoom #graphics" << std::endl;
+                    client.ReqDeleteRoom("graphics");
+                    break;
+                case '8':
+                    std::cout << "ReqRoomHistory #network" << std::endl;
+                    client.ReqRoomHistory("network", 20);
+                    break;
+                case '9':
+                    std::cout << "ReqSearchRoom #network \"happy cat\"" << std::endl;
+                    client.ReqSearchRoom("network", "happy cat");
+                    break;
+                case 'd':
+                    std::cout << "ReqDirectMessage " << peerName << std::endl;
+                    client.ReqDirectMessage(peerName, MumboJumbo());
+                    break;
                 case 'q':
                     bQuit.store(true);
                     break;
@@ -0,0 +1,820 @@
+#include "chat_log.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "byte_order.h"
+#include "crc32.h"
+
+using namespace network;
+
+// Find the end of the valid records of a segment, returns their size and the sequence of the last one, and fills
+// the sparse index of the segment if outEntries is not null.
+// A record must have a sane size, a matching CRC and follow the previous sequence: what comes after is a torn
+// write, the unused zeros, or stale bytes left behind by a previous recovery.
+static size_t ScanSegment(const char* base, size_t size, uint64& outLastSequence,
+                          std::vector<ChatLogIndexEntry>* outEntries) {
+    outLastSequence = 0;
+    size_t offset = 0;
+    while (size - offset >= sizeof(ChatLogRecordHeader)) {
+        ChatLogRecordHeader header;
+        memcpy(&header, base + offset, sizeof(header));
+        uint32 recordSize = HostToLE32(header.recordSize);
+        if (recordSize < sizeof(header) || recordSize > size - offset) {
+            break;
+        }
+        uint64 sequence = HostToLE64(header.sequence);
+        if (outLastSequence != 0 && sequence != outLastSequence + 1) {
+            break;
+        }
+        const size_t kCRC_START = offsetof(ChatLogRecordHeader, sequence);
+        uint32 crc = Crc32(base + offset + kCRC_START, recordSize - kCRC_START);
+        if (crc != HostToLE32(header.crc)) {
+            break;
+        }
+
+        if (outEntries != nullptr &&
+            (outEntries->empty() || offset >= outEntries->back().offset + ChatLog::kINDEX_INTERVAL)) {
+            outEntries->push_back(ChatLogIndexEntry{sequence, HostToLE64(header.timeMs), offset});
+        }
+        outLastSequence = sequence;
+        offset += recordSize;
+    }
+    return offset;
+}
+
+ChatLog::ChatLog(const std::string& directory, size_t segmentSize)
+    : m_Directory(directory),
+      m_SegmentSize(segmentSize),
+      m_NextSequence(1),
+      m_NextIndexOffset(0),
+      m_Active(nullptr),
+      m_Spare(nullptr),
+      m_NewestSegment(0),
+      m_Committer(nullptr),
+      m_CommitBytes(0),
+      m_AppendedBytes(0),
+      m_CommittedBytes(0),
+      m_CommittedSequence(0),
+      m_WakePending(false) {}
+
+// The committer is stopped by now
+ChatLog::~ChatLog() {
+    for (ChatLogSegment* view : m_Views) {
+        CloseSegment(view);
+        delete view;
+    }
+    for (ChatLogSegment* segment : m_Retired) {
+        FlushSegment(segment);
+        WriteIndex(segment->number, segment->index);
+        CloseSegment(segment);
+        delete segment;
+    }
+    if (m_Active != nullptr) {
+        FlushSegment(m_Active);
+        CloseSegment(m_Active);
+        delete m_Active;
+    }
+    if (m_Spare != nullptr) {
+        CloseSegment(m_Spare);
+        DeleteFileA(m_Spare->path.c_str());  // never written
+        delete m_Spare;
+    }
+}
+
+bool ChatLog::Open() {
+    CreateDirectoryA(m_Directory.c_str(), NULL);  // fails if it exists already
+
+    std::vector<uint64> numbers;
+    WIN32_FIND_DATAA findData;
+    HANDLE find = FindFirstFileA((m_Directory + "\\*.seg").c_str(), &findData);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            numbers.push_back(strtoull(findData.cFileName, nullptr, 10));
+        } while (FindNextFileA(find, &findData));
+        FindClose(find);
+    }
+    std::sort(numbers.begin(), numbers.end());
+
+    if (numbers.empty()) {
+        m_NewestSegment = 1;
+        m_Active = CreateSegment(m_NewestSegment);
+        if (m_Active == nullptr) {
+            return false;
+        }
+        m_Indexes.push_back(SegmentIndex{m_NewestSegment, true, 0, {}});
+        return true;
+    }
+
+    // the older segments are indexed when they are first read
+    for (size_t i = 0; i + 1 < numbers.size(); i++) {
+        m_Indexes.push_back(SegmentIndex{numbers[i], false, 0, {}});
+    }
+
+    // append to the newest segment after its last valid record
+    m_NewestSegment = numbers.back();
+    m_Active = CreateSegment(m_NewestSegment);
+    if (m_Active == nullptr) {
+        return false;
+    }
+    SegmentIndex active{m_NewestSegment, true, 0, {}};
+    uint64 lastSequence = 0;
+    size_t written = ScanSegment(m_Active->base, m_Active->size, lastSequence, &active.entries);
+    active.end = written;
+    m_NextIndexOffset = active.entries.empty() ? 0 : active.entries.back().offset + kINDEX_INTERVAL;
+    m_Indexes.push_back(std::move(active));
+    m_Active->written.store(written);
+    m_Active->lastSequence.store(lastSequence);
+    m_Active->committed = written;
+
+    // after a crash the tail may hold a torn record, clear it so the records appended now are not followed by
+    // leftovers that could pass for their successors
+    static const char kZEROS[sizeof(ChatLogRecordHeader)] = {};
+    size_t tail = m_Active->size - written;
+    if (tail > 0 && memcmp(m_Active->base + written, kZEROS, tail < sizeof(kZEROS) ? tail : sizeof(kZEROS)) != 0) {
+        memset(m_Active->base + written, 0, tail);
+        FlushViewOfFile(m_Active->base + written, tail);
+        FlushFileBuffers(m_Active->file);
+    }
+
+    // the newest segment may be a spare that was never written, the sequence goes on from the last record
+    for (size_t i = numbers.size() - 1; lastSequence == 0 && i > 0; i--) {
+        ChatLogSegment* older = MapSegment(SegmentPath(numbers[i - 1]), 0);
+        if (older != nullptr) {
+            ScanSegment(older->base, older->size, lastSequence, nullptr);
+            CloseSegment(older);
+            delete older;
+        }
+    }
+
+    m_NextSequence = lastSequence + 1;
+    m_CommittedSequence.store(lastSequence);
+    printf("chat log %s resumes at sequence %llu.\n", m_Directory.c_str(), m_NextSequence);
+    return true;
+}
+
+void ChatLog::SetCommitter(ChatLogCommitter* committer, size_t commitBytes) {
+    m_Committer = committer;
+    m_CommitBytes = commitBytes;
+}
+
+uint64 ChatLog::Append(uint64 timeMs, uint32 roomId, uint32 userId, const std::string& chat) {
+    size_t recordSize = sizeof(ChatLogRecordHeader) + chat.size();
+    if (m_Active == nullptr || recordSize > m_SegmentSize) {
+        return 0;
+    }
+
+    size_t offset = m_Active->written.load(std::memory_order_relaxed);
+    if (recordSize > m_Active->size - offset) {
+        if (!Rollover()) {
+            return 0;
+        }
+        offset = 0;
+    }
+
+    uint64 sequence = m_NextSequence;
+    ChatLogRecordHeader header;
+    header.recordSize = HostToLE32(static_cast<uint32>(recordSize));
+    header.crc = 0;
+    header.sequence = HostToLE64(sequence);
+    header.timeMs = HostToLE64(timeMs);
+    header.roomId = HostToLE32(roomId);
+    header.userId = HostToLE32(userId);
+
+    const size_t kCRC_START = offsetof(ChatLogRecordHeader, sequence);
+    uint32 crc = Crc32(reinterpret_cast<const char*>(&header) + kCRC_START, sizeof(header) - kCRC_START);
+    header.crc = HostToLE32(Crc32(chat.data(), chat.size(), crc));
+
+    char* record = m_Active->base + offset;
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), chat.data(), chat.size());
+
+    // written first: a committer that sees lastSequence also sees the record in written
+    m_Active->written.store(offset + recordSize, std::memory_order_release);
+    m_Active->lastSequence.store(sequence, std::memory_order_release);
+    m_AppendedBytes.fetch_add(recordSize, std::memory_order_relaxed);
+    m_NextSequence++;
+
+    SegmentIndex& index = m_Indexes.back();
+    if (offset >= m_NextIndexOffset) {
+        index.entries.push_back(ChatLogIndexEntry{sequence, timeMs, offset});
+        m_NextIndexOffset = offset + kINDEX_INTERVAL;
+    }
+    index.end = offset + recordSize;
+
+    if (m_Committer != nullptr && UncommittedBytes() >= m_CommitBytes && !m_WakePending.exchange(true)) {
+        m_Committer->Wake();
+    }
+    return sequence;
+}
+
+// Start at the index block holding the newest sequence in range and walk the blocks back, reading each one
+// forward, until the page is full, the range is exhausted or kMAX_READ_SCAN bytes were gone through.
+// The records are copied from the mapped segments as they are, nothing is decoded but the headers.
+uint64 ChatLog::Read(const ChatLogQuery& query, std::string& outRecords, uint32& outCount) {
+    outCount = 0;
+    if (m_Active == nullptr || query.maxCount == 0) {
+        return 0;
+    }
+
+    // the records of the page are below upper
+    uint64 upper = m_NextSequence;
+    if (query.beforeSequence != 0 && query.beforeSequence < upper) {
+        upper = query.beforeSequence;
+    }
+    if (query.toTimeMs != 0) {
+        uint64 bound = SequenceAfter(query.toTimeMs);
+        upper = bound < upper ? bound : upper;
+    }
+    size_t segment = 0;
+    size_t entry = 0;
+    if (upper <= query.afterSequence + 1 || !Locate(upper - 1, segment, entry)) {
+        return 0;
+    }
+
+    std::vector<std::string> blockRecords;  // newest block first
+    std::vector<size_t> matches;            // the offsets of the matching records of a block
+    size_t bytes = 0;
+    size_t scanned = 0;
+    uint64 next = 0;
+    while (true) {
+        const SegmentIndex& index = m_Indexes[segment];
+        size_t viewSize = 0;
+        const char* base = View(segment, viewSize);
+        if (base == nullptr) {
+            break;
+        }
+        const ChatLogIndexEntry& block = index.entries[entry];
+        size_t blockEnd = entry + 1 < index.entries.size() ? index.entries[entry + 1].offset : index.end;
+        blockEnd = blockEnd < viewSize ? blockEnd : viewSize;
+
+        matches.clear();
+        size_t offset = block.offset;
+        while (blockEnd - offset >= sizeof(ChatLogRecordHeader)) {
+            ChatLogRecordHeader header;
+            memcpy(&header, base + offset, sizeof(header));
+            uint32 recordSize = HostToLE32(header.recordSize);
+            uint64 sequence = HostToLE64(header.sequence);
+            if (recordSize < sizeof(header) || recordSize > blockEnd - offset || sequence >= upper) {
+                break;
+            }
+            uint64 timeMs = HostToLE64(header.timeMs);
+            if (sequence > query.afterSequence && HostToLE32(header.roomId) == query.roomId &&
+                timeMs >= query.fromTimeMs && (query.toTimeMs == 0 || timeMs <= query.toTimeMs)) {
+                matches.push_back(offset);
+            }
+            offset += recordSize;
+        }
+        scanned += blockEnd - block.offset;
+
+        // the newest matches of the block, as many as the page still takes
+        size_t first = matches.size();
+        while (first > 0 && outCount < query.maxCount) {
+            ChatLogRecordHeader header;
+            memcpy(&header, base + matches[first - 1], sizeof(header));
+            size_t recordSize = HostToLE32(header.recordSize);
+            if (outCount > 0 && bytes + recordSize > query.maxBytes) {
+                break;
+            }
+            first--;
+            outCount++;
+            bytes += recordSize;
+        }
+        blockRecords.emplace_back();
+        for (size_t i = first; i < matches.size(); i++) {
+            ChatLogRecordHeader header;
+            memcpy(&header, base + matches[i], sizeof(header));
+            blockRecords.back().append(base + matches[i], HostToLE32(header.recordSize));
+        }
+
+        if (first > 0) {
+            // the page is full, the next one starts with the newest match left
+            ChatLogRecordHeader header;
+            memcpy(&header, base + matches[first - 1], sizeof(header));
+            next = HostToLE64(header.sequence) + 1;
+            break;
+        }
+        if (block.sequence <= query.afterSequence + 1 || block.timeMs < query.fromTimeMs) {
+            break;  // the older blocks are out of range
+        }
+        if (outCount == query.maxCount || bytes >= query.maxBytes || scanned >= kMAX_READ_SCAN) {
+            next = block.sequence;
+            break;
+        }
+
+        if (entry > 0) {
+            entry--;
+            continue;
+        }
+
+        // the last block of the previous segment with records
+        bool found = false;
+        while (!found && segment > 0) {
+            segment--;
+            found = LoadIndex(segment) && !m_Indexes[segment].entries.empty();
+        }
+        if (!found) {
+            break;  // the start of the log
+        }
+        entry = m_Indexes[segment].entries.size() - 1;
+    }
+
+    for (size_t i = blockRecords.size(); i > 0; i--) {
+        outRecords += blockRecords[i - 1];
+    }
+    return next;
+}
+
+size_t ChatLog::Commit() {
+    m_WakePending.store(false);
+
+    std::vector<ChatLogSegment*> retired;
+    ChatLogSegment* active = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        retired.swap(m_Retired);
+        active = m_Active;
+
+        // the next rollover takes this one, so the owner thread does not create files
+        if (m_Spare == nullptr && active != nullptr) {
+            m_Spare = CreateSegment(m_NewestSegment + 1);
+            if (m_Spare != nullptr) {
+                m_NewestSegment++;
+            }
+        }
+    }
+
+    // lastSequence is loaded before FlushSegment loads written, so the record it names is flushed
+    uint64 sequence = m_CommittedSequence.load();
+    size_t flushed = 0;
+    for (ChatLogSegment* segment : retired) {
+        uint64 lastSequence = segment->lastSequence.load(std::memory_order_acquire);
+        flushed += FlushSegment(segment);
+        sequence = lastSequence > sequence ? lastSequence : sequence;
+        WriteIndex(segment->number, segment->index);
+        CloseSegment(segment);
+        delete segment;
+    }
+    if (active != nullptr) {
+        uint64 lastSequence = active->lastSequence.load(std::memory_order_acquire);
+        flushed += FlushSegment(active);
+        sequence = lastSequence > sequence ? lastSequence : sequence;
+    }
+
+    m_CommittedBytes.fetch_add(flushed);
+    m_CommittedSequence.store(sequence);
+    return flushed;
+}
+
+// One lookup in the index, then a read of at most a block
+bool ChatLog::ReadRecord(uint64 sequence, std::string& outRecords) {
+    size_t segment = 0;
+    size_t entry = 0;
+    if (m_Active == nullptr || sequence >= m_NextSequence || !Locate(sequence, segment, entry)) {
+        return false;
+    }
+    size_t viewSize = 0;
+    const char* base = View(segment, viewSize);
+    if (base == nullptr) {
+        return false;
+    }
+
+    const SegmentIndex& index = m_Indexes[segment];
+    size_t end = index.end < viewSize ? index.end : viewSize;
+    size_t offset = index.entries[entry].offset;
+    while (end - offset >= sizeof(ChatLogRecordHeader)) {
+        ChatLogRecordHeader header;
+        memcpy(&header, base + offset, sizeof(header));
+        uint32 recordSize = HostToLE32(header.recordSize);
+        uint64 found = HostToLE64(header.sequence);
+        if (recordSize < sizeof(header) || recordSize > end - offset || found > sequence) {
+            break;
+        }
+        if (found == sequence) {
+            outRecords.append(base + offset, recordSize);
+            return true;
+        }
+        offset += recordSize;
+    }
+    return false;
+}
+
+// One lookup in the index, then the segments are read forward from that block
+uint64 ChatLog::ReadFrom(uint64 fromSequence, size_t maxBytes, std::string& outRecords) {
+    size_t segment = 0;
+    size_t entry = 0;
+    if (m_Active == nullptr || fromSequence >= m_NextSequence) {
+        return 0;
+    }
+    if (!Locate(fromSequence, segment, entry)) {
+        segment = 0;  // the log starts after fromSequence
+        entry = 0;
+    }
+
+    size_t bytes = 0;
+    for (; segment < m_Indexes.size(); segment++, entry = 0) {
+        size_t viewSize = 0;
+        const char* base = LoadIndex(segment) ? View(segment, viewSize) : nullptr;
+        if (base == nullptr) {
+            return 0;
+        }
+        const SegmentIndex& index = m_Indexes[segment];
+        if (index.entries.empty()) {
+            continue;
+        }
+
+        size_t end = index.end < viewSize ? index.end : viewSize;
+        size_t offset = index.entries[entry].offset;
+        while (end - offset >= sizeof(ChatLogRecordHeader)) {
+            ChatLogRecordHeader header;
+            memcpy(&header, base + offset, sizeof(header));
+            uint32 recordSize = HostToLE32(header.recordSize);
+            uint64 sequence = HostToLE64(header.sequence);
+            if (recordSize < sizeof(header) || recordSize > end - offset || sequence >= m_NextSequence) {
+                break;
+            }
+            if (sequence >= fromSequence) {
+                if (bytes > 0 && bytes + recordSize > maxBytes) {
+                    return sequence;
+                }
+                outRecords.append(base + offset, recordSize);
+                bytes += recordSize;
+            }
+            offset += recordSize;
+        }
+    }
+    return 0;
+}
+
+uint64 ChatLog::NextSequence() const { return m_NextSequence; }
+
+size_t ChatLog::UncommittedBytes() const { return m_AppendedBytes.load() - m_CommittedBytes.load(); }
+
+uint64 ChatLog::CommittedSequence() const { return m_CommittedSequence.load(); }
+
+const std::string& ChatLog::Directory() const { return m_Directory; }
+
+ChatLogSegment* ChatLog::CreateSegment(uint64 number) {
+    ChatLogSegment* segment = MapSegment(SegmentPath(number), m_SegmentSize);
+    if (segment != nullptr) {
+        segment->number = number;
+    }
+    return segment;
+}
+
+// Map a segment file, growing it to minSize with zeros
+ChatLogSegment* ChatLog::MapSegment(const std::string& path, size_t minSize) {
+    ChatLogSegment* segment = new ChatLogSegment;
+    segment->path = path;
+    segment->file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL, NULL);
+    if (segment->file == INVALID_HANDLE_VALUE) {
+        printf("CreateFile %s failed with error %lu\n", path.c_str(), GetLastError());
+        delete segment;
+        return nullptr;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(segment->file, &fileSize)) {
+        fileSize.QuadPart = 0;
+    }
+    uint64 size = static_cast<uint64>(fileSize.QuadPart);
+    size = size > minSize ? size : minSize;
+    if (size == 0) {
+        CloseSegment(segment);
+        delete segment;
+        return nullptr;
+    }
+
+    // https://learn.microsoft.com/en-us/windows/win32/memory/creating-a-file-mapping-object
+    segment->mapping = CreateFileMappingA(segment->file, NULL, PAGE_READWRITE, static_cast<DWORD>(size >> 32),
+                                          static_cast<DWORD>(size & 0xFFFFFFFF), NULL);
+    if (segment->mapping != NULL) {
+        segment->base = static_cast<char*>(MapViewOfFile(segment->mapping, FILE_MAP_WRITE, 0, 0, size));
+    }
+    if (segment->base == nullptr) {
+        printf("mapping %s failed with error %lu\n", path.c_str(), GetLastError());
+        CloseSegment(segment);
+        delete segment;
+        return nullptr;
+    }
+    segment->size = static_cast<size_t>(size);
+    return segment;
+}
+
+// Map a whole file for reading, the owner thread keeps writing to it through its own view
+ChatLogSegment* ChatLog::MapReadOnly(const std::string& path) {
+    ChatLogSegment* segment = new ChatLogSegment;
+    segment->path = path;
+    segment->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER fileSize;
+    if (segment->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(segment->file, &fileSize) || fileSize.QuadPart == 0) {
+        CloseSegment(segment);
+        delete segment;
+        return nullptr;
+    }
+
+    segment->mapping = CreateFileMappingA(segment->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (segment->mapping != NULL) {
+        segment->base = static_cast<char*>(MapViewOfFile(segment->mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+    if (segment->base == nullptr) {
+        printf("mapping %s failed with error %lu\n", path.c_str(), GetLastError());
+        CloseSegment(segment);
+        delete segment;
+        return nullptr;
+    }
+    segment->size = static_cast<size_t>(fileSize.QuadPart);
+    return segment;
+}
+
+void ChatLog::CloseSegment(ChatLogSegment* segment) {
+    if (segment->base != nullptr) {
+        UnmapViewOfFile(segment->base);
+        segment->base = nullptr;
+    }
+    if (segment->mapping != NULL) {
+        CloseHandle(segment->mapping);
+        segment->mapping = NULL;
+    }
+    if (segment->file != INVALID_HANDLE_VALUE) {
+        CloseHandle(segment->file);
+        segment->file = INVALID_HANDLE_VALUE;
+    }
+}
+
+// Write the records appended since the last flush to disk, returns their size
+size_t ChatLog::FlushSegment(ChatLogSegment* segment) {
+    size_t written = segment->written.load(std::memory_order_acquire);
+    if (written == segment->committed) {
+        return 0;
+    }
+
+    // FlushViewOfFile only hands the dirty pages to the file system, FlushFileBuffers waits for the disk
+    size_t flushed = written - segment->committed;
+    FlushViewOfFile(segment->base + segment->committed, flushed);
+    FlushFileBuffers(segment->file);
+    segment->committed = written;
+    return flushed;
+}
+
+// Switch to the next segment. The committer creates it ahead of time, unless it fell behind.
+bool ChatLog::Rollover() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    ChatLogSegment* next = m_Spare;
+    m_Spare = nullptr;
+    if (next == nullptr) {
+        next = CreateSegment(m_NewestSegment + 1);
+        if (next == nullptr) {
+            return false;
+        }
+        m_NewestSegment++;
+    }
+
+    m_Active->index = m_Indexes.back().entries;  // the committer writes the .idx once the segment is flushed
+    m_Retired.push_back(m_Active);
+    m_Active = next;
+
+    m_Indexes.push_back(SegmentIndex{next->number, true, 0, {}});
+    m_NextIndexOffset = 0;
+    return true;
+}
+
+std::string ChatLog::SegmentPath(uint64 number) const {
+    char name[32];
+    snprintf(name, sizeof(name), "\\%020llu.seg", number);
+    return m_Directory + name;
+}
+
+std::string ChatLog::IndexPath(uint64 number) const {
+    char name[32];
+    snprintf(name, sizeof(name), "\\%020llu.idx", number);
+    return m_Directory + name;
+}
+
+// The block holding a sequence: the last index entry at or before it, in the last segment that starts at or
+// before it. Both are binary searches, only the probed segments get their index loaded.
+bool ChatLog::Locate(uint64 sequence, size_t& outSegment, size_t& outEntry) {
+    // the first segment that starts after sequence, a segment with no records counts as one
+    size_t low = 0;
+    size_t high = m_Indexes.size();
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (!LoadIndex(mid)) {
+            return false;
+        }
+        const std::vector<ChatLogIndexEntry>& entries = m_Indexes[mid].entries;
+        if (!entries.empty() && entries[0].sequence <= sequence) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return false;
+    }
+
+    const std::vector<ChatLogIndexEntry>& entries = m_Indexes[low - 1].entries;
+    std::vector<ChatLogIndexEntry>::const_iterator after =
+        std::upper_bound(entries.begin(), entries.end(), sequence,
+                         [](uint64 value, const ChatLogIndexEntry& entry) { return value < entry.sequence; });
+    outSegment = low - 1;
+    outEntry = static_cast<size_t>(after - entries.begin()) - 1;
+    return true;
+}
+
+// A sequence below which lie all the records up to timeMs, as far as the clock went forward: the start of the
+// first block that starts after timeMs. The records are filtered by time anyway, this only bounds the read.
+uint64 ChatLog::SequenceAfter(uint64 timeMs) {
+    size_t low = 0;
+    size_t high = m_Indexes.size();
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (!LoadIndex(mid)) {
+            return m_NextSequence;
+        }
+        const std::vector<ChatLogIndexEntry>& entries = m_Indexes[mid].entries;
+        if (!entries.empty() && entries[0].timeMs <= timeMs) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return 0;  // the log starts after timeMs
+    }
+
+    const std::vector<ChatLogIndexEntry>& entries = m_Indexes[low - 1].entries;
+    std::vector<ChatLogIndexEntry>::const_iterator after =
+        std::upper_bound(entries.begin(), entries.end(), timeMs,
+                         [](uint64 value, const ChatLogIndexEntry& entry) { return value < entry.timeMs; });
+    if (after != entries.end()) {
+        return after->sequence;
+    }
+    if (low < m_Indexes.size() && !m_Indexes[low].entries.empty()) {
+        return m_Indexes[low].entries[0].sequence;
+    }
+    return m_NextSequence;
+}
+
+// The index of a segment, on its first use: its .idx if it matches the segment (it was written when the segment
+// was full), otherwise a scan of the segment, which writes the .idx for the next time.
+bool ChatLog::LoadIndex(size_t segment) {
+    SegmentIndex& index = m_Indexes[segment];
+    if (index.loaded) {
+        return true;
+    }
+    size_t size = 0;
+    const char* base = View(segment, size);
+    if (base == nullptr) {
+        return false;
+    }
+
+    std::vector<ChatLogIndexEntry> entries;
+    ChatLogSegment* file = MapReadOnly(IndexPath(index.number));
+    if (file != nullptr) {
+        entries.resize(file->size / sizeof(ChatLogIndexEntry));
+        for (size_t i = 0; i < entries.size(); i++) {
+            ChatLogIndexEntry entry;
+            memcpy(&entry, file->base + i * sizeof(entry), sizeof(entry));
+            entries[i].sequence = HostToLE64(entry.sequence);
+            entries[i].timeMs = HostToLE64(entry.timeMs);
+            entries[i].offset = HostToLE64(entry.offset);
+        }
+        CloseSegment(file);
+        delete file;
+    }
+
+    // the entries must go up from offset 0, and the last one must name its record, which the tail follows
+    bool valid = !entries.empty() && entries[0].offset == 0;
+    for (size_t i = 1; valid && i < entries.size(); i++) {
+        valid = entries[i].sequence > entries[i - 1].sequence && entries[i].offset > entries[i - 1].offset;
+    }
+    if (valid && entries.back().offset < size) {
+        ChatLogRecordHeader header;
+        memcpy(&header, base + entries.back().offset, sizeof(header));
+        uint64 lastSequence = 0;
+        size_t tail = ScanSegment(base + entries.back().offset, size - entries.back().offset, lastSequence, nullptr);
+        valid = tail > 0 && HostToLE64(header.sequence) == entries.back().sequence;
+        index.end = entries.back().offset + tail;
+    } else {
+        valid = false;
+    }
+
+    if (!valid) {
+        printf("indexing chat log segment %s.\n", SegmentPath(index.number).c_str());
+        uint64 lastSequence = 0;
+        entries.clear();
+        index.end = ScanSegment(base, size, lastSequence, &entries);
+        WriteIndex(index.number, entries);
+    }
+    index.entries.swap(entries);
+    index.loaded = true;
+    return true;
+}
+
+// The mapped segment, m_Active or a read-only view of an older one
+const char* ChatLog::View(size_t segment, size_t& outSize) {
+    uint64 number = m_Indexes[segment].number;
+    if (number == m_Active->number) {
+        outSize = m_Active->size;
+        return m_Active->base;
+    }
+
+    for (size_t i = 0; i < m_Views.size(); i++) {
+        if (m_Views[i]->number == number) {
+            ChatLogSegment* view = m_Views[i];
+            m_Views.erase(m_Views.begin() + i);
+            m_Views.push_back(view);
+            outSize = view->size;
+            return view->base;
+        }
+    }
+
+    ChatLogSegment* view = MapReadOnly(SegmentPath(number));
+    if (view == nullptr) {
+        return nullptr;
+    }
+    view->number = number;
+    if (m_Views.size() == kREAD_VIEWS) {
+        CloseSegment(m_Views.front());
+        delete m_Views.front();
+        m_Views.erase(m_Views.begin());
+    }
+    m_Views.push_back(view);
+    outSize = view->size;
+    return view->base;
+}
+
+// Keep the index of a full segment next to it, so a restart does not have to scan the segment.
+// It is only a hint, LoadIndex checks it against the segment.
+void ChatLog::WriteIndex(uint64 number, const std::vector<ChatLogIndexEntry>& entries) {
+    if (entries.empty()) {
+        return;
+    }
+    std::string path = IndexPath(number);
+    DeleteFileA(path.c_str());  // a stale one could be longer
+    ChatLogSegment* file = MapSegment(path, entries.size() * sizeof(ChatLogIndexEntry));
+    if (file == nullptr) {
+        return;
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        const ChatLogIndexEntry& entry = entries[i];
+        ChatLogIndexEntry stored{HostToLE64(entry.sequence), HostToLE64(entry.timeMs), HostToLE64(entry.offset)};
+        memcpy(file->base + i * sizeof(stored), &stored, sizeof(stored));
+    }
+    FlushViewOfFile(file->base, file->size);
+    FlushFileBuffers(file->file);
+    CloseSegment(file);
+    delete file;
+}
+
+ChatLogCommitter::ChatLogCommitter(uint32 intervalMs, size_t commitBytes)
+    : m_IntervalMs(intervalMs), m_CommitBytes(commitBytes), m_WakeRequested(false), m_Stopping(false) {}
+
+ChatLogCommitter::~ChatLogCommitter() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stopping = true;
+    }
+    m_WakeCond.notify_one();
+    if (m_Thread.joinable()) {
+        m_Thread.join();
+    }
+}
+
+void ChatLogCommitter::Add(ChatLog* log) {
+    log->SetCommitter(this, m_CommitBytes);
+    m_Logs.push_back(log);
+}
+
+void ChatLogCommitter::Start() { m_Thread = std::thread(&ChatLogCommitter::Run, this); }
+
+void ChatLogCommitter::Wake() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_WakeRequested = true;
+    }
+    m_WakeCond.notify_one();
+}
+
+void ChatLogCommitter::Run() {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (!m_Stopping) {
+        m_WakeCond.wait_for(lock, std::chrono::milliseconds(m_IntervalMs),
+                            [this] { return m_WakeRequested || m_Stopping; });
+        m_WakeRequested = false;
+
+        lock.unlock();
+        for (ChatLog* log : m_Logs) {
+            log->Commit();
+        }
+        lock.lock();
+    }
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "fixed_layout.h"
+
+// The records are network::ChatLogRecordHeader followed by the chat.
+
+// A sparse index entry: the first record at or after every ChatLog::kINDEX_INTERVAL bytes of a segment.
+// A segment's entries are also kept in <segment number>.idx once it is full. Little-endian, no padding.
+#pragma pack(push, 1)
+struct ChatLogIndexEntry {
+    uint64 sequence;
+    uint64 timeMs;
+    uint64 offset;
+};
+#pragma pack(pop)
+
+// A segment file of a chat log, mapped in memory. The file is preallocated, its unused tail is zeros.
+struct ChatLogSegment {
+    uint64 number = 0;
+    std::string path;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+    char* base = nullptr;
+    size_t size = 0;
+
+    std::atomic<size_t> written{0};       // published by the appending thread
+    std::atomic<uint64> lastSequence{0};  // the sequence of the last record below written, 0 if none
+    size_t committed = 0;                 // committer thread
+
+    std::vector<ChatLogIndexEntry> index;  // handed to the committer with the full segment, to write the .idx
+};
+
+// A page of the chats of one room in a chat log, the newest ones in the range. The bounds are exclusive for the
+// sequences and inclusive for the times, 0 for none.
+struct ChatLogQuery {
+    uint32 roomId = 0;
+    uint64 beforeSequence = 0;
+    uint64 afterSequence = 0;
+    uint64 fromTimeMs = 0;
+    uint64 toTimeMs = 0;
+    uint32 maxCount = 0;
+    size_t maxBytes = 0;
+};
+
+class ChatLogCommitter;
+
+// One partition of the persistent chat log: an append-only sequence of records in memory-mapped segment files,
+// <directory>\<segment number>.seg. A partition holds the chats of the rooms of one RoomShard, which appends on its
+// own thread: an append is a copy into the mapped segment, only the ChatLogCommitter thread waits for the disk.
+// The committer also creates the next segment ahead of time, so a rollover is usually a pointer swap.
+// Reads go through a sparse index of every segment, so a page of history is a lookup and a short sequential read.
+class ChatLog {
+public:
+    static constexpr size_t kSEGMENT_SIZE = 64 * 1024 * 1024;
+
+    // the index granularity: a lookup lands at most this far before the record it looks for
+    static constexpr size_t kINDEX_INTERVAL = 16 * 1024;
+
+    // how many bytes of records a Read goes through before it returns what it found
+    static constexpr size_t kMAX_READ_SCAN = 4 * 1024 * 1024;
+
+    // older segments mapped for reading at the same time
+    static constexpr size_t kREAD_VIEWS = 4;
+
+    ChatLog(const std::string& directory, size_t segmentSize);
+    ~ChatLog();
+
+    // Resume after the last valid record of the newest segment, or start a new log. Returns false on error.
+    bool Open();
+
+    // the committer to wake when enough bytes are waiting, before the first Append
+    void SetCommitter(ChatLogCommitter* committer, size_t commitBytes);
+
+    // Append a chat, returns its sequence (0 if the log is not open or the chat cannot fit in a segment).
+    // Owner thread only.
+    uint64 Append(uint64 timeMs, uint32 roomId, uint32 userId, const std::string& chat);
+
+    // Copy the records of the page (header and chat, as stored) to outRecords, oldest first, and count them.
+    // Returns the beforeSequence of the next older page, 0 once the range is exhausted. Owner thread only.
+    uint64 Read(const ChatLogQuery& query, std::string& outRecords, uint32& outCount);
+
+    // Append the record of a sequence to outRecords, returns false if the log does not have it. Owner thread only.
+    bool ReadRecord(uint64 sequence, std::string& outRecords);
+
+    // Append the records from fromSequence on to outRecords, oldest first, up to maxBytes of them (at least one).
+    // Returns the sequence to go on from, 0 once the end of the log is reached. Owner thread only.
+    uint64 ReadFrom(uint64 fromSequence, size_t maxBytes, std::string& outRecords);
+
+    // the sequence the next Append gets. Owner thread only.
+    uint64 NextSequence() const;
+
+    // Flush the appended records to disk, returns the number of bytes made durable. Committer thread only.
+    size_t Commit();
+
+    // the bytes appended but not flushed yet, and the sequence of the last durable record. Any thread.
+    size_t UncommittedBytes() const;
+    uint64 CommittedSequence() const;
+
+    const std::string& Directory() const;
+
+private:
+    ChatLogSegment* CreateSegment(uint64 number);
+    ChatLogSegment* MapSegment(const std::string& path, size_t minSize);
+    ChatLogSegment* MapReadOnly(const std::string& path);
+    void CloseSegment(ChatLogSegment* segment);
+    size_t FlushSegment(ChatLogSegment* segment);
+    bool Rollover();
+    std::string SegmentPath(uint64 number) const;
+    std::string IndexPath(uint64 number) const;
+
+    // reads: the block of the index holding a sequence, the bound below which the records up to a time lie,
+    // the index of a segment (loaded or rebuilt on first use) and a read-only view of it
+    bool Locate(uint64 sequence, size_t& outSegment, size_t& outEntry);
+    uint64 SequenceAfter(uint64 timeMs);
+    bool LoadIndex(size_t segment);
+    const char* View(size_t segment, size_t& outSize);
+    void WriteIndex(uint64 number, const std::vector<ChatLogIndexEntry>& entries);
+
+private:
+    std::string m_Directory;
+    size_t m_SegmentSize;
+
+    // owner thread
+    uint64 m_NextSequence;
+
+    // the index of every segment, oldest first, the last one is m_Active's
+    struct SegmentIndex {
+        uint64 number;
+        bool loaded;  // entries and end are known
+        size_t end;   // the size of the valid records
+        std::vector<ChatLogIndexEntry> entries;
+    };
+    std::vector<SegmentIndex> m_Indexes;
+    size_t m_NextIndexOffset;              // where m_Active gets its next entry
+    std::vector<ChatLogSegment*> m_Views;  // read-only views of older segments, least recently used first
+
+    // m_Active is read by the committer under m_Mutex, and only replaced under it
+    std::mutex m_Mutex;
+    ChatLogSegment* m_Active;
+    ChatLogSegment* m_Spare;                 // the next segment, created by the committer
+    std::vector<ChatLogSegment*> m_Retired;  // full segments not flushed yet
+    uint64 m_NewestSegment;                  // the number of the newest segment file
+
+    // group commit
+    ChatLogCommitter* m_Committer;
+    size_t m_CommitBytes;
+    std::atomic<size_t> m_AppendedBytes;
+    std::atomic<size_t> m_CommittedBytes;
+    std::atomic<uint64> m_CommittedSequence;
+    std::atomic<bool> m_WakePending;  // the committer was woken and has not committed yet
+};
+
+// Group commit for the chat logs: one thread flushes every log each intervalMs, or sooner once a log has
+// commitBytes waiting, so a burst of chats costs one flush per log instead of one per chat.
+class ChatLogCommitter {
+public:
+    static constexpr uint32 kCOMMIT_INTERVAL_MS = 10;
+    static constexpr size_t kCOMMIT_BYTES = 1024 * 1024;
+
+    ChatLogCommitter(uint32 intervalMs, size_t commitBytes);
+    ~ChatLogCommitter();  // commits a last time and stops the thread
+
+    // register a log before Start
+    void Add(ChatLog* log);
+    void Start();
+
+    // commit now, any thread
+    void Wake();
+
+private:
+    void Run();
+
+private:
+    std::vector<ChatLog*> m_Logs;
+    uint32 m_IntervalMs;
+    size_t m_CommitBytes;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_WakeCond;
+    bool m_WakeRequested;
+    bool m_Stopping;
+    std::thread m_Thread;
+};
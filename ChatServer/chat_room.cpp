@@ -0,0 +1,112 @@
+#include "chat_room.h"
+
+ChatRoom::ChatRoom(uint32 id, const std::string& name, uint32 initialVersion, uint32 historyCapacity)
+    : m_Id(id), m_Name(name), m_Version(initialVersion), m_History(historyCapacity) {}
+
+ChatRoom::~ChatRoom() {}
+
+uint32 ChatRoom::Id() const { return m_Id; }
+
+const std::string& ChatRoom::Name() const { return m_Name; }
+
+const std::vector<uint32>& ChatRoom::Members() const { return m_Members; }
+
+bool ChatRoom::IsMember(uint32 userId) const { return m_MemberSlots.Contains(userId); }
+
+uint32 ChatRoom::Version() const { return m_Version; }
+
+MessageHistory& ChatRoom::History() { return m_History; }
+
+const MessageHistory& ChatRoom::History() const { return m_History; }
+
+bool ChatRoom::Join(uint32 userId) {
+    if (m_MemberSlots.Contains(userId)) {
+        return false;
+    }
+    m_MemberSlots.Insert(userId, static_cast<uint32>(m_Members.size()));
+    m_Members.push_back(userId);
+    m_MemberIndex.insert(userId);
+    RecordChange(userId);
+    return true;
+}
+
+bool ChatRoom::Leave(uint32 userId) {
+    uint32 slot = 0;
+    if (!m_MemberSlots.Find(userId, slot)) {
+        return false;
+    }
+
+    // move the last member into the freed slot
+    uint32 lastUserId = m_Members.back();
+    m_Members[slot] = lastUserId;
+    m_MemberSlots.Insert(lastUserId, slot);
+    m_Members.pop_back();
+    m_MemberSlots.Erase(userId);
+    m_MemberIndex.erase(userId);
+
+    RecordChange(userId);
+    return true;
+}
+
+bool ChatRoom::ChangesSince(uint32 knownVersion, std::vector<uint32>& outJoined, std::vector<uint32>& outLeft) const {
+    outJoined.clear();
+    outLeft.clear();
+
+    // version 0 means the client knows nothing, and a version from the future means it talked to another server
+    uint32 oldestKnown = m_Version - static_cast<uint32>(m_ChangeLog.size());
+    if (knownVersion == 0 || knownVersion < oldestKnown || knownVersion > m_Version) {
+        return false;
+    }
+
+    // only the current state of each user touched since knownVersion matters
+    std::set<uint32> touched;
+    for (size_t i = knownVersion - oldestKnown; i < m_ChangeLog.size(); i++) {
+        touched.insert(m_ChangeLog[i]);
+    }
+    for (uint32 userId : touched) {
+        if (IsMember(userId)) {
+            outJoined.push_back(userId);
+        } else {
+            outLeft.push_back(userId);
+        }
+    }
+    return true;
+}
+
+uint32 ChatRoom::MembersPage(uint32 cursor, uint32 pageSize, std::vector<uint32>& outUserIds) const {
+    outUserIds.clear();
+    if (cursor == network::kEND_CURSOR) {
+        return network::kEND_CURSOR;
+    }
+
+    std::set<uint32>::const_iterator it = m_MemberIndex.lower_bound(cursor);
+    for (; it != m_MemberIndex.end() && outUserIds.size() < pageSize; ++it) {
+        outUserIds.push_back(*it);
+    }
+    return it != m_MemberIndex.end() ? *it : network::kEND_CURSOR;
+}
+
+void ChatRoom::SortedMembers(std::vector<uint32>& outUserIds) const {
+    outUserIds.assign(m_MemberIndex.begin(), m_MemberIndex.end());
+}
+
+void ChatRoom::RestoreMembers(const std::vector<uint32>& userIds) {
+    m_Members.reserve(m_Members.size() + userIds.size());
+    for (uint32 userId : userIds) {
+        if (!m_MemberSlots.Contains(userId)) {
+            m_MemberSlots.Insert(userId, static_cast<uint32>(m_Members.size()));
+            m_Members.push_back(userId);
+            m_MemberIndex.insert(m_MemberIndex.end(), userId);
+        }
+    }
+}
+
+void ChatRoom::DropChangeLog() { std::deque<uint32>().swap(m_ChangeLog); }
+
+void ChatRoom::RecordChange(uint32 userId) {
+    m_Version++;
+    m_ChangeLog.push_back(userId);
+    if (m_ChangeLog.size() > kMAX_CHANGE_LOG) {
+        m_ChangeLog.pop_front();
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "id_table.h"
+#include "message.h"
+#include "message_history.h"
+
+// A chat room, its membership and its recent chats.
+// Every join/leave bumps the membership version and is recorded in a bounded change log,
+// so a client that knows an older version can be sent only what changed since.
+// A room whose state was reclaimed and is allocated again starts at a version no client can hold a newer one of.
+class ChatRoom {
+public:
+    ChatRoom(uint32 id, const std::string& name, uint32 initialVersion, uint32 historyCapacity);
+    ~ChatRoom();
+
+    uint32 Id() const;
+    const std::string& Name() const;
+    const std::vector<uint32>& Members() const;  // in no particular order
+    bool IsMember(uint32 userId) const;
+    uint32 Version() const;
+
+    // the last chats, replayed to the users who join
+    MessageHistory& History();
+    const MessageHistory& History() const;
+
+    // returns false if the membership did not change
+    bool Join(uint32 userId);
+    bool Leave(uint32 userId);
+
+    // Fill the net membership changes since knownVersion: the users who are members now, and the ones who are not.
+    // Returns false if the change log no longer reaches back to knownVersion, send a full snapshot then.
+    bool ChangesSince(uint32 knownVersion, std::vector<uint32>& outJoined, std::vector<uint32>& outLeft) const;
+
+    // Fill one page of members in userId order, starting at cursor (0 for the first page).
+    // Returns the cursor of the next page, network::kEND_CURSOR after the last one.
+    // A cursor is the userId to resume at, so pages stay consistent while members come and go.
+    uint32 MembersPage(uint32 cursor, uint32 pageSize, std::vector<uint32>& outUserIds) const;
+
+    // The members in userId order, to park the room / add them back to a new room, without a version change.
+    void SortedMembers(std::vector<uint32>& outUserIds) const;
+    void RestoreMembers(const std::vector<uint32>& userIds);
+
+    // Free the change log, a client behind the current version gets a snapshot. For idle rooms that still have members.
+    void DropChangeLog();
+
+    // how many changes are kept, a client further behind gets a snapshot
+    static constexpr size_t kMAX_CHANGE_LOG = 1024;
+
+private:
+    void RecordChange(uint32 userId);
+
+private:
+    uint32 m_Id;  // the roomId
+    std::string m_Name;
+    std::vector<uint32> m_Members;   // userIds, dense so a broadcast is a linear scan
+    IdTable m_MemberSlots;           // userId -> index in m_Members, for O(1) swap-remove
+    std::set<uint32> m_MemberIndex;  // the same userIds in order, for the pages of MembersPage
+
+    // the version of m_Members, the initial version until the first change
+    uint32 m_Version;
+
+    // the userIds of the last changes, oldest first, the last one is the change that made m_Version
+    std::deque<uint32> m_ChangeLog;
+
+    MessageHistory m_History;
+};
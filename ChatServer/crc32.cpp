@@ -0,0 +1,28 @@
+#include "crc32.h"
+
+// the table of the reflected polynomial 0xEDB88320, built on first use
+static const uint32* Crc32Table() {
+    static uint32 table[256];
+    static bool built = [] {
+        for (uint32 i = 0; i < 256; i++) {
+            uint32 c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)built;
+    return table;
+}
+
+uint32 Crc32(const void* data, size_t size, uint32 crc) {
+    const uint32* table = Crc32Table();
+    const uint8* bytes = static_cast<const uint8*>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
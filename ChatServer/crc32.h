@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+
+#include "common.h"
+
+// CRC-32 (IEEE 802.3, the zlib one). Pass the previous result as crc to checksum data in pieces.
+uint32 Crc32(const void* data, size_t size, uint32 crc = 0);
@@ -0,0 +1,104 @@
+#include "id_table.h"
+
+#include "message.h"
+
+IdTable::IdTable() : m_Size(0), m_Shift(32) {}
+
+IdTable::~IdTable() {}
+
+bool IdTable::Find(uint32 key, uint32& outValue) const {
+    if (m_Entries.empty()) {
+        return false;
+    }
+    const Entry& entry = m_Entries[Probe(key)];
+    if (entry.key != key) {
+        return false;
+    }
+    outValue = entry.value;
+    return true;
+}
+
+bool IdTable::Contains(uint32 key) const {
+    uint32 value = 0;
+    return Find(key, value);
+}
+
+void IdTable::Insert(uint32 key, uint32 value) {
+    // keep the load factor under 3/4
+    if ((m_Size + 1) * 4 > m_Entries.size() * 3) {
+        Rehash(m_Entries.empty() ? kMIN_CAPACITY : m_Entries.size() * 2);
+    }
+
+    Entry& entry = m_Entries[Probe(key)];
+    if (entry.key != key) {
+        entry.key = key;
+        m_Size++;
+    }
+    entry.value = value;
+}
+
+bool IdTable::Erase(uint32 key) {
+    if (m_Entries.empty()) {
+        return false;
+    }
+    size_t mask = m_Entries.size() - 1;
+    size_t hole = Probe(key);
+    if (m_Entries[hole].key != key) {
+        return false;
+    }
+
+    // move back every following entry of the cluster that may not be reachable from its home slot anymore
+    size_t i = hole;
+    while (true) {
+        i = (i + 1) & mask;
+        if (m_Entries[i].key == network::kINVALID_ID) {
+            break;
+        }
+        size_t home = Home(m_Entries[i].key);
+        // the entry can fill the hole if its home slot is not in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            m_Entries[hole] = m_Entries[i];
+            hole = i;
+        }
+    }
+    m_Entries[hole].key = network::kINVALID_ID;
+    m_Size--;
+    return true;
+}
+
+size_t IdTable::Size() const { return m_Size; }
+
+void IdTable::Clear() {
+    m_Entries.clear();
+    m_Size = 0;
+    m_Shift = 32;
+}
+
+size_t IdTable::Home(uint32 key) const {
+    // Fibonacci hashing: the high bits of the product spread the sequential ids over the table
+    return static_cast<uint32>(key * 2654435769u) >> m_Shift;
+}
+
+size_t IdTable::Probe(uint32 key) const {
+    size_t mask = m_Entries.size() - 1;
+    size_t i = Home(key);
+    while (m_Entries[i].key != key && m_Entries[i].key != network::kINVALID_ID) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void IdTable::Rehash(size_t capacity) {
+    std::vector<Entry> old;
+    old.swap(m_Entries);
+    m_Entries.assign(capacity, Entry{network::kINVALID_ID, 0});
+    m_Shift = 32;
+    for (size_t c = capacity; c > 1; c >>= 1) {
+        m_Shift--;
+    }
+    for (const Entry& entry : old) {
+        if (entry.key != network::kINVALID_ID) {
+            m_Entries[Probe(entry.key)] = entry;
+        }
+    }
+}
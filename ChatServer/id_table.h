@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "common.h"
+
+// A uint32 -> uint32 hash table with open addressing (linear probing) in one flat array.
+// Keys are interned ids, network::kINVALID_ID marks an empty slot and cannot be used as a key.
+// Erase shifts the following entries back instead of leaving tombstones, so lookups never slow down.
+class IdTable {
+public:
+    IdTable();
+    ~IdTable();
+
+    // returns false if key is not in the table
+    bool Find(uint32 key, uint32& outValue) const;
+    bool Contains(uint32 key) const;
+
+    // Insert key, or overwrite its value
+    void Insert(uint32 key, uint32 value);
+
+    // returns false if key was not in the table
+    bool Erase(uint32 key);
+
+    size_t Size() const;
+    void Clear();
+
+private:
+    struct Entry {
+        uint32 key;
+        uint32 value;
+    };
+
+    // the slot holding key, or the empty slot where it would go
+    size_t Probe(uint32 key) const;
+    size_t Home(uint32 key) const;
+    void Rehash(size_t capacity);
+
+private:
+    std::vector<Entry> m_Entries;  // the capacity is a power of 2
+    size_t m_Size;
+    uint32 m_Shift;  // 32 - log2(capacity)
+
+    static constexpr size_t kMIN_CAPACITY = 8;
+};
@@ -0,0 +1,68 @@
+#include "message_history.h"
+
+#include <utility>
+
+MessageHistory::MessageHistory(uint32 capacity) : m_Head(0), m_Count(0), m_Bytes(0), m_Capacity(capacity) {}
+
+MessageHistory::~MessageHistory() {}
+
+uint32 MessageHistory::Capacity() const { return m_Capacity; }
+
+size_t MessageHistory::Count() const { return m_Count; }
+
+size_t MessageHistory::Bytes() const { return m_Bytes; }
+
+const MessageHistory::SharedPacket& MessageHistory::At(size_t i) const {
+    return m_Ring[(m_Head + i) % m_Ring.size()];
+}
+
+void MessageHistory::SetCapacity(uint32 capacity) {
+    if (capacity == m_Capacity) {
+        return;
+    }
+
+    // keep the newest packets that fit, in order, at the start of a new ring
+    while (m_Count > capacity) {
+        DropOldest();
+    }
+    std::vector<SharedPacket> ring;
+    if (m_Count > 0) {
+        ring.resize(capacity);
+        for (size_t i = 0; i < m_Count; i++) {
+            ring[i] = std::move(m_Ring[(m_Head + i) % m_Ring.size()]);
+        }
+    }
+    m_Ring.swap(ring);
+    m_Head = 0;
+    m_Capacity = capacity;
+}
+
+void MessageHistory::Append(const SharedPacket& packet) {
+    if (m_Capacity == 0) {
+        return;
+    }
+    if (m_Ring.empty()) {
+        m_Ring.resize(m_Capacity);
+    }
+    if (m_Count == m_Capacity) {
+        DropOldest();
+    }
+
+    m_Ring[(m_Head + m_Count) % m_Ring.size()] = packet;
+    m_Count++;
+    m_Bytes += packet->size();
+}
+
+size_t MessageHistory::DropOldest() {
+    if (m_Count == 0) {
+        return 0;
+    }
+
+    SharedPacket& oldest = m_Ring[m_Head];
+    size_t size = oldest->size();
+    oldest.reset();
+    m_Head = (m_Head + 1) % m_Ring.size();
+    m_Count--;
+    m_Bytes -= size;
+    return size;
+}
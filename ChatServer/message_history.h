@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// The last chats of a room, kept as encoded S2C_ChatInRoomNtfMsg packets.
+// The packets are the ones the broadcast queued, so keeping them and replaying them costs no encoding or copy.
+class MessageHistory {
+public:
+    typedef std::shared_ptr<const std::string> SharedPacket;
+
+    explicit MessageHistory(uint32 capacity);
+    ~MessageHistory();
+
+    uint32 Capacity() const;
+    size_t Count() const;
+    size_t Bytes() const;  // the size of the packets held
+
+    // the i-th packet, oldest first
+    const SharedPacket& At(size_t i) const;
+
+    // Keep at most capacity packets, the oldest ones are dropped
+    void SetCapacity(uint32 capacity);
+
+    // Add the newest packet, dropping the oldest one when full
+    void Append(const SharedPacket& packet);
+
+    // Drop the oldest packet, returns its size (0 if empty)
+    size_t DropOldest();
+
+private:
+    std::vector<SharedPacket> m_Ring;  // allocated on the first Append
+    size_t m_Head;                     // the index of the oldest packet
+    size_t m_Count;
+    size_t m_Bytes;
+    uint32 m_Capacity;
+};
@@ -0,0 +1,45 @@
+#include "mpsc_queue.h"
+
+MpscQueue::MpscQueue() : m_Head(&m_Stub), m_Tail(&m_Stub) {}
+
+MpscQueue::~MpscQueue() {}
+
+void MpscQueue::Push(MpscNode* node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    MpscNode* prev = m_Head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+MpscNode* MpscQueue::Pop() {
+    MpscNode* tail = m_Tail;
+    MpscNode* next = tail->next.load(std::memory_order_acquire);
+
+    // skip the stub
+    if (tail == &m_Stub) {
+        if (next == nullptr) {
+            return nullptr;
+        }
+        m_Tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr) {
+        m_Tail = next;
+        return tail;
+    }
+
+    // tail is the last node: a producer is between its exchange and its store
+    if (tail != m_Head.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+
+    // put the stub back behind tail so tail can be handed out
+    Push(&m_Stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+        m_Tail = next;
+        return tail;
+    }
+    return nullptr;
+}
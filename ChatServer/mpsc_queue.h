@@ -0,0 +1,27 @@
+#pragma once
+
+#include <atomic>
+
+// A node of an MpscQueue, embedded in the queued object
+struct MpscNode {
+    std::atomic<MpscNode*> next{nullptr};
+};
+
+// An intrusive, lock-free, multi-producer single-consumer FIFO (Vyukov's design).
+// Push is wait-free and may be called from any thread; Pop must only be called by the owner thread.
+// The queue does not own the nodes.
+class MpscQueue {
+public:
+    MpscQueue();
+    ~MpscQueue();
+
+    void Push(MpscNode* node);
+
+    // returns nullptr when the queue is empty, or when the next node is still being pushed
+    MpscNode* Pop();
+
+private:
+    std::atomic<MpscNode*> m_Head;  // the last pushed node, producers swap it
+    MpscNode* m_Tail;               // the next node to pop, only touched by the consumer
+    MpscNode m_Stub;                // keeps the list non-empty, so push and pop never touch the same pointer
+};
@@ -0,0 +1,107 @@
+#include "offline_inbox.h"
+
+#include <utility>
+
+OfflineInbox::OfflineInbox(uint32 capacity, size_t maxBytes, size_t budget)
+    : m_Bytes(0), m_Hand(0), m_Capacity(capacity), m_MaxBytes(maxBytes), m_Budget(budget) {}
+
+OfflineInbox::~OfflineInbox() {}
+
+void OfflineInbox::SetCapacity(uint32 capacity, size_t maxBytes, size_t budget) {
+    m_Capacity = capacity;
+    m_MaxBytes = maxBytes;
+    m_Budget = budget;
+
+    size_t slot = m_Queues.size();
+    while (slot > 0) {
+        slot--;
+        Trim(m_Queues[slot]);
+        if (m_Queues[slot].packets.empty()) {
+            Free(static_cast<uint32>(slot));  // moves the last queue into slot, which was already visited
+        }
+    }
+    EnforceBudget();
+}
+
+void OfflineInbox::Store(uint32 userId, uint64 sequence, const SharedPacket& packet) {
+    if (m_Capacity == 0 || packet->size() > m_MaxBytes) {
+        return;
+    }
+
+    uint32 slot = 0;
+    if (!m_QueueSlots.Find(userId, slot)) {
+        slot = static_cast<uint32>(m_Queues.size());
+        m_QueueSlots.Insert(userId, slot);
+        Queue queue;
+        queue.userId = userId;
+        queue.bytes = 0;
+        queue.dropped = 0;
+        m_Queues.push_back(std::move(queue));
+    }
+
+    Queue& queue = m_Queues[slot];
+    queue.packets.push_back(Entry{sequence, packet});
+    queue.bytes += packet->size();
+    m_Bytes += packet->size();
+    Trim(queue);
+    EnforceBudget();
+}
+
+uint32 OfflineInbox::Take(uint32 userId, std::vector<Entry>& outEntries) {
+    uint32 slot = 0;
+    if (!m_QueueSlots.Find(userId, slot)) {
+        return 0;
+    }
+
+    Queue& queue = m_Queues[slot];
+    outEntries.insert(outEntries.end(), queue.packets.begin(), queue.packets.end());
+    uint32 dropped = queue.dropped;
+    m_Bytes -= queue.bytes;
+    Free(slot);
+    return dropped;
+}
+
+size_t OfflineInbox::UserCount() const { return m_Queues.size(); }
+
+size_t OfflineInbox::Bytes() const { return m_Bytes; }
+
+void OfflineInbox::DropOldest(Queue& queue) {
+    size_t size = queue.packets.front().packet->size();
+    queue.packets.pop_front();
+    queue.bytes -= size;
+    queue.dropped++;
+    m_Bytes -= size;
+}
+
+void OfflineInbox::Trim(Queue& queue) {
+    while (!queue.packets.empty() && (queue.packets.size() > m_Capacity || queue.bytes > m_MaxBytes)) {
+        DropOldest(queue);
+    }
+}
+
+// The clock hand drops the oldest chat of each queue in turn, so the users share the budget
+// instead of the one with the most chats losing all of them.
+void OfflineInbox::EnforceBudget() {
+    while (m_Bytes > m_Budget && !m_Queues.empty()) {
+        if (m_Hand >= m_Queues.size()) {
+            m_Hand = 0;
+        }
+        DropOldest(m_Queues[m_Hand]);
+        if (m_Queues[m_Hand].packets.empty()) {
+            Free(static_cast<uint32>(m_Hand));  // the last queue moves into the hand's slot, it is visited next
+        } else {
+            m_Hand++;
+        }
+    }
+}
+
+// swap-remove, like RoomShard::FreeRoom
+void OfflineInbox::Free(uint32 slot) {
+    uint32 userId = m_Queues[slot].userId;
+    if (slot + 1 < m_Queues.size()) {
+        m_Queues[slot] = std::move(m_Queues.back());
+        m_QueueSlots.Insert(m_Queues[slot].userId, slot);
+    }
+    m_Queues.pop_back();
+    m_QueueSlots.Erase(userId);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "id_table.h"
+
+// The chats broadcast to the members of a shard's rooms while they were offline, queued per user until they log in.
+// The queues hold the plain packets the broadcast encoded (like MessageHistory), so queueing a chat costs a reference.
+// Each packet is stamped with the sequence ChatServer gave the request that sent it, so the queues a user has in
+// several shards can be merged back into the order the chats were sent in.
+// Each queue is capped by count and by size, and all of them by a budget: the oldest chats go first, so a user who
+// has been away for months gets the newest ones, not a burst of everything.
+class OfflineInbox {
+public:
+    typedef std::shared_ptr<const std::string> SharedPacket;
+
+    struct Entry {
+        uint64 sequence;
+        SharedPacket packet;
+    };
+
+    OfflineInbox(uint32 capacity, size_t maxBytes, size_t budget);
+    ~OfflineInbox();
+
+    // Set the caps of each queue and of all of them, the queues are trimmed right away
+    void SetCapacity(uint32 capacity, size_t maxBytes, size_t budget);
+
+    // Queue a packet for a user, dropping the oldest ones to respect the caps. The sequences of a user increase.
+    void Store(uint32 userId, uint64 sequence, const SharedPacket& packet);
+
+    // Move the packets of a user to outEntries, oldest first. Returns how many were dropped since the last Take.
+    uint32 Take(uint32 userId, std::vector<Entry>& outEntries);
+
+    size_t UserCount() const;
+    size_t Bytes() const;  // the size of the packets held
+
+private:
+    struct Queue {
+        uint32 userId;
+        std::deque<Entry> packets;
+        size_t bytes;
+        uint32 dropped;  // the packets dropped to respect the caps
+    };
+
+    void DropOldest(Queue& queue);
+    void Trim(Queue& queue);
+    void EnforceBudget();
+    void Free(uint32 slot);
+
+private:
+    std::vector<Queue> m_Queues;  // dense, so the budget sweep is a linear scan
+    IdTable m_QueueSlots;         // userId -> index in m_Queues
+    size_t m_Bytes;
+    size_t m_Hand;  // the clock hand of the budget sweep, like RoomShard::EnforceHistoryBudget
+
+    uint32 m_Capacity;
+    size_t m_MaxBytes;
+    size_t m_Budget;
+};
@@ -0,0 +1,105 @@
+#include "registry.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "byte_order.h"
+#include "crc32.h"
+
+using namespace network;
+
+Registry::Registry(const std::string& path) : m_Path(path), m_File(INVALID_HANDLE_VALUE) {}
+
+Registry::~Registry() {
+    if (m_File != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_File);
+    }
+}
+
+// A record must have a sane size, a matching CRC and name the next id of its kind, or a room that exists: what comes
+// after is a torn append, it is cut off so the next append follows the last valid record.
+bool Registry::Open(std::vector<std::string>& outUserNames, std::vector<std::string>& outRoomNames) {
+    m_File = CreateFileA(m_Path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+                         FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_File == INVALID_HANDLE_VALUE) {
+        printf("CreateFile %s failed with error %lu\n", m_Path.c_str(), GetLastError());
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(m_File, &fileSize)) {
+        fileSize.QuadPart = 0;
+    }
+    std::string journal(static_cast<size_t>(fileSize.QuadPart), '\0');
+    DWORD bytesRead = 0;
+    if (!journal.empty() &&
+        !ReadFile(m_File, &journal[0], static_cast<DWORD>(journal.size()), &bytesRead, NULL)) {
+        printf("ReadFile %s failed with error %lu\n", m_Path.c_str(), GetLastError());
+        return false;
+    }
+    journal.resize(bytesRead);
+
+    size_t offset = 0;
+    while (journal.size() - offset >= sizeof(RegistryRecordHeader)) {
+        RegistryRecordHeader header;
+        memcpy(&header, journal.data() + offset, sizeof(header));
+        uint32 recordSize = HostToLE32(header.recordSize);
+        if (recordSize < sizeof(header) || recordSize > journal.size() - offset) {
+            break;
+        }
+        const size_t kCRC_START = offsetof(RegistryRecordHeader, kind);
+        if (Crc32(journal.data() + offset + kCRC_START, recordSize - kCRC_START) != HostToLE32(header.crc)) {
+            break;
+        }
+
+        uint32 id = HostToLE32(header.id);
+        std::string name(journal.data() + offset + sizeof(header), recordSize - sizeof(header));
+        if (header.kind == kUSER && id == outUserNames.size()) {
+            outUserNames.push_back(name);
+        } else if (header.kind == kROOM && id == outRoomNames.size()) {
+            outRoomNames.push_back(name);
+        } else if (header.kind == kROOM_DELETED && id < outRoomNames.size()) {
+            std::string().swap(outRoomNames[id]);
+        } else {
+            break;
+        }
+        offset += recordSize;
+    }
+
+    LARGE_INTEGER end;
+    end.QuadPart = static_cast<LONGLONG>(offset);
+    if (!SetFilePointerEx(m_File, end, NULL, FILE_BEGIN) || !SetEndOfFile(m_File)) {
+        printf("truncating %s failed with error %lu\n", m_Path.c_str(), GetLastError());
+        return false;
+    }
+    printf("registry %s holds %u users and %u rooms.\n", m_Path.c_str(), static_cast<uint32>(outUserNames.size()),
+           static_cast<uint32>(outRoomNames.size()));
+    return true;
+}
+
+bool Registry::Append(Kind kind, uint32 id, const std::string& name) {
+    if (m_File == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    RegistryRecordHeader header;
+    header.recordSize = HostToLE32(static_cast<uint32>(sizeof(header) + name.size()));
+    header.crc = 0;
+    header.kind = kind;
+    header.id = HostToLE32(id);
+
+    const size_t kCRC_START = offsetof(RegistryRecordHeader, kind);
+    uint32 crc = Crc32(reinterpret_cast<const char*>(&header) + kCRC_START, sizeof(header) - kCRC_START);
+    header.crc = HostToLE32(Crc32(name.data(), name.size(), crc));
+
+    m_Record.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_Record += name;
+    DWORD bytesWritten = 0;
+    if (!WriteFile(m_File, m_Record.data(), static_cast<DWORD>(m_Record.size()), &bytesWritten, NULL) ||
+        bytesWritten != m_Record.size() || !FlushFileBuffers(m_File)) {
+        printf("appending to %s failed with error %lu\n", m_Path.c_str(), GetLastError());
+        return false;
+    }
+    return true;
+}
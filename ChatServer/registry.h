@@ -0,0 +1,43 @@
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// A record of the registry journal, followed by the name. Little-endian, no padding.
+#pragma pack(push, 1)
+struct RegistryRecordHeader {
+    uint32 recordSize;  // header + name
+    uint32 crc;         // of what follows it
+    uint8 kind;         // Registry::Kind
+    uint32 id;
+};
+#pragma pack(pop)
+
+// The ids ChatServer gave its users and rooms, kept across restarts: the chat log records name their room and author
+// by id, so the records of the previous runs can only be served if the ids stay the same.
+// An append-only journal: a user or a room is appended when it is interned, a room again when it is deleted (its id
+// is not reused). The appends are rare, each one is flushed before the id it records is used.
+class Registry {
+public:
+    enum Kind : uint8 { kUSER = 1, kROOM = 2, kROOM_DELETED = 3 };
+
+    explicit Registry(const std::string& path);
+    ~Registry();
+
+    // Replay the journal into the names, indexed by id (a deleted room gets an empty name), and open it for appending
+    // after its last valid record. Returns false on error.
+    bool Open(std::vector<std::string>& outUserNames, std::vector<std::string>& outRoomNames);
+
+    // Append a record, returns false on error
+    bool Append(Kind kind, uint32 id, const std::string& name);
+
+private:
+    std::string m_Path;
+    HANDLE m_File;
+    std::string m_Record;  // scratch space of Append
+};
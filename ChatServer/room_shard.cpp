@@ -0,0 +1,716 @@
+#include "room_shard.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "byte_order.h"
+#include "compression.h"
+#include "frame_reader.h"
+#include "serializer.h"
+
+using namespace network;
+
+RoomShard::RoomShard(const std::vector<std::string>& userNames, const std::vector<SOCKET>& userSockets,
+                     const std::vector<uint8>& userPacketVariants)
+    : m_UserNames(userNames),
+      m_UserSockets(userSockets),
+      m_UserPacketVariants(userPacketVariants),
+      m_VersionFloor(0),
+      m_HistoryBytes(0),
+      m_HistoryBudget(kHISTORY_BUDGET),
+      m_HistoryHand(0),
+      m_NowMs(0),
+      m_Sequence(0),
+      m_ChatLog(nullptr),
+      m_SearchIndex(nullptr),
+      m_Inbox(kINBOX_CAPACITY, kINBOX_USER_BYTES, kINBOX_BUDGET),
+      m_SendBuf(512),
+      m_CompressBuf(512),
+      m_HoldOutboxes(false) {}
+
+RoomShard::~RoomShard() {
+    // drop the requests that were never run
+    while (MpscNode* node = m_Mailbox.Pop()) {
+        delete static_cast<RoomCommand*>(node);
+    }
+}
+
+void RoomShard::Post(RoomCommand* command) { m_Mailbox.Push(command); }
+
+void RoomShard::SetHistoryBudget(size_t bytes) {
+    m_HistoryBudget = bytes;
+    EnforceHistoryBudget();
+}
+
+void RoomShard::SetInboxCapacity(uint32 capacity, size_t maxBytes, size_t budget) {
+    m_Inbox.SetCapacity(capacity, maxBytes, budget);
+}
+
+void RoomShard::StoreInbox(uint32 userId, uint64 sequence, const SharedPacket& packet) {
+    m_Inbox.Store(userId, sequence, packet);
+}
+
+uint32 RoomShard::TakeInbox(uint32 userId, std::vector<OfflineInbox::Entry>& outEntries) {
+    return m_Inbox.Take(userId, outEntries);
+}
+
+void RoomShard::EnqueueInbox(uint32 userId, const std::vector<OfflineInbox::Entry>& entries) {
+    if (m_UserSockets[userId] == INVALID_SOCKET) {
+        return;
+    }
+    ResizeUserTables();  // a direct message may be waiting for a user interned since the last drain
+
+    m_ReplayPackets.clear();
+    for (const OfflineInbox::Entry& entry : entries) {
+        m_ReplayPackets.push_back(entry.packet);
+    }
+    EnqueueBatched(userId, m_ReplayPackets, kINBOX_BATCH_BYTES);
+    m_ReplayPackets.clear();
+    if (m_HoldOutboxes) {
+        m_UnsentChats[userId].insert(m_UnsentChats[userId].end(), entries.begin(), entries.end());
+    }
+}
+
+void RoomShard::SetHoldOutboxes(bool hold) {
+    m_HoldOutboxes = hold;
+    if (!hold) {
+        std::vector<std::vector<OfflineInbox::Entry>>().swap(m_UnsentChats);
+        m_UnsentChats.resize(m_Outboxes.size());
+    }
+}
+
+// The chats of the inbox and the broadcasts may be interleaved, the inbox wants them by sequence. The rest of the
+// outbox (acks, presence) is stale once the user is offline, it is dropped.
+void RoomShard::StashOutbox(uint32 userId) {
+    if (userId >= m_Outboxes.size()) {
+        return;
+    }
+    std::vector<OfflineInbox::Entry>& chats = m_UnsentChats[userId];
+    std::stable_sort(chats.begin(), chats.end(), [](const OfflineInbox::Entry& a, const OfflineInbox::Entry& b) {
+        return a.sequence < b.sequence;
+    });
+    for (const OfflineInbox::Entry& entry : chats) {
+        m_Inbox.Store(userId, entry.sequence, entry.packet);
+    }
+    ClearOutbox(userId);
+}
+
+void RoomShard::SetChatLog(ChatLog* chatLog) { m_ChatLog = chatLog; }
+
+void RoomShard::SetSearchIndex(SearchIndex* searchIndex) { m_SearchIndex = searchIndex; }
+
+void RoomShard::Drain(std::chrono::steady_clock::time_point now) {
+    m_Now = now;
+    std::chrono::system_clock::duration sinceEpoch = std::chrono::system_clock::now().time_since_epoch();
+    m_NowMs = std::chrono::duration_cast<std::chrono::milliseconds>(sinceEpoch).count();
+
+    ResizeUserTables();
+
+    while (MpscNode* node = m_Mailbox.Pop()) {
+        RoomCommand* command = static_cast<RoomCommand*>(node);
+        m_Sequence = command->sequence;
+        switch (command->type) {
+            case MessageType::kJOIN_ROOM_REQ:
+                JoinRoom(*command);
+                break;
+            case MessageType::kLEAVE_ROOM_REQ:
+                LeaveRoom(*command);
+                break;
+            case MessageType::kCHAT_IN_ROOM_REQ:
+                ChatInRoom(*command);
+                break;
+            case MessageType::kLIST_MEMBERS_REQ:
+                ListMembers(*command);
+                break;
+            case MessageType::kDELETE_ROOM_REQ:
+                DeleteRoom(*command);
+                break;
+            case MessageType::kROOM_HISTORY_REQ:
+                RoomHistory(*command);
+                break;
+            case MessageType::kSEARCH_ROOM_REQ:
+                SearchRoom(*command);
+                break;
+            default:
+                break;
+        }
+        delete command;
+    }
+}
+
+// An empty room is freed, its version is kept in m_VersionFloor so a reallocated room does not reuse versions.
+// A room whose members are all offline is parked. A room with a member online keeps its state, only its change log
+// goes.
+void RoomShard::ReclaimIdleRooms(std::chrono::steady_clock::time_point now) {
+    size_t slot = m_ActiveRooms.size();
+    while (slot > 0) {
+        slot--;
+        ActiveRoom& active = m_ActiveRooms[slot];
+        long long idleMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - active.lastActive).count();
+        if (idleMs < kROOM_IDLE_TIMEOUT_MS) {
+            continue;
+        }
+        bool online = false;
+        for (uint32 memberId : active.room->Members()) {
+            if (m_UserSockets[memberId] != INVALID_SOCKET) {
+                online = true;
+                break;
+            }
+        }
+        if (active.room->Members().empty()) {
+            FreeRoom(static_cast<uint32>(slot));  // moves the last room into slot, which was already visited
+        } else if (!online) {
+            ParkRoom(static_cast<uint32>(slot));  // the same
+        } else {
+            active.room->DropChangeLog();
+            active.lastActive = now;
+        }
+    }
+}
+
+// [send] S2C_PresenceNtfMsg
+// one frame per room, encoded once per variant. A room freed or deleted since its changes has no members left.
+void RoomShard::FlushPresence() {
+    for (const PendingPresence& presence : m_Presence) {
+        uint32 slot = 0;
+        if (presence.changes.empty() || !m_ActiveSlots.Find(presence.roomId, slot)) {
+            continue;
+        }
+        const ChatRoom& room = *m_ActiveRooms[slot].room;
+
+        S2C_PresenceNtfMsg ntf{room.Id(), room.Version()};
+        for (const PendingPresence::Change& change : presence.changes) {
+            (change.joined ? ntf.joinedUserIds : ntf.leftUserIds).push_back(change.userId);
+        }
+        FillUserNames(ntf.joinedUserIds, ntf.joinedUserNames);
+        Broadcast(room, ntf, kINVALID_ID);
+    }
+    m_Presence.clear();
+    m_PresenceSlots.Clear();
+}
+
+bool RoomShard::HasPendingPresence() const { return !m_Presence.empty(); }
+
+size_t RoomShard::ActiveRoomCount() const { return m_ActiveRooms.size(); }
+
+size_t RoomShard::ParkedRoomCount() const { return m_ParkedRooms.size(); }
+
+const std::vector<uint32>& RoomShard::DeletedRooms() const { return m_DeletedRooms; }
+
+void RoomShard::ClearDeleted() { m_DeletedRooms.clear(); }
+
+const std::vector<uint32>& RoomShard::PendingUsers() const { return m_PendingUsers; }
+
+std::vector<RoomShard::SharedPacket>& RoomShard::Outbox(uint32 userId) { return m_Outboxes[userId]; }
+
+bool RoomShard::HasOutbox(uint32 userId) const { return userId < m_Outboxes.size() && !m_Outboxes[userId].empty(); }
+
+size_t RoomShard::OutboxBytes(uint32 userId) const { return m_OutboxBytes[userId]; }
+
+bool RoomShard::IsUrgent(uint32 userId) const { return m_UserUrgent[userId] != 0; }
+
+void RoomShard::ClearOutbox(uint32 userId) {
+    m_Outboxes[userId].clear();
+    m_OutboxBytes[userId] = 0;
+    m_UserUrgent[userId] = 0;
+    m_UnsentChats[userId].clear();
+}
+
+void RoomShard::ClearPending() {
+    for (uint32 userId : m_PendingUsers) {
+        m_UserPending[userId] = 0;
+    }
+    m_PendingUsers.clear();
+}
+
+// [send] S2C_JoinRoomAckMsg, the room history, and S2C_PresenceNtfMsg on the next tick
+// a client that sends a version still covered by the room's change log only gets the delta,
+// otherwise it gets the member count and the first page of members
+void RoomShard::JoinRoom(const RoomCommand& command) {
+    if (IsDeleted(command.roomId)) {
+        S2C_JoinRoomAckMsg ack{static_cast<uint16>(MessageStatus::kFAILURE), kINVALID_ID, command.roomName};
+        Deliver(command.userId, ack);
+        return;
+    }
+
+    ChatRoom* found = FindRoom(command.roomId);
+    ChatRoom& room = found != nullptr ? *found : AllocateRoom(command.roomId, command.roomName);
+    if (room.History().Capacity() != command.historyCapacity) {
+        m_HistoryBytes -= room.History().Bytes();
+        room.History().SetCapacity(command.historyCapacity);
+        m_HistoryBytes += room.History().Bytes();
+    }
+    bool joined = room.Join(command.userId);
+    printf("'%s' has joined #%s.\n", m_UserNames[command.userId].c_str(), room.Name().c_str());
+
+    S2C_JoinRoomAckMsg ack{static_cast<uint16>(MessageStatus::kSUCCESS), room.Id(), room.Name()};
+    ack.version = room.Version();
+    ack.memberCount = static_cast<uint32>(room.Members().size());
+    if (room.ChangesSince(command.knownVersion, ack.userIds, ack.leftUserIds)) {
+        ack.syncMode = MembershipSync::kSYNC_DELTA;
+    } else {
+        // only the first page, so the ack size does not depend on the room size
+        ack.syncMode = MembershipSync::kSYNC_SNAPSHOT;
+        ack.nextCursor = room.MembersPage(0, kMEMBER_PAGE_SIZE, ack.userIds);
+    }
+    FillUserNames(ack.userIds, ack.userNames);
+    Deliver(command.userId, ack);
+    ReplayHistory(command.userId, room.History());
+
+    if (joined) {
+        RecordPresence(room, command.userId, true);
+    }
+}
+
+// [send] S2C_LeaveRoomAckMsg, and S2C_PresenceNtfMsg on the next tick
+// a dormant room has no members, there is nothing to leave
+void RoomShard::LeaveRoom(const RoomCommand& command) {
+    if (IsDeleted(command.roomId)) {
+        Deliver(command.userId, S2C_LeaveRoomAckMsg{static_cast<uint16>(MessageStatus::kFAILURE), command.roomId});
+        return;
+    }
+
+    ChatRoom* room = FindRoom(command.roomId);
+    bool left = room != nullptr && room->Leave(command.userId);
+    printf("'%s' has left #%u.\n", m_UserNames[command.userId].c_str(), command.roomId);
+
+    Deliver(command.userId, S2C_LeaveRoomAckMsg{static_cast<uint16>(MessageStatus::kSUCCESS), command.roomId});
+
+    if (left) {
+        RecordPresence(*room, command.userId, false);
+    }
+}
+
+// [send] S2C_ChatInRoomAckMsg, S2C_ChatInRoomNtfMsg
+// only the members of a room may chat in it (a dormant room has none). The offline members get the chat in their
+// inbox. The chat is logged once the broadcast is queued.
+void RoomShard::ChatInRoom(const RoomCommand& command) {
+    ChatRoom* room = IsDeleted(command.roomId) ? nullptr : FindRoom(command.roomId);
+    if (room == nullptr || !room->IsMember(command.userId)) {
+        Deliver(command.userId, S2C_ChatInRoomAckMsg{static_cast<uint16>(MessageStatus::kFAILURE), command.roomId});
+        return;
+    }
+
+    printf("'%s' - #%u: %s.\n", m_UserNames[command.userId].c_str(), command.roomId, command.chat.c_str());
+
+    Deliver(command.userId, S2C_ChatInRoomAckMsg{static_cast<uint16>(MessageStatus::kSUCCESS), command.roomId});
+
+    // the history keeps the plain fixed-format packet, every client can read it
+    SharedPacket packets[kPACKET_VARIANTS];
+    S2C_ChatInRoomNtfMsg ntf{room->Id(), command.userId, command.chat};
+    packets[0] = Encode(ntf, 0);
+    Broadcast(*room, ntf, kINVALID_ID, packets, true);
+    AppendHistory(*room, packets[0]);
+
+    if (m_ChatLog != nullptr) {
+        uint64 sequence = m_ChatLog->Append(m_NowMs, command.roomId, command.userId, command.chat);
+        if (sequence != 0 && m_SearchIndex != nullptr) {
+            m_SearchIndex->Add(command.roomId, sequence, command.chat, m_NowMs);
+        }
+    }
+}
+
+// [send] S2C_ListMembersAckMsg
+// only the members of a room may list it
+void RoomShard::ListMembers(const RoomCommand& command) {
+    const ChatRoom* found = FindRoom(command.roomId);
+    if (found == nullptr || !found->IsMember(command.userId)) {
+        Deliver(command.userId, S2C_ListMembersAckMsg{static_cast<uint16>(MessageStatus::kFAILURE), command.roomId});
+        return;
+    }
+    const ChatRoom& room = *found;
+
+    S2C_ListMembersAckMsg ack{static_cast<uint16>(MessageStatus::kSUCCESS), room.Id()};
+    ack.version = room.Version();
+    ack.memberCount = static_cast<uint32>(room.Members().size());
+    ack.nextCursor = room.MembersPage(command.cursor, command.pageSize, ack.userIds);
+    FillUserNames(ack.userIds, ack.userNames);
+    Deliver(command.userId, ack);
+}
+
+// [send] S2C_DeleteRoomAckMsg
+// only an empty room can be deleted (a parked room has members), the RunLoop thread drops its name from the registry
+// after the drain
+void RoomShard::DeleteRoom(const RoomCommand& command) {
+    uint32 slot = 0;
+    bool active = m_ActiveSlots.Find(command.roomId, slot);
+    if (IsDeleted(command.roomId) || m_ParkedSlots.Contains(command.roomId) ||
+        (active && !m_ActiveRooms[slot].room->Members().empty())) {
+        Deliver(command.userId, S2C_DeleteRoomAckMsg{static_cast<uint16>(MessageStatus::kFAILURE), command.roomId});
+        return;
+    }
+
+    if (active) {
+        FreeRoom(slot);
+    }
+    m_DeletedRooms.push_back(command.roomId);
+    printf("'%s' has deleted #%u.\n", m_UserNames[command.userId].c_str(), command.roomId);
+
+    Deliver(command.userId, S2C_DeleteRoomAckMsg{static_cast<uint16>(MessageStatus::kSUCCESS), command.roomId});
+}
+
+// [send] S2C_RoomHistoryAckMsg
+// only the members of a room may read its history. The page is one lookup in the log's index and a short read,
+// the records go to the client as they are stored.
+void RoomShard::RoomHistory(const RoomCommand& command) {
+    const ChatRoom* room = FindRoom(command.roomId);
+    if (m_ChatLog == nullptr || room == nullptr || !room->IsMember(command.userId)) {
+        Deliver(command.userId, S2C_RoomHistoryAckMsg{static_cast<uint16>(MessageStatus::kFAILURE), command.roomId});
+        return;
+    }
+
+    // the ids in the records of the previous runs are still ours, ChatServer keeps them in its Registry
+    S2C_RoomHistoryAckMsg ack{static_cast<uint16>(MessageStatus::kSUCCESS), room->Id()};
+    ack.nextBeforeSequence = m_ChatLog->Read(command.history, ack.records, ack.recordCount);
+    FillAuthors(ack.records, ack.userIds);
+    FillUserNames(ack.userIds, ack.userNames);
+    Deliver(command.userId, ack);
+}
+
+// [send] S2C_SearchRoomAckMsg
+// only the members of a room may search it. The index gives the sequences of the hits, newest first, each record
+// is then one lookup in the log.
+void RoomShard::SearchRoom(const RoomCommand& command) {
+    const ChatRoom* room = FindRoom(command.roomId);
+    if (m_ChatLog == nullptr || m_SearchIndex == nullptr || room == nullptr || !room->IsMember(command.userId)) {
+        Deliver(command.userId, S2C_SearchRoomAckMsg{static_cast<uint16>(MessageStatus::kFAILURE), command.roomId});
+        return;
+    }
+
+    const ChatLogQuery& query = command.history;
+    std::vector<uint64> sequences;
+    uint64 next =
+        m_SearchIndex->Search(room->Id(), command.searchText, query.beforeSequence, query.maxCount, sequences);
+
+    // read newest first, so a page cut by size still ends at the newest hits
+    std::vector<std::string> records(sequences.size());
+    size_t count = 0;
+    size_t bytes = 0;
+    for (; count < sequences.size() && (count == 0 || bytes < query.maxBytes); count++) {
+        m_ChatLog->ReadRecord(sequences[count], records[count]);
+        bytes += records[count].size();
+    }
+    if (count < sequences.size()) {
+        next = sequences[count - 1];
+    }
+
+    S2C_SearchRoomAckMsg ack{static_cast<uint16>(MessageStatus::kSUCCESS), room->Id()};
+    for (size_t i = count; i > 0; i--) {
+        ack.records += records[i - 1];
+        ack.recordCount += records[i - 1].empty() ? 0 : 1;
+    }
+    ack.nextBeforeSequence = next;
+    FillAuthors(ack.records, ack.userIds);
+    FillUserNames(ack.userIds, ack.userNames);
+    Deliver(command.userId, ack);
+}
+
+ChatRoom* RoomShard::FindRoom(uint32 roomId) {
+    uint32 slot = 0;
+    if (!m_ActiveSlots.Find(roomId, slot)) {
+        return UnparkRoom(roomId);
+    }
+    m_ActiveRooms[slot].lastActive = m_Now;
+    return m_ActiveRooms[slot].room.get();
+}
+
+ChatRoom& RoomShard::AllocateRoom(uint32 roomId, const std::string& roomName) {
+    m_ActiveSlots.Insert(roomId, static_cast<uint32>(m_ActiveRooms.size()));
+    ActiveRoom active;
+    active.room.reset(new ChatRoom(roomId, roomName, m_VersionFloor, 0));  // the join sets the history capacity
+    active.lastActive = m_Now;
+    m_ActiveRooms.push_back(std::move(active));
+    return *m_ActiveRooms.back().room;
+}
+
+// swap-remove, like ChatRoom::Leave
+void RoomShard::FreeRoom(uint32 slot) {
+    uint32 roomId = m_ActiveRooms[slot].room->Id();
+    uint32 version = m_ActiveRooms[slot].room->Version();
+    m_VersionFloor = version > m_VersionFloor ? version : m_VersionFloor;
+    m_HistoryBytes -= m_ActiveRooms[slot].room->History().Bytes();
+
+    if (slot + 1 < m_ActiveRooms.size()) {
+        m_ActiveRooms[slot] = std::move(m_ActiveRooms.back());
+        m_ActiveSlots.Insert(m_ActiveRooms[slot].room->Id(), slot);
+    }
+    m_ActiveRooms.pop_back();
+    m_ActiveSlots.Erase(roomId);
+}
+
+// The members are kept sorted, so the room is rebuilt with its member index in one pass. The history goes, the
+// chat log still has it.
+void RoomShard::ParkRoom(uint32 slot) {
+    const ChatRoom& room = *m_ActiveRooms[slot].room;
+    ParkedRoom parked;
+    parked.roomId = room.Id();
+    parked.name = room.Name();
+    parked.version = room.Version();
+    parked.historyCapacity = room.History().Capacity();
+    room.SortedMembers(parked.members);
+
+    m_ParkedSlots.Insert(parked.roomId, static_cast<uint32>(m_ParkedRooms.size()));
+    m_ParkedRooms.push_back(std::move(parked));
+    FreeRoom(slot);
+}
+
+ChatRoom* RoomShard::UnparkRoom(uint32 roomId) {
+    uint32 slot = 0;
+    if (!m_ParkedSlots.Find(roomId, slot)) {
+        return nullptr;
+    }
+    ParkedRoom& parked = m_ParkedRooms[slot];
+
+    m_ActiveSlots.Insert(roomId, static_cast<uint32>(m_ActiveRooms.size()));
+    ActiveRoom active;
+    active.room.reset(new ChatRoom(roomId, parked.name, parked.version, parked.historyCapacity));
+    active.room->RestoreMembers(parked.members);
+    active.lastActive = m_Now;
+    m_ActiveRooms.push_back(std::move(active));
+
+    // swap-remove, like FreeRoom
+    if (slot + 1 < m_ParkedRooms.size()) {
+        m_ParkedRooms[slot] = std::move(m_ParkedRooms.back());
+        m_ParkedSlots.Insert(m_ParkedRooms[slot].roomId, slot);
+    }
+    m_ParkedRooms.pop_back();
+    m_ParkedSlots.Erase(roomId);
+    return m_ActiveRooms.back().room.get();
+}
+
+// only the rooms deleted during this drain can still get requests, the registry drops the others before posting
+bool RoomShard::IsDeleted(uint32 roomId) const {
+    for (uint32 deletedId : m_DeletedRooms) {
+        if (deletedId == roomId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void RoomShard::ReplayHistory(uint32 userId, const MessageHistory& history) {
+    if (history.Count() == 0 || m_UserSockets[userId] == INVALID_SOCKET) {
+        return;
+    }
+    m_ReplayPackets.clear();
+    for (size_t i = 0; i < history.Count(); i++) {
+        m_ReplayPackets.push_back(history.At(i));
+    }
+    EnqueueBatched(userId, m_ReplayPackets, FrameReader::kMAX_PACKET_SIZE);
+    m_ReplayPackets.clear();
+}
+
+// A client that negotiated kFEATURE_BATCH gets the packets in kBATCH packets, each made of a header and the
+// shared packets, so nothing is copied. A client that also negotiated kFEATURE_COMPRESSION gets each batch
+// compressed as a whole instead, which shrinks the runs of similar chats much more than one packet at a time.
+// Either way the packets go out with the rest of the outbox in one WSASend.
+void RoomShard::EnqueueBatched(uint32 userId, const std::vector<SharedPacket>& packets, size_t maxBatchSize) {
+    uint32 variant = m_UserPacketVariants[userId];
+    if (!(variant & kVARIANT_BATCH)) {
+        for (const SharedPacket& packet : packets) {
+            Enqueue(userId, packet);
+        }
+        return;
+    }
+
+    size_t begin = 0;
+    while (begin < packets.size()) {
+        // a batch must fit in a packet
+        size_t batchSize = sizeof(PacketHeader);
+        size_t end = begin;
+        while (end < packets.size() && batchSize + packets[end]->size() <= maxBatchSize) {
+            batchSize += packets[end]->size();
+            end++;
+        }
+        if (end == begin) {  // too large to be nested, send it alone
+            Enqueue(userId, packets[begin]);
+            begin++;
+            continue;
+        }
+
+        uint32 header[2] = {HostToLE32(static_cast<uint32>(batchSize)),
+                            HostToLE32(static_cast<uint32>(MessageType::kBATCH))};
+        uint32 compressedSize = 0;
+        if (variant & kVARIANT_COMPRESSED) {
+            m_SendBuf.Reset();
+            m_SendBuf.Append(header, sizeof(header));
+            for (size_t i = begin; i < end; i++) {
+                m_SendBuf.Append(packets[i]->data(), packets[i]->size());
+            }
+            compressedSize = CompressPacket(m_SendBuf.ConstData(), static_cast<uint32>(batchSize), m_CompressBuf);
+        }
+
+        if (compressedSize > 0) {
+            Enqueue(userId, std::make_shared<const std::string>(m_CompressBuf.ConstData(), compressedSize));
+        } else {
+            Enqueue(userId,
+                    std::make_shared<const std::string>(reinterpret_cast<const char*>(header), sizeof(header)));
+            for (size_t i = begin; i < end; i++) {
+                Enqueue(userId, packets[i]);
+            }
+        }
+        begin = end;
+    }
+}
+
+void RoomShard::AppendHistory(ChatRoom& room, const SharedPacket& packet) {
+    MessageHistory& history = room.History();
+    m_HistoryBytes -= history.Bytes();
+    history.Append(packet);
+    m_HistoryBytes += history.Bytes();
+    EnforceHistoryBudget();
+}
+
+// The clock hand walks the active rooms and drops the oldest chat of each, so the rooms share the budget
+// instead of the busiest one losing all of its history.
+void RoomShard::EnforceHistoryBudget() {
+    while (m_HistoryBytes > m_HistoryBudget && !m_ActiveRooms.empty()) {
+        if (m_HistoryHand >= m_ActiveRooms.size()) {
+            m_HistoryHand = 0;
+        }
+        m_HistoryBytes -= m_ActiveRooms[m_HistoryHand].room->History().DropOldest();
+        m_HistoryHand++;
+    }
+}
+
+// A join and a leave of the same user cancel out, unless another user joined in between: its ack showed the
+// members of that time, so the change that followed must reach it. The latest change is kept then, notifying it
+// again to the members who already know it is harmless.
+void RoomShard::RecordPresence(const ChatRoom& room, uint32 userId, bool joined) {
+    uint32 index = 0;
+    if (!m_PresenceSlots.Find(room.Id(), index)) {
+        index = static_cast<uint32>(m_Presence.size());
+        m_PresenceSlots.Insert(room.Id(), index);
+        m_Presence.emplace_back();
+        m_Presence.back().roomId = room.Id();
+    }
+    PendingPresence& presence = m_Presence[index];
+
+    uint32 slot = 0;
+    if (!presence.slots.Find(userId, slot)) {
+        presence.slots.Insert(userId, static_cast<uint32>(presence.changes.size()));
+        presence.changes.push_back(PendingPresence::Change{userId, room.Version(), joined});
+    } else if (presence.lastJoinVersion <= presence.changes[slot].version) {
+        // swap-remove, like ChatRoom::Leave
+        uint32 lastUserId = presence.changes.back().userId;
+        presence.changes[slot] = presence.changes.back();
+        presence.slots.Insert(lastUserId, slot);
+        presence.changes.pop_back();
+        presence.slots.Erase(userId);
+    } else {
+        presence.changes[slot].version = room.Version();
+        presence.changes[slot].joined = joined;
+    }
+
+    if (joined) {
+        presence.lastJoinVersion = room.Version();
+    }
+}
+
+template <typename Msg>
+void RoomShard::Deliver(uint32 userId, const Msg& msg) {
+    if (m_UserSockets[userId] == INVALID_SOCKET) {
+        return;
+    }
+    Enqueue(userId, Encode(msg, m_UserPacketVariants[userId]));
+    m_UserUrgent[userId] = 1;
+}
+
+// The packet is encoded (and compressed) at most once per variant, each recipient only gets a reference to it.
+template <typename Msg>
+void RoomShard::Broadcast(const ChatRoom& room, const Msg& msg, uint32 skipUserId) {
+    SharedPacket packets[kPACKET_VARIANTS];
+    Broadcast(room, msg, skipUserId, packets, false);
+}
+
+// packets holds the variants already encoded, the missing ones are filled in. With keepOffline, the offline members
+// get the plain packets[0] in their inbox, any client can read it on login.
+template <typename Msg>
+void RoomShard::Broadcast(const ChatRoom& room, const Msg& msg, uint32 skipUserId, SharedPacket* packets,
+                          bool keepOffline) {
+    for (uint32 memberId : room.Members()) {
+        if (memberId == skipUserId) {
+            continue;
+        }
+        if (m_UserSockets[memberId] == INVALID_SOCKET) {
+            if (keepOffline) {
+                if (!packets[0]) {
+                    packets[0] = Encode(msg, 0);
+                }
+                m_Inbox.Store(memberId, m_Sequence, packets[0]);
+            }
+            continue;
+        }
+
+        uint32 variant = m_UserPacketVariants[memberId] & kVARIANT_ENCODING_MASK;
+        SharedPacket& packet = packets[variant];
+        if (!packet) {
+            packet = Encode(msg, variant);
+        }
+        Enqueue(memberId, packet);
+
+        if (keepOffline && m_HoldOutboxes) {
+            if (!packets[0]) {
+                packets[0] = Encode(msg, 0);
+            }
+            m_UnsentChats[memberId].push_back(OfflineInbox::Entry{m_Sequence, packets[0]});
+        }
+    }
+}
+
+template <typename Msg>
+RoomShard::SharedPacket RoomShard::Encode(const Msg& msg, uint32 variant) {
+    bool compact = (variant & kVARIANT_COMPACT) != 0;
+    bool compress = (variant & kVARIANT_COMPRESSED) != 0;
+    uint32 packetSize = Serialize(msg, m_SendBuf, compact ? WireFormat::kCOMPACT : WireFormat::kFIXED);
+    uint32 compressedSize = compress ? CompressPacket(m_SendBuf.ConstData(), packetSize, m_CompressBuf) : 0;
+    if (compressedSize > 0) {
+        return std::make_shared<const std::string>(m_CompressBuf.ConstData(), compressedSize);
+    }
+    return std::make_shared<const std::string>(m_SendBuf.ConstData(), packetSize);
+}
+
+void RoomShard::Enqueue(uint32 userId, const SharedPacket& packet) {
+    if (!m_UserPending[userId]) {
+        m_UserPending[userId] = 1;
+        m_PendingUsers.push_back(userId);
+    }
+    m_Outboxes[userId].push_back(packet);
+    m_OutboxBytes[userId] += packet->size();
+}
+
+// users may have been interned since the last drain
+void RoomShard::ResizeUserTables() {
+    if (m_Outboxes.size() < m_UserNames.size()) {
+        m_Outboxes.resize(m_UserNames.size());
+        m_OutboxBytes.resize(m_UserNames.size(), 0);
+        m_UserUrgent.resize(m_UserNames.size(), 0);
+        m_UserPending.resize(m_UserNames.size(), 0);
+        m_UnsentChats.resize(m_UserNames.size());
+    }
+}
+
+// the authors of chat log records, each listed once
+void RoomShard::FillAuthors(const std::string& records, std::vector<uint32>& outUserIds) const {
+    for (size_t offset = 0; offset < records.size();) {
+        ChatLogRecordHeader header;
+        memcpy(&header, records.data() + offset, sizeof(header));
+        uint32 userId = HostToLE32(header.userId);
+        if (std::find(outUserIds.begin(), outUserIds.end(), userId) == outUserIds.end()) {
+            outUserIds.push_back(userId);
+        }
+        offset += HostToLE32(header.recordSize);
+    }
+}
+
+void RoomShard::FillUserNames(const std::vector<uint32>& userIds, std::vector<std::string>& outUserNames) const {
+    outUserNames.clear();
+    outUserNames.reserve(userIds.size());
+    for (uint32 userId : userIds) {
+        // a log record may name a user the registry lost
+        outUserNames.push_back(userId < m_UserNames.size() ? m_UserNames[userId] : std::string());
+    }
+}
@@ -0,0 +1,274 @@
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <WinSock2.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "buffer.h"
+#include "chat_log.h"
+#include "chat_room.h"
+#include "id_table.h"
+#include "message.h"
+#include "mpsc_queue.h"
+#include "offline_inbox.h"
+#include "search_index.h"
+
+// A room request, posted by the RunLoop thread to the mailbox of the shard that owns the room
+struct RoomCommand : MpscNode {
+    network::MessageType type;  // one of the requests RoomShard::Drain runs
+    uint64 sequence = 0;        // the order ChatServer posted it in, stamps the chats kept for offline members
+    uint32 roomId = network::kINVALID_ID;
+    uint32 userId = network::kINVALID_ID;  // the requester, it gets the ack
+    std::string roomName;                  // kJOIN_ROOM_REQ, the room state may have to be allocated
+    uint32 historyCapacity = 0;            // kJOIN_ROOM_REQ
+    uint32 knownVersion = 0;               // kJOIN_ROOM_REQ
+    uint32 cursor = 0;                     // kLIST_MEMBERS_REQ
+    uint32 pageSize = 0;                   // kLIST_MEMBERS_REQ
+    std::string chat;                      // kCHAT_IN_ROOM_REQ
+    ChatLogQuery history;                  // kROOM_HISTORY_REQ, the range and the page size, kSEARCH_ROOM_REQ
+    std::string searchText;                // kSEARCH_ROOM_REQ
+};
+
+// The membership changes of a room since the last presence tick, net of the pairs that cancel out
+struct PendingPresence {
+    struct Change {
+        uint32 userId;
+        uint32 version;  // the room version the change made
+        bool joined;
+    };
+
+    uint32 roomId = network::kINVALID_ID;
+    std::vector<Change> changes;
+    IdTable slots;               // userId -> index in changes
+    uint32 lastJoinVersion = 0;  // the version of the last join, whose ack showed the members of that time
+};
+
+// The owner of a subset of the rooms (roomId % shard count).
+// Room requests are posted to its lock-free mailbox; Drain runs them in order on the thread that owns the shard,
+// which mutates the rooms and encodes the acks and notifications with no locking. The packets are queued in
+// the shard's per-user outboxes, ChatServer sends them.
+// The user tables belong to the RunLoop thread, a shard only reads them while the RunLoop thread waits for it.
+// The RunLoop thread owns the room registry (names and ids). A shard only holds the state of its active rooms:
+// it is allocated on the first join and reclaimed once the room is idle with no member online. An empty room costs
+// nothing then, one whose members are all offline is parked as its sorted member ids until its next request, so
+// memory tracks the active rooms and not every room anyone ever joined.
+// Joins and leaves are not notified one by one: they are accumulated per room and the members get one
+// S2C_PresenceNtfMsg per room and presence tick, so a mass reconnect costs a frame per member and tick, not per change.
+// The chats broadcast while a member is offline wait in the shard's inbox until the member logs in again, with the
+// direct messages sent to the offline users of the shard (userId % shard count). ChatServer merges the inboxes a
+// user has in every shard by sequence on login.
+class RoomShard {
+public:
+    // an encoded packet shared by all the outboxes it was queued in
+    typedef std::shared_ptr<const std::string> SharedPacket;
+
+    // the encodings a client can get: fixed/compact x plain/compressed, a broadcast is encoded once per variant
+    static constexpr uint32 kVARIANT_COMPACT = 1 << 0;
+    static constexpr uint32 kVARIANT_COMPRESSED = 1 << 1;
+    static constexpr uint32 kPACKET_VARIANTS = 4;
+    static constexpr uint32 kVARIANT_ENCODING_MASK = kVARIANT_COMPACT | kVARIANT_COMPRESSED;
+    static constexpr uint32 kVARIANT_BATCH = 1 << 2;  // not an encoding, the client unpacks kBATCH packets
+
+    // member lists are sent in pages, the join ack only carries the first one
+    static constexpr uint32 kMEMBER_PAGE_SIZE = 100;
+    static constexpr uint32 kMAX_MEMBER_PAGE_SIZE = 1000;
+
+    // how often the membership changes are notified by default
+    static constexpr uint32 kPRESENCE_TICK_MS = 100;
+
+    // how long a room goes without requests before its state is reclaimed (or its change log, if a member is online)
+    static constexpr long long kROOM_IDLE_TIMEOUT_MS = 60 * 1000;
+
+    // how many chats a room keeps for the users who join, and how much memory the histories of a shard may use
+    static constexpr uint32 kHISTORY_CAPACITY = 50;
+    static constexpr uint32 kMAX_HISTORY_CAPACITY = 1000;
+    static constexpr size_t kHISTORY_BUDGET = 16 * 1024 * 1024;
+
+    // older chats are read from the chat log in pages, bounded by count and by size
+    static constexpr uint32 kLOG_PAGE_SIZE = 100;
+    static constexpr uint32 kMAX_LOG_PAGE_SIZE = 1000;
+    static constexpr size_t kMAX_LOG_PAGE_BYTES = 1024 * 1024;
+
+    // the chats kept for an offline member, per user (in the rooms of this shard) and for all of them, and the size
+    // of the kBATCH packets they are sent in on login
+    static constexpr uint32 kINBOX_CAPACITY = 1000;
+    static constexpr size_t kINBOX_USER_BYTES = 256 * 1024;
+    static constexpr size_t kINBOX_BUDGET = 64 * 1024 * 1024;
+    static constexpr size_t kINBOX_BATCH_BYTES = 64 * 1024;
+
+    RoomShard(const std::vector<std::string>& userNames, const std::vector<SOCKET>& userSockets,
+              const std::vector<uint8>& userPacketVariants);
+    ~RoomShard();
+
+    // Post a request to the mailbox, the shard takes ownership of command. Any thread.
+    void Post(RoomCommand* command);
+
+    // The history memory budget of this shard. Not while the shard runs.
+    void SetHistoryBudget(size_t bytes);
+
+    // The caps of the offline inbox, see OfflineInbox. Not while the shard runs.
+    void SetInboxCapacity(uint32 capacity, size_t maxBytes, size_t budget);
+
+    // Keep a packet for an offline user / take the packets kept for a user, see OfflineInbox. Not while the shard runs.
+    void StoreInbox(uint32 userId, uint64 sequence, const SharedPacket& packet);
+    uint32 TakeInbox(uint32 userId, std::vector<OfflineInbox::Entry>& outEntries);
+
+    // Queue the chats a user missed while offline, in kBATCH packets if its client takes them. The RunLoop thread
+    // calls it on login with the entries of every shard. Not while the shard runs.
+    void EnqueueInbox(uint32 userId, const std::vector<OfflineInbox::Entry>& entries);
+
+    // Whether the outboxes may be held across loop iterations (see ChatServer::SetOutboundBatching). Then the plain
+    // packets of the chats in them are kept too, so that StashOutbox can move them to the inbox of a user who went
+    // offline before they were sent. Not while the shard runs.
+    void SetHoldOutboxes(bool hold);
+    void StashOutbox(uint32 userId);
+
+    // The log partition the chats of this shard's rooms are appended to (none by default). Not while the shard runs.
+    void SetChatLog(ChatLog* chatLog);
+
+    // The index the logged chats are added to (none by default). Not while the shard runs.
+    void SetSearchIndex(SearchIndex* searchIndex);
+
+    // Run every posted request, now is the time of the loop iteration. Owner thread only.
+    void Drain(std::chrono::steady_clock::time_point now);
+
+    // Notify the members of the rooms whose membership changed since the last call. Owner thread only.
+    void FlushPresence();
+    bool HasPendingPresence() const;
+
+    // Reclaim the state of the rooms idle for kROOM_IDLE_TIMEOUT_MS. Owner thread only.
+    void ReclaimIdleRooms(std::chrono::steady_clock::time_point now);
+
+    // the rooms with allocated state / parked as their member ids
+    size_t ActiveRoomCount() const;
+    size_t ParkedRoomCount() const;
+
+    // the rooms deleted since the last ClearDeleted, the RunLoop thread drops them from the registry
+    const std::vector<uint32>& DeletedRooms() const;
+    void ClearDeleted();
+
+    // the users with queued packets, each listed once
+    const std::vector<uint32>& PendingUsers() const;
+    std::vector<SharedPacket>& Outbox(uint32 userId);
+
+    // whether packets are queued for a user, which may have been interned since the last drain
+    bool HasOutbox(uint32 userId) const;
+
+    // the size of a user's outbox, and whether it holds a reply to one of its requests (which should not wait)
+    size_t OutboxBytes(uint32 userId) const;
+    bool IsUrgent(uint32 userId) const;
+
+    // empty a user's outbox once it was sent
+    void ClearOutbox(uint32 userId);
+
+    // forget the pending users once their outboxes were sent
+    void ClearPending();
+
+private:
+    void JoinRoom(const RoomCommand& command);
+    void LeaveRoom(const RoomCommand& command);
+    void ChatInRoom(const RoomCommand& command);
+    void ListMembers(const RoomCommand& command);
+    void DeleteRoom(const RoomCommand& command);
+    void RoomHistory(const RoomCommand& command);
+    void SearchRoom(const RoomCommand& command);
+
+    // the state of a room (nullptr if dormant), marks the room as active and rebuilds it if it was parked
+    ChatRoom* FindRoom(uint32 roomId);
+    ChatRoom& AllocateRoom(uint32 roomId, const std::string& roomName);
+    void FreeRoom(uint32 slot);
+    void ParkRoom(uint32 slot);
+    ChatRoom* UnparkRoom(uint32 roomId);
+    bool IsDeleted(uint32 roomId) const;
+
+    // queue packets for a user, in kBATCH packets of up to maxBatchSize bytes if its client takes them
+    void EnqueueBatched(uint32 userId, const std::vector<SharedPacket>& packets, size_t maxBatchSize);
+
+    // queue a room's history after the join ack / drop the oldest chats until the histories fit the budget
+    void ReplayHistory(uint32 userId, const MessageHistory& history);
+    void AppendHistory(ChatRoom& room, const SharedPacket& packet);
+    void EnforceHistoryBudget();
+
+    // remember a membership change for the next presence tick
+    void RecordPresence(const ChatRoom& room, uint32 userId, bool joined);
+
+    // encode msg for one user (a reply, sent without delay) / for the online members of a room but skipUserId, the
+    // offline ones may get packets[0] in their inbox
+    template <typename Msg>
+    void Deliver(uint32 userId, const Msg& msg);
+    template <typename Msg>
+    void Broadcast(const ChatRoom& room, const Msg& msg, uint32 skipUserId);
+    template <typename Msg>
+    void Broadcast(const ChatRoom& room, const Msg& msg, uint32 skipUserId, SharedPacket* packets, bool keepOffline);
+    template <typename Msg>
+    SharedPacket Encode(const Msg& msg, uint32 variant);
+
+    void Enqueue(uint32 userId, const SharedPacket& packet);
+    void ResizeUserTables();
+    void FillUserNames(const std::vector<uint32>& userIds, std::vector<std::string>& outUserNames) const;
+    void FillAuthors(const std::string& records, std::vector<uint32>& outUserIds) const;
+
+private:
+    MpscQueue m_Mailbox;
+
+    // shared with ChatServer, see the class comment
+    const std::vector<std::string>& m_UserNames;
+    const std::vector<SOCKET>& m_UserSockets;
+    const std::vector<uint8>& m_UserPacketVariants;
+
+    // the rooms with allocated state
+    struct ActiveRoom {
+        std::unique_ptr<ChatRoom> room;
+        std::chrono::steady_clock::time_point lastActive;  // the last request for the room
+    };
+    std::vector<ActiveRoom> m_ActiveRooms;  // dense, so a sweep is a linear scan
+    IdTable m_ActiveSlots;                  // roomId -> index in m_ActiveRooms
+    uint32 m_VersionFloor;                  // the highest version of a reclaimed room, reallocated rooms start there
+    std::vector<uint32> m_DeletedRooms;     // see DeletedRooms
+
+    // the idle rooms whose members are all offline, without their history and change log
+    struct ParkedRoom {
+        uint32 roomId;
+        std::string name;
+        uint32 version;  // the room is rebuilt at it, so the versions its members know are still valid
+        uint32 historyCapacity;
+        std::vector<uint32> members;  // sorted
+    };
+    std::vector<ParkedRoom> m_ParkedRooms;
+    IdTable m_ParkedSlots;  // roomId -> index in m_ParkedRooms
+
+    // the rooms whose membership changed since the last presence tick
+    std::vector<PendingPresence> m_Presence;
+    IdTable m_PresenceSlots;  // roomId -> index in m_Presence
+
+    // the bytes held by the histories of the active rooms, the clock hand picks the next room to trim
+    size_t m_HistoryBytes;
+    size_t m_HistoryBudget;
+    size_t m_HistoryHand;
+
+    std::chrono::steady_clock::time_point m_Now;  // the time of the current drain
+    uint64 m_NowMs;                               // the same in wall clock milliseconds, for the chat log
+    uint64 m_Sequence;                            // the sequence of the request being run
+
+    ChatLog* m_ChatLog;
+    SearchIndex* m_SearchIndex;
+
+    OfflineInbox m_Inbox;
+    std::vector<SharedPacket> m_ReplayPackets;  // scratch space of EnqueueBatched's callers
+
+    network::Buffer m_SendBuf;
+    network::Buffer m_CompressBuf;
+
+    std::vector<std::vector<SharedPacket>> m_Outboxes;  // userId -> packets not sent yet
+    std::vector<size_t> m_OutboxBytes;                  // userId -> the size of its outbox
+    std::vector<uint8> m_UserUrgent;                    // userId -> 1 if its outbox holds an ack
+    std::vector<uint8> m_UserPending;                   // userId -> 1 if listed in m_PendingUsers
+    std::vector<uint32> m_PendingUsers;
+
+    bool m_HoldOutboxes;
+    std::vector<std::vector<OfflineInbox::Entry>> m_UnsentChats;  // userId -> the chats in its outbox, see StashOutbox
+};
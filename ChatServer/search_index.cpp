@@ -0,0 +1,454 @@
+#include "search_index.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+#include "byte_order.h"
+
+// a list this many times shorter than the other one is looked up in it instead of merged with it
+static constexpr size_t kGALLOP_RATIO = 32;
+
+static void EncodeList(const uint32* docs, size_t count, std::string& out) {
+    uint32 previous = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32 delta = docs[i] - previous;
+        previous = docs[i];
+        while (delta >= 0x80) {
+            out.push_back(static_cast<char>((delta & 0x7F) | 0x80));
+            delta >>= 7;
+        }
+        out.push_back(static_cast<char>(delta));
+    }
+}
+
+static void DecodeList(const SearchSegment& segment, size_t key, std::vector<uint32>& outDocs) {
+    outDocs.resize(segment.counts[key]);
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(segment.postings.data()) + segment.offsets[key];
+    uint32 doc = 0;
+    for (uint32& outDoc : outDocs) {
+        uint32 delta = 0;
+        for (uint32 shift = 0;; shift += 7) {
+            delta |= static_cast<uint32>(*p & 0x7F) << shift;
+            if ((*p++ & 0x80) == 0) {
+                break;
+            }
+        }
+        doc += delta;
+        outDoc = doc;
+    }
+}
+
+// the encoded bytes of a list, which start with an absolute doc so they can be copied as they are
+static void CopyList(const SearchSegment& segment, size_t key, std::string& out) {
+    size_t end = key + 1 < segment.offsets.size() ? segment.offsets[key + 1] : segment.postings.size();
+    out.append(segment.postings, segment.offsets[key], end - segment.offsets[key]);
+}
+
+static std::shared_ptr<const SearchSegment> BuildSegment(const SearchMemtable& memtable) {
+    typedef std::unordered_map<std::string, std::vector<uint32>>::const_iterator ListIterator;
+    std::vector<ListIterator> lists;
+    lists.reserve(memtable.lists.size());
+    for (ListIterator it = memtable.lists.begin(); it != memtable.lists.end(); ++it) {
+        lists.push_back(it);
+    }
+    std::sort(lists.begin(), lists.end(), [](ListIterator a, ListIterator b) { return a->first < b->first; });
+
+    std::shared_ptr<SearchSegment> segment(new SearchSegment);
+    segment->keys.reserve(lists.size());
+    segment->counts.reserve(lists.size());
+    segment->offsets.reserve(lists.size());
+    for (ListIterator it : lists) {
+        segment->keys.push_back(it->first);
+        segment->counts.push_back(static_cast<uint32>(it->second.size()));
+        segment->offsets.push_back(segment->postings.size());
+        EncodeList(it->second.data(), it->second.size(), segment->postings);
+    }
+    segment->postingCount = memtable.postingCount;
+    segment->firstDoc = memtable.firstDoc;
+    return segment;
+}
+
+// A merge of neighbours: every doc of older is below every doc of newer, so a list of both is the older one
+// followed by the newer one.
+static std::shared_ptr<const SearchSegment> MergeSegments(const SearchSegment& older, const SearchSegment& newer) {
+    std::shared_ptr<SearchSegment> merged(new SearchSegment);
+    std::vector<uint32> olderDocs;
+    std::vector<uint32> newerDocs;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < older.keys.size() || j < newer.keys.size()) {
+        bool fromOlder = j == newer.keys.size() || (i < older.keys.size() && older.keys[i] <= newer.keys[j]);
+        bool fromNewer = i == older.keys.size() || (j < newer.keys.size() && newer.keys[j] <= older.keys[i]);
+        merged->keys.push_back(fromOlder ? older.keys[i] : newer.keys[j]);
+        merged->offsets.push_back(merged->postings.size());
+        if (fromOlder && fromNewer) {
+            DecodeList(older, i, olderDocs);
+            DecodeList(newer, j, newerDocs);
+            olderDocs.insert(olderDocs.end(), newerDocs.begin(), newerDocs.end());
+            EncodeList(olderDocs.data(), olderDocs.size(), merged->postings);
+            merged->counts.push_back(static_cast<uint32>(olderDocs.size()));
+        } else if (fromOlder) {
+            CopyList(older, i, merged->postings);
+            merged->counts.push_back(older.counts[i]);
+        } else {
+            CopyList(newer, j, merged->postings);
+            merged->counts.push_back(newer.counts[j]);
+        }
+        i += fromOlder ? 1 : 0;
+        j += fromNewer ? 1 : 0;
+    }
+    merged->postingCount = older.postingCount + newer.postingCount;
+    merged->firstDoc = older.firstDoc;
+    return merged;
+}
+
+// Each value of the short list is looked up in what is left of the long one: a gallop, then a binary search.
+static size_t IntersectGallop(const uint32* a, size_t aCount, const uint32* b, size_t bCount, uint32* out) {
+    size_t count = 0;
+    size_t low = 0;
+    for (size_t i = 0; i < aCount && low < bCount; i++) {
+        uint32 value = a[i];
+        size_t bound = 1;
+        while (low + bound < bCount && b[low + bound] < value) {
+            bound *= 2;
+        }
+        size_t high = low + bound < bCount ? low + bound + 1 : bCount;
+        low = std::lower_bound(b + low, b + high, value) - b;
+        if (low < bCount && b[low] == value) {
+            out[count++] = value;
+            low++;
+        }
+    }
+    return count;
+}
+
+// Intersect two ascending lists into out, which has room for the shorter one, returns the size of the result.
+// Lists of similar sizes are merged a block of 4 against a block of 4: all 16 pairs are compared at once, then
+// the block with the lower maximum moves on.
+static size_t IntersectSorted(const uint32* a, size_t aCount, const uint32* b, size_t bCount, uint32* out) {
+    if (aCount > bCount) {
+        std::swap(a, b);
+        std::swap(aCount, bCount);
+    }
+    if (aCount * kGALLOP_RATIO < bCount) {
+        return IntersectGallop(a, aCount, b, bCount, out);
+    }
+
+    size_t count = 0;
+    size_t i = 0;
+    size_t j = 0;
+#if defined(NETWORK_HAS_SSE2)
+    while (i + 4 <= aCount && j + 4 <= bCount) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+        // each lane of a against the 4 rotations of b
+        __m128i eq01 = _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                                    _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+        __m128i eq23 = _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                                    _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(eq01, eq23)));
+        for (int lane = 0; lane < 4; lane++) {
+            if (mask & (1 << lane)) {
+                out[count++] = a[i + lane];
+            }
+        }
+        uint32 aMax = a[i + 3];
+        uint32 bMax = b[j + 3];
+        i += aMax <= bMax ? 4 : 0;
+        j += bMax <= aMax ? 4 : 0;
+    }
+#elif defined(NETWORK_HAS_NEON)
+    while (i + 4 <= aCount && j + 4 <= bCount) {
+        uint32x4_t va = vld1q_u32(a + i);
+        uint32x4_t vb = vld1q_u32(b + j);
+        uint32x4_t eq01 = vorrq_u32(vceqq_u32(va, vb), vceqq_u32(va, vextq_u32(vb, vb, 1)));
+        uint32x4_t eq23 = vorrq_u32(vceqq_u32(va, vextq_u32(vb, vb, 2)), vceqq_u32(va, vextq_u32(vb, vb, 3)));
+        uint32 lanes[4];
+        vst1q_u32(lanes, vorrq_u32(eq01, eq23));
+        for (int lane = 0; lane < 4; lane++) {
+            if (lanes[lane] != 0) {
+                out[count++] = a[i + lane];
+            }
+        }
+        uint32 aMax = a[i + 3];
+        uint32 bMax = b[j + 3];
+        i += aMax <= bMax ? 4 : 0;
+        j += bMax <= aMax ? 4 : 0;
+    }
+#endif
+    while (i < aCount && j < bCount) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (b[j] < a[i]) {
+            j++;
+        } else {
+            out[count++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+SearchIndex::SearchIndex(uint64 firstSequence)
+    : m_SequenceBase(firstSequence - 1), m_Merger(nullptr), m_Memtable(new SearchMemtable) {}
+
+void SearchIndex::SetMerger(SearchIndexMerger* merger) { m_Merger = merger; }
+
+void SearchIndex::Add(uint32 roomId, uint64 sequence, const std::string& chat, uint64 nowMs) {
+    if (sequence <= m_SequenceBase || sequence - m_SequenceBase > 0xFFFFFFFF) {
+        return;  // docs are 32-bit
+    }
+    uint32 doc = static_cast<uint32>(sequence - m_SequenceBase);
+    Tokenize(chat, m_Terms);
+    if (m_Terms.empty()) {
+        return;
+    }
+
+    SearchMemtable& memtable = *m_Memtable;
+    if (memtable.postingCount == 0) {
+        memtable.firstDoc = doc;
+        memtable.startMs = nowMs;
+    }
+    for (const std::string& term : m_Terms) {
+        m_Key.clear();
+        AppendKey(roomId, term, m_Key);
+        std::unordered_map<std::string, std::vector<uint32>>::iterator it = memtable.lists.find(m_Key);
+        if (it == memtable.lists.end()) {
+            it = memtable.lists.emplace(m_Key, std::vector<uint32>()).first;
+        }
+        it->second.push_back(doc);
+    }
+    memtable.postingCount += m_Terms.size();
+
+    if (memtable.postingCount >= kFLUSH_POSTINGS || nowMs - memtable.startMs >= kFLUSH_INTERVAL_MS) {
+        Freeze();
+    }
+}
+
+// Every source (the memtable, the frozen memtables, the segments) covers its own range of docs, so they are
+// searched newest first and the search stops once the page is full.
+uint64 SearchIndex::Search(uint32 roomId, const std::string& text, uint64 beforeSequence, uint32 maxCount,
+                           std::vector<uint64>& outSequences) {
+    outSequences.clear();
+    Tokenize(text, m_Terms);
+    if (m_Terms.empty() || maxCount == 0) {
+        return 0;
+    }
+    std::vector<std::string> keys(m_Terms.size());
+    for (size_t i = 0; i < m_Terms.size(); i++) {
+        AppendKey(roomId, m_Terms[i], keys[i]);
+    }
+    uint32 docBefore = 0xFFFFFFFF;
+    if (beforeSequence != 0 && beforeSequence - m_SequenceBase <= 0xFFFFFFFF) {
+        docBefore = beforeSequence > m_SequenceBase ? static_cast<uint32>(beforeSequence - m_SequenceBase) : 0;
+    }
+
+    std::vector<std::shared_ptr<const SearchMemtable>> frozen;
+    std::vector<std::shared_ptr<const SearchSegment>> segments;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        frozen = m_Frozen;
+        segments = m_Segments;
+    }
+
+    std::vector<std::vector<uint32>> decoded(keys.size());
+    std::vector<size_t> found(keys.size());
+    std::vector<const std::vector<uint32>*> lists;
+    std::vector<uint32> hits;
+    std::vector<uint32> scratch;
+    size_t sourceCount = 1 + frozen.size() + segments.size();
+    for (size_t source = 0; source < sourceCount && outSequences.size() < maxCount; source++) {
+        lists.clear();
+        if (source <= frozen.size()) {
+            const SearchMemtable& memtable = source == 0 ? *m_Memtable : *frozen[frozen.size() - source];
+            if (memtable.postingCount == 0 || memtable.firstDoc >= docBefore) {
+                continue;
+            }
+            for (const std::string& key : keys) {
+                std::unordered_map<std::string, std::vector<uint32>>::const_iterator it = memtable.lists.find(key);
+                if (it == memtable.lists.end()) {
+                    break;
+                }
+                lists.push_back(&it->second);
+            }
+        } else {
+            const SearchSegment& segment = *segments[segments.size() - (source - frozen.size())];
+            if (segment.firstDoc >= docBefore) {
+                continue;
+            }
+            // the keys are looked up before any list is decoded
+            size_t count = 0;
+            for (; count < keys.size(); count++) {
+                std::vector<std::string>::const_iterator it =
+                    std::lower_bound(segment.keys.begin(), segment.keys.end(), keys[count]);
+                if (it == segment.keys.end() || *it != keys[count]) {
+                    break;
+                }
+                found[count] = static_cast<size_t>(it - segment.keys.begin());
+            }
+            for (size_t i = 0; count == keys.size() && i < keys.size(); i++) {
+                DecodeList(segment, found[i], decoded[i]);
+                lists.push_back(&decoded[i]);
+            }
+        }
+        if (lists.size() != keys.size()) {
+            continue;  // a term is missing from this source
+        }
+
+        // the shortest list first, the result only shrinks
+        std::sort(lists.begin(), lists.end(),
+                  [](const std::vector<uint32>* a, const std::vector<uint32>* b) { return a->size() < b->size(); });
+        hits.assign(lists[0]->begin(), lists[0]->end());
+        for (size_t i = 1; i < lists.size() && !hits.empty(); i++) {
+            scratch.resize(hits.size());
+            const std::vector<uint32>& list = *lists[i];
+            scratch.resize(IntersectSorted(hits.data(), hits.size(), list.data(), list.size(), scratch.data()));
+            hits.swap(scratch);
+        }
+        for (size_t i = hits.size(); i > 0 && outSequences.size() < maxCount; i--) {
+            if (hits[i - 1] < docBefore) {
+                outSequences.push_back(m_SequenceBase + hits[i - 1]);
+            }
+        }
+    }
+
+    // a full page may have older hits
+    return outSequences.size() == maxCount ? outSequences.back() : 0;
+}
+
+void SearchIndex::Maintain() {
+    // compress the frozen memtables, oldest first so the segments stay in doc order
+    while (true) {
+        std::shared_ptr<const SearchMemtable> memtable;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (m_Frozen.empty()) {
+                break;
+            }
+            memtable = m_Frozen.front();
+        }
+        std::shared_ptr<const SearchSegment> segment = BuildSegment(*memtable);
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Frozen.erase(m_Frozen.begin());
+            m_Segments.push_back(segment);
+        }
+    }
+
+    // merge the neighbours with the fewest postings until there are few enough segments,
+    // small segments get merged together long before they are merged into the large ones
+    while (true) {
+        std::vector<std::shared_ptr<const SearchSegment>> segments;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            segments = m_Segments;
+        }
+        if (segments.size() <= kMAX_SEGMENTS) {
+            break;
+        }
+        size_t pick = 0;
+        for (size_t i = 1; i + 1 < segments.size(); i++) {
+            if (segments[i]->postingCount + segments[i + 1]->postingCount <
+                segments[pick]->postingCount + segments[pick + 1]->postingCount) {
+                pick = i;
+            }
+        }
+        std::shared_ptr<const SearchSegment> merged = MergeSegments(*segments[pick], *segments[pick + 1]);
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Segments[pick] = merged;
+            m_Segments.erase(m_Segments.begin() + pick + 1);
+        }
+    }
+}
+
+// Terms are runs of ASCII letters and digits, lowercased, and of non-ASCII bytes, so UTF-8 words stay whole
+void SearchIndex::Tokenize(const std::string& text, std::vector<std::string>& outTerms) {
+    outTerms.clear();
+    std::string term;
+    for (size_t i = 0; i <= text.size(); i++) {
+        unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) {
+            term.push_back(static_cast<char>(c));
+            continue;
+        }
+        if (c >= 'A' && c <= 'Z') {
+            term.push_back(static_cast<char>(c - 'A' + 'a'));
+            continue;
+        }
+        if (!term.empty() && term.size() <= kMAX_TERM_SIZE &&
+            std::find(outTerms.begin(), outTerms.end(), term) == outTerms.end()) {
+            outTerms.push_back(term);
+        }
+        term.clear();
+    }
+}
+
+void SearchIndex::Freeze() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Frozen.push_back(std::shared_ptr<const SearchMemtable>(m_Memtable.release()));
+    }
+    m_Memtable.reset(new SearchMemtable);
+    if (m_Merger != nullptr) {
+        m_Merger->Wake();
+    }
+}
+
+// the roomId (little-endian) then the term
+void SearchIndex::AppendKey(uint32 roomId, const std::string& term, std::string& outKey) const {
+    uint32 id = network::HostToLE32(roomId);
+    outKey.append(reinterpret_cast<const char*>(&id), sizeof(id));
+    outKey.append(term);
+}
+
+SearchIndexMerger::SearchIndexMerger(uint32 intervalMs)
+    : m_IntervalMs(intervalMs), m_WakeRequested(false), m_Stopping(false) {}
+
+SearchIndexMerger::~SearchIndexMerger() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stopping = true;
+    }
+    m_WakeCond.notify_one();
+    if (m_Thread.joinable()) {
+        m_Thread.join();
+    }
+}
+
+void SearchIndexMerger::Add(SearchIndex* index) {
+    index->SetMerger(this);
+    m_Indexes.push_back(index);
+}
+
+void SearchIndexMerger::Start() { m_Thread = std::thread(&SearchIndexMerger::Run, this); }
+
+void SearchIndexMerger::Wake() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_WakeRequested = true;
+    }
+    m_WakeCond.notify_one();
+}
+
+void SearchIndexMerger::Run() {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (!m_Stopping) {
+        m_WakeCond.wait_for(lock, std::chrono::milliseconds(m_IntervalMs),
+                            [this] { return m_WakeRequested || m_Stopping; });
+        m_WakeRequested = false;
+        if (m_Stopping) {
+            break;
+        }
+
+        lock.unlock();
+        for (SearchIndex* index : m_Indexes) {
+            index->Maintain();
+        }
+        lock.lock();
+    }
+}
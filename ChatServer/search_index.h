@@ -0,0 +1,120 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// The posting lists of the chats indexed since the last flush, keyed by roomId + term. Docs are ascending.
+struct SearchMemtable {
+    std::unordered_map<std::string, std::vector<uint32>> lists;
+    size_t postingCount = 0;
+    uint32 firstDoc = 0;
+    uint64 startMs = 0;  // when the first chat was indexed
+};
+
+// An immutable, compressed segment of the index: the posting lists of a range of docs, the keys sorted and each
+// list stored as varint deltas.
+struct SearchSegment {
+    std::vector<std::string> keys;
+    std::vector<uint32> counts;   // postings per key
+    std::vector<size_t> offsets;  // where each list starts in postings
+    std::string postings;
+    size_t postingCount = 0;
+    uint32 firstDoc = 0;
+};
+
+class SearchIndexMerger;
+
+// A full-text index of the chats of one chat log partition, so of one RoomShard.
+// The shard indexes each chat it logs into a memtable, on its own thread. A full (or old) memtable is frozen and
+// handed to the SearchIndexMerger thread, which compresses it into a segment and merges small segments, so the
+// shard never waits for either. A search is an AND of terms within a room, answered newest first from the
+// memtable, the frozen memtables and the segments. Docs are log sequences, relative to the first one indexed.
+class SearchIndex {
+public:
+    // a memtable is frozen after this many postings, or this long after its first chat
+    static constexpr size_t kFLUSH_POSTINGS = 256 * 1024;
+    static constexpr uint64 kFLUSH_INTERVAL_MS = 10 * 1000;
+
+    // the merger merges two neighbours past this many segments
+    static constexpr size_t kMAX_SEGMENTS = 8;
+
+    // longer terms are not indexed
+    static constexpr size_t kMAX_TERM_SIZE = 32;
+
+    // firstSequence is the sequence of the first chat that will be indexed
+    explicit SearchIndex(uint64 firstSequence);
+    ~SearchIndex() {}
+
+    // the merger to wake when a memtable is frozen, before the first Add
+    void SetMerger(SearchIndexMerger* merger);
+
+    // Index a logged chat, sequences must go up. nowMs is the wall clock. Owner thread only.
+    void Add(uint32 roomId, uint64 sequence, const std::string& chat, uint64 nowMs);
+
+    // Fill outSequences with the newest chats of roomId below beforeSequence (0 for none) that hold every term of
+    // text, newest first, up to maxCount. Returns the beforeSequence of the next page, 0 if there is none.
+    // Owner thread only.
+    uint64 Search(uint32 roomId, const std::string& text, uint64 beforeSequence, uint32 maxCount,
+                  std::vector<uint64>& outSequences);
+
+    // Compress the frozen memtables and merge segments. Merger thread only.
+    void Maintain();
+
+    // split text into lowercase terms, each listed once
+    static void Tokenize(const std::string& text, std::vector<std::string>& outTerms);
+
+private:
+    void Freeze();
+    void AppendKey(uint32 roomId, const std::string& term, std::string& outKey) const;
+
+private:
+    uint64 m_SequenceBase;  // doc = sequence - m_SequenceBase
+    SearchIndexMerger* m_Merger;
+
+    // owner thread
+    std::unique_ptr<SearchMemtable> m_Memtable;
+    std::vector<std::string> m_Terms;
+    std::string m_Key;
+
+    // oldest first, the docs of a frozen memtable are above those of every segment
+    std::mutex m_Mutex;
+    std::vector<std::shared_ptr<const SearchMemtable>> m_Frozen;
+    std::vector<std::shared_ptr<const SearchSegment>> m_Segments;  // only the merger replaces them
+};
+
+// The background thread of the search indexes: it compresses the frozen memtables when woken, and merges the
+// segments, so indexing costs the chat loop a memtable insert per term.
+class SearchIndexMerger {
+public:
+    static constexpr uint32 kMERGE_INTERVAL_MS = 1000;
+
+    explicit SearchIndexMerger(uint32 intervalMs);
+    ~SearchIndexMerger();  // stops the thread
+
+    // register an index before Start
+    void Add(SearchIndex* index);
+    void Start();
+
+    // run now, any thread
+    void Wake();
+
+private:
+    void Run();
+
+private:
+    std::vector<SearchIndex*> m_Indexes;
+    uint32 m_IntervalMs;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_WakeCond;
+    bool m_WakeRequested;
+    bool m_Stopping;
+    std::thread m_Thread;
+};
@@ -3,23 +3,69 @@
 #include <WS2tcpip.h>
 #include <WinSock2.h>
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <utility>
 
 #include "auth.pb.h"
+#include "batch.h"
+#include "byte_order.h"
+#include "compression.h"
+#include "fixed_layout.h"
+#include "serializer.h"
 
 using namespace network;
 
-ChatServer::ChatServer(uint16 port) {
-    // init chatroom logic stuff
-    m_RoomNames.push_back("graphics");
-    m_RoomNames.push_back("network");
-    m_RoomNames.push_back("media");
-    m_RoomNames.push_back("configuration");
+// one fan-out thread per extra core, the RunLoop thread takes a chunk too
+static size_t FanOutThreadCount(size_t maxThreads) {
+    size_t cores = std::thread::hardware_concurrency();
+    size_t threads = cores > 1 ? cores - 1 : 0;
+    return threads < maxThreads ? threads : maxThreads;
+}
+
+// index the chats a log already holds, the search index is only kept in memory
+static void IndexChatLog(ChatLog& chatLog, SearchIndex& searchIndex) {
+    std::string records;
+    uint64 sequence = 1;
+    while (sequence != 0) {
+        records.clear();
+        sequence = chatLog.ReadFrom(sequence, ChatLog::kMAX_READ_SCAN, records);
+        for (size_t offset = 0; offset < records.size();) {
+            ChatLogRecordHeader header;
+            memcpy(&header, records.data() + offset, sizeof(header));
+            uint32 recordSize = HostToLE32(header.recordSize);
+            std::string chat(records.data() + offset + sizeof(header), recordSize - sizeof(header));
+            searchIndex.Add(HostToLE32(header.roomId), HostToLE64(header.sequence), chat, HostToLE64(header.timeMs));
+            offset += recordSize;
+        }
+    }
+}
 
-    std::set<std::string> emptyUserSet{};
-    m_RoomMap.insert(std::make_pair("graphics", emptyUserSet));
-    m_RoomMap.insert(std::make_pair("network", emptyUserSet));
-    m_RoomMap.insert(std::make_pair("media", emptyUserSet));
-    m_RoomMap.insert(std::make_pair("configuration", emptyUserSet));
+// the messages only AuthServer sends, they bind sessions so they are only taken from the AuthServer link
+static bool IsAuthServerMessage(MessageType msgType) {
+    switch (msgType) {
+        case MessageType::kCREATE_ACCOUNT_WEB_SUCCESS_ACK:
+        case MessageType::kCREATE_ACCOUNT_WEB_FAILURE_ACK:
+        case MessageType::kAUTHENTICATE_ACCOUNT_WEB_SUCCESS_ACK:
+        case MessageType::kAUTHENTICATE_ACCOUNT_WEB_FAILURE_ACK:
+        case MessageType::kNEGOTIATE_PROTOCOL_ACK:
+            return true;
+        default:
+            return false;
+    }
+}
+
+ChatServer::ChatServer(uint16 port)
+    : m_FanOutPool(FanOutThreadCount(kMAX_FAN_OUT_THREADS)), m_FanOutWsaBufs(m_FanOutPool.Concurrency()) {
+    // a fixed number of room shards, whatever the number of fan-out threads
+    for (size_t i = 0; i < kROOM_SHARDS; i++) {
+        m_RoomShards.emplace_back(new RoomShard(m_UserNames, m_UserSockets, m_UserPacketVariants));
+    }
+    m_NextRoomSweep = std::chrono::steady_clock::now() + std::chrono::milliseconds(kROOM_SWEEP_INTERVAL_MS);
+    InitChatLog();
 
     // init networking stuff
     InitChatService(port);
@@ -158,7 +204,79 @@ int ChatServer::InitAuthConn(const std::string& ip, uint16 port) {
         printf("connect AuthServer OK!\n");
     }
 
-    return result;
+    // the link stays on plain protobuf packets until AuthServer acknowledges the features it supports
+    C2S_NegotiateProtocolReqMsg msg{kSUPPORTED_AUTH_FEATURES};
+    uint32 packetSize = Serialize(msg, m_SendBuf);
+    return SendBytes(m_AuthConn.authSocket, m_SendBuf.ConstData(), packetSize);
+}
+
+// Open one chat log partition per room shard, with its search index, and start the group commit
+void ChatServer::InitChatLog() {
+    CreateDirectoryA(kCHAT_LOG_DIRECTORY, NULL);  // fails if it exists already
+
+    // the records name their room and author by id, they are only kept if the ids survive a restart
+    std::string registryPath = std::string(kCHAT_LOG_DIRECTORY) + "\\registry.dat";
+    std::vector<std::string> userNames;
+    m_Registry.reset(new Registry(registryPath));
+    if (!m_Registry->Open(userNames, m_RoomNames)) {
+        printf("failed to open the registry %s, no chats will be kept.\n", registryPath.c_str());
+        m_Registry.reset();
+        m_RoomNames.clear();
+        return;
+    }
+    for (const std::string& userName : userNames) {
+        InternUser(userName);
+    }
+    for (uint32 roomId = 0; roomId < m_RoomNames.size(); roomId++) {
+        if (!m_RoomNames[roomId].empty()) {
+            m_RoomIds[m_RoomNames[roomId]] = roomId;
+        }
+    }
+
+    m_ChatLogCommitter.reset(
+        new ChatLogCommitter(ChatLogCommitter::kCOMMIT_INTERVAL_MS, ChatLogCommitter::kCOMMIT_BYTES));
+    m_SearchIndexMerger.reset(new SearchIndexMerger(SearchIndexMerger::kMERGE_INTERVAL_MS));
+    for (size_t i = 0; i < m_RoomShards.size(); i++) {
+        std::string directory = std::string(kCHAT_LOG_DIRECTORY) + "\\p" + std::to_string(i);
+        std::unique_ptr<ChatLog> chatLog(new ChatLog(directory, ChatLog::kSEGMENT_SIZE));
+        if (!chatLog->Open()) {
+            printf("failed to open the chat log %s, its chats will not be kept.\n", directory.c_str());
+            continue;
+        }
+        m_ChatLogCommitter->Add(chatLog.get());
+        m_RoomShards[i]->SetChatLog(chatLog.get());
+
+        std::unique_ptr<SearchIndex> searchIndex(new SearchIndex(1));
+        m_SearchIndexMerger->Add(searchIndex.get());
+        m_RoomShards[i]->SetSearchIndex(searchIndex.get());
+        m_SearchIndexes.push_back(std::move(searchIndex));
+        m_ChatLogs.push_back(std::move(chatLog));
+    }
+
+    // the chats of the previous runs are indexed again, the partitions split among the fan-out threads
+    m_FanOutPool.Run(m_ChatLogs.size(), [this](size_t worker, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            IndexChatLog(*m_ChatLogs[i], *m_SearchIndexes[i]);
+        }
+    });
+    m_ChatLogCommitter->Start();
+    m_SearchIndexMerger->Start();
+}
+
+// Record an id in the registry. If the record is lost, the replay stops there on the next start and the later ids
+// change, so the chats are no longer logged: the shards drop their partitions (the committer still flushes what they
+// appended). The shards are not running.
+void ChatServer::AppendRegistry(Registry::Kind kind, uint32 id, const std::string& name) {
+    if (!m_Registry || m_Registry->Append(kind, id, name)) {
+        return;
+    }
+
+    printf("failed to append to the registry, no more chats will be kept.\n");
+    m_Registry.reset();
+    for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+        shard->SetChatLog(nullptr);
+        shard->SetSearchIndex(nullptr);
+    }
 }
 
 int ChatServer::RunLoop() {
@@ -186,8 +304,30 @@ int ChatServer::RunLoop() {
         // Select will check all sockets in the SocketsReadyForReading set
         // to see if there is any data to be read on the socket.
         // https://learn.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-select
-        int socketCount = select(0, &copy, NULL, NULL, &tv);
+        // wake up in time to flush the pending auth requests
+        struct timeval wait = tv;
+        if (m_AuthBatch.Count() > 0) {
+            wait.tv_sec = 0;
+            wait.tv_usec = static_cast<long>(AuthBatchTimeLeftMs()) * 1000;
+        }
+        // and to notify the membership changes
+        if (m_PresencePending && static_cast<long>(PresenceTimeLeftMs()) * 1000 < wait.tv_usec) {
+            wait.tv_sec = 0;
+            wait.tv_usec = static_cast<long>(PresenceTimeLeftMs()) * 1000;
+        }
+        // and to send the held notifications
+        if (!m_HeldUsers.empty() && static_cast<long>(OutboundTimeLeftMs()) * 1000 < wait.tv_usec) {
+            wait.tv_sec = 0;
+            wait.tv_usec = static_cast<long>(OutboundTimeLeftMs()) * 1000;
+        }
+
+        int socketCount = select(0, &copy, NULL, NULL, &wait);
         if (socketCount == 0) {  // Time limit expired
+            if (m_AuthBatch.Count() > 0 && AuthBatchTimeLeftMs() == 0) {
+                FlushAuthBatch();
+            }
+            RunRoomShards();  // the idle room sweep and the presence tick
+            FlushOutboxes();  // and the held notifications
             continue;
         }
         if (socketCount == SOCKET_ERROR) {
@@ -224,21 +364,48 @@ int ChatServer::RunLoop() {
                     }
                     closesocket(sock);
                     FD_CLR(sock, &m_ChatConn.readfds);
+                    m_FrameReaders.erase(sock);
+                    m_ClientFeatures.erase(sock);
+                    UnbindSession(sock);
                 } else {
                     // printf("recv %d bytes from client.\n", recvResult);
 
-                    m_RecvBuf.Set(m_RawRecvBuf, kRECV_BUF_SIZE);
-                    uint32 packetSize = m_RecvBuf.ReadUInt32LE();
-                    MessageType messageType = static_cast<MessageType>(m_RecvBuf.ReadUInt32LE());
-
-                    if (m_RecvBuf.Size() >= packetSize) {
-                        uint32 headerSize = sizeof(uint32) * 2;
-                        uint32 payloadSize = packetSize - headerSize;
+                    // a packet may arrive in pieces, or several packets may arrive at once
+                    FrameReader& reader = m_FrameReaders[sock];
+                    reader.Append(m_RawRecvBuf, recvResult);
+
+                    const char* frame = nullptr;
+                    uint32 frameSize = 0;
+                    while (reader.NextFrame(frame, frameSize)) {
+                        if (!LoadPacket(m_RecvBuf, frame, frameSize)) {
+                            fprintf(stderr, "malformed packet.\n");
+                            continue;
+                        }
+                        uint32 packetSize = 0;
+                        MessageType messageType = ReadPacketHeader(m_RecvBuf, packetSize);
                         HandleMessage(messageType, sock);
                     }
+
+                    if (reader.IsCorrupted()) {
+                        fprintf(stderr, "invalid packet size, dropping connection.\n");
+                        if (it != m_ChatConn.clients.end()) {
+                            it->second = false;
+                        }
+                        closesocket(sock);
+                        FD_CLR(sock, &m_ChatConn.readfds);
+                        m_FrameReaders.erase(sock);
+                        m_ClientFeatures.erase(sock);
+                        UnbindSession(sock);
+                    }
                 }
             }
         }
+
+        if (m_AuthBatch.Count() > 0 && AuthBatchTimeLeftMs() == 0) {
+            FlushAuthBatch();
+        }
+        RunRoomShards();
+        FlushOutboxes();
     }
 }
 
@@ -248,92 +415,166 @@ void ChatServer::HandleMessage(network::MessageType msgType, SOCKET socket) {
     uint32 payloadSize = m_RecvBuf.Size() - headerSize;
     const void* payloadHead = static_cast<const void*>(m_RecvBuf.ConstData() + headerSize);
 
+    // a client must not forge AuthServer acks (the requestId of an ack is just a socket), and the AuthServer link
+    // only carries them, or kBATCH packets of them
+    bool fromAuthServer = socket == m_AuthConn.authSocket;
+    if (msgType != MessageType::kBATCH && IsAuthServerMessage(msgType) != fromAuthServer) {
+        printf("unexpected message %u from socket %llu.\n", static_cast<uint32>(msgType), (uint64)socket);
+        return;
+    }
+
     switch (msgType) {
         // received
         case MessageType::kCREATE_ACCOUNT_REQ: {
-            uint32 emailLength = m_RecvBuf.ReadUInt32LE();
-            std::string email = m_RecvBuf.ReadString(emailLength);
-            uint32 passwordLength = m_RecvBuf.ReadUInt32LE();
-            std::string password = m_RecvBuf.ReadString(passwordLength);
+            C2S_CreateAccountReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
 
-            // record the socket
-            m_UserName2ClientSocketMap[email] = socket;
-            m_ClientSocket2UserNameMap[socket] = email;
+            // record the socket, the session is bound once AuthServer accepts
+            m_ClientSocket2UserNameMap[socket] = req.email;
 
-            printf("try creating account for %s...\n", email.c_str());
-            ReqCreateAccountWeb(socket, email, password);
+            printf("try creating account for %s...\n", req.email.c_str());
+            ReqCreateAccountWeb(socket, req.email, req.password);
         } break;
 
         case MessageType::kCREATE_ACCOUNT_WEB_SUCCESS_ACK: {
-            auth::CreateAccountWebSuccess msg;
-            msg.ParseFromArray(payloadHead, payloadSize);
-            uint64 requestId = msg.requestid();  // requestId is the socket
+            uint64 requestId = 0;  // requestId is the socket
+            uint64 userId = 0;
+            if (m_AuthFeatures & ProtocolFeature::kFEATURE_FIXED_LAYOUT) {
+                const A2S_CreateAccountWebSuccessLayout* ack =
+                    LayoutOf<A2S_CreateAccountWebSuccessLayout>(payloadHead, payloadSize);
+                if (ack == nullptr) {
+                    printf("malformed message.\n");
+                    break;
+                }
+                requestId = HostToLE64(ack->requestId);
+                userId = HostToLE64(ack->userId);
+            } else {
+                auth::CreateAccountWebSuccess& msg = m_CreateAccountWebSuccess;
+                if (!msg.ParseFromArray(payloadHead, payloadSize)) {
+                    printf("malformed message.\n");
+                    break;
+                }
+                requestId = msg.requestid();
+                userId = msg.userid();
+            }
 
             // find the socket's email
             std::map<SOCKET, std::string>::iterator it = m_ClientSocket2UserNameMap.find(requestId);
             if (it != m_ClientSocket2UserNameMap.end()) {
-                std::string email = it->second;
-                uint64_t userId = msg.userid();
+                std::string email = std::move(it->second);  // binding the session drops the entry
                 printf("'%s' has created account, userId: %llu.\n", email.c_str(), userId);
+                BindSession(requestId, email);
                 AckCreateAccountSuccess(requestId, email, userId);
             }
         } break;
 
         case MessageType::kCREATE_ACCOUNT_WEB_FAILURE_ACK: {
-            auth::CreateAccountWebFailure msg;
-            msg.ParseFromArray(payloadHead, payloadSize);
-            uint64 requestId = msg.requestid();  // requestId is the socket
+            uint64 requestId = 0;  // requestId is the socket
+            uint16 reason = 0;
+            if (m_AuthFeatures & ProtocolFeature::kFEATURE_FIXED_LAYOUT) {
+                const A2S_CreateAccountWebFailureLayout* ack =
+                    LayoutOf<A2S_CreateAccountWebFailureLayout>(payloadHead, payloadSize);
+                if (ack == nullptr) {
+                    printf("malformed message.\n");
+                    break;
+                }
+                requestId = HostToLE64(ack->requestId);
+                reason = static_cast<uint16>(HostToLE32(ack->reason));
+            } else {
+                auth::CreateAccountWebFailure& msg = m_CreateAccountWebFailure;
+                if (!msg.ParseFromArray(payloadHead, payloadSize)) {
+                    printf("malformed message.\n");
+                    break;
+                }
+                requestId = msg.requestid();
+                reason = static_cast<uint16>(msg.reason());
+            }
 
             // find the socket's email
             std::map<SOCKET, std::string>::iterator it = m_ClientSocket2UserNameMap.find(requestId);
             if (it != m_ClientSocket2UserNameMap.end()) {
-                std::string email = it->second;
-                uint16 reason = static_cast<uint16>(msg.reason());
+                const std::string& email = it->second;
                 printf("'%s' failed to create account, reason: %d.\n", email.c_str(), reason);
                 AckCreateAccountFailure(requestId, reason, email);
             }
         } break;
 
         case MessageType::kAUTHENTICATE_ACCOUNT_REQ: {
-            uint32 emailLength = m_RecvBuf.ReadUInt32LE();
-            std::string email = m_RecvBuf.ReadString(emailLength);
-            uint32 passwordLength = m_RecvBuf.ReadUInt32LE();
-            std::string password = m_RecvBuf.ReadString(passwordLength);
+            C2S_AuthenticateAccountReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
 
-            // record the socket
-            m_UserName2ClientSocketMap[email] = socket;
-            m_ClientSocket2UserNameMap[socket] = email;
+            // record the socket, the session is bound once AuthServer accepts
+            m_ClientSocket2UserNameMap[socket] = req.email;
 
-            printf("try authenticating account for %s...\n", email.c_str());
-            ReqAuthenticateAccountWeb(socket, email, password);
+            printf("try authenticating account for %s...\n", req.email.c_str());
+            ReqAuthenticateAccountWeb(socket, req.email, req.password);
         } break;
 
         case MessageType::kAUTHENTICATE_ACCOUNT_WEB_SUCCESS_ACK: {
-            auth::AuthenticateWebSuccess msg;
-            msg.ParseFromArray(payloadHead, payloadSize);
-            uint64 requestId = msg.requestid();  // requestId is the socket
+            uint64 requestId = 0;  // requestId is the socket
+            if (m_AuthFeatures & ProtocolFeature::kFEATURE_FIXED_LAYOUT) {
+                const A2S_AuthenticateWebSuccessLayout* ack =
+                    LayoutOf<A2S_AuthenticateWebSuccessLayout>(payloadHead, payloadSize);
+                if (ack == nullptr) {
+                    printf("malformed message.\n");
+                    break;
+                }
+                requestId = HostToLE64(ack->requestId);
+            } else {
+                auth::AuthenticateWebSuccess& msg = m_AuthenticateWebSuccess;
+                if (!msg.ParseFromArray(payloadHead, payloadSize)) {
+                    printf("malformed message.\n");
+                    break;
+                }
+                requestId = msg.requestid();
+            }
 
             // find the socket's email
             std::map<SOCKET, std::string>::iterator it = m_ClientSocket2UserNameMap.find(requestId);
             if (it != m_ClientSocket2UserNameMap.end()) {
-                std::string email = it->second;
+                std::string email = std::move(it->second);  // binding the session drops the entry
                 printf("'%s' has authenticated.\n", email.c_str());
-                AckAuthenticateAccountSuccess(requestId, email, m_RoomNames);
+                uint32 userId = BindSession(requestId, email);
+                ListRoomNames(m_ListedRoomNames);
+                AckAuthenticateAccountSuccess(requestId, email, m_ListedRoomNames);
+                DeliverInbox(userId);
             } else {
                 printf("unknown socket: %llu.\n", requestId);
             }
         } break;
 
         case MessageType::kAUTHENTICATE_ACCOUNT_WEB_FAILURE_ACK: {
-            auth::AuthenticateWebFailure msg;
-            msg.ParseFromArray(payloadHead, payloadSize);
-            uint64 requestId = msg.requestid();  // requestId is the socket
+            uint64 requestId = 0;  // requestId is the socket
+            uint16 reason = 0;
+            if (m_AuthFeatures & ProtocolFeature::kFEATURE_FIXED_LAYOUT) {
+                const A2S_AuthenticateWebFailureLayout* ack =
+                    LayoutOf<A2S_AuthenticateWebFailureLayout>(payloadHead, payloadSize);
+                if (ack == nullptr) {
+                    printf("malformed message.\n");
+                    break;
+                }
+                requestId = HostToLE64(ack->requestId);
+                reason = static_cast<uint16>(HostToLE32(ack->reason));
+            } else {
+                auth::AuthenticateWebFailure& msg = m_AuthenticateWebFailure;
+                if (!msg.ParseFromArray(payloadHead, payloadSize)) {
+                    printf("malformed message.\n");
+                    break;
+                }
+                requestId = msg.requestid();
+                reason = static_cast<uint16>(msg.reason());
+            }
 
             // find the socket's email
             std::map<SOCKET, std::string>::iterator it = m_ClientSocket2UserNameMap.find(requestId);
             if (it != m_ClientSocket2UserNameMap.end()) {
-                std::string email = it->second;
-                uint16 reason = static_cast<uint16>(msg.reason());
+                const std::string& email = it->second;
                 printf("'%s' failed to authenticate, reason: %d.\n", email.c_str(), reason);
                 AckAuthenticateAccountFailure(requestId, reason, email);
             } else {
@@ -343,88 +584,291 @@ void ChatServer::HandleMessage(network::MessageType msgType, SOCKET socket) {
 
         // received C2S_JoinRoomReqMsg
         case MessageType::kJOIN_ROOM_REQ: {
-            uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string userName = m_RecvBuf.ReadString(userNameLength);
-            uint32 roomNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string roomName = m_RecvBuf.ReadString(roomNameLength);
-
-            printf("'%s' has joined #%s.\n", userName.c_str(), roomName.c_str());
-
-            // add the user to room
-            std::map<std::string, std::set<std::string>>::iterator it = m_RoomMap.find(roomName);
-            if (it != m_RoomMap.end()) {
-                std::set<std::string>& usersInRoom = it->second;
-                usersInRoom.insert(userName);
-
-                // respond with S2C_JoinRoomAckMsg SUCCESS
-                std::vector<std::string> userNames{usersInRoom.begin(), usersInRoom.end()};
-                AckJoinRoom(socket, MessageStatus::kSUCCESS, roomName, userNames);
+            C2S_JoinRoomReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
 
-                // broadcast event with S2C_JoinRoomNtfMsg
-                BroadcastJoinRoom(usersInRoom, roomName, userName);
-            } else {
+            uint32 userId = SessionUserId(socket);
+            std::map<std::string, uint32>::iterator it = m_RoomIds.find(req.roomName);
+            if (userId == kINVALID_ID || it == m_RoomIds.end()) {
                 // respond with S2C_JoinRoomAckMsg FAILURE
-                std::vector<std::string> placeHolder{};
-                AckJoinRoom(socket, MessageStatus::kFAILURE, roomName, placeHolder);
+                AckJoinRoom(socket, MessageStatus::kFAILURE, req.roomName);
+                break;
             }
 
+            // the room's shard adds the user, acks and broadcasts S2C_JoinRoomNtfMsg
+            RoomCommand* command = new RoomCommand;
+            command->type = MessageType::kJOIN_ROOM_REQ;
+            command->roomId = it->second;
+            command->userId = userId;
+            command->roomName = std::move(req.roomName);
+            command->historyCapacity = RoomHistoryCapacity(it->second);
+            command->knownVersion = req.knownVersion;
+            PostRoomCommand(command);
         } break;
 
         // received C2S_LeaveRoomReqMsg
         case MessageType::kLEAVE_ROOM_REQ: {
-            uint32 roomNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string roomName = m_RecvBuf.ReadString(roomNameLength);
-            uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string userName = m_RecvBuf.ReadString(userNameLength);
-
-            printf("'%s' has left #%s.\n", userName.c_str(), roomName.c_str());
-
-            // remove the user from room
-            std::map<std::string, std::set<std::string>>::iterator it = m_RoomMap.find(roomName);
-            if (it != m_RoomMap.end()) {
-                std::set<std::string>& usersInRoom = it->second;
-                std::set<std::string>::iterator uit = usersInRoom.find(userName);
-                if (uit != usersInRoom.end()) {
-                    usersInRoom.erase(uit);
-                }
-
-                // respond with S2C_LeaveRoomAckMsg SUCCESS
-                AckLeaveRoom(socket, MessageStatus::kSUCCESS, roomName, userName);
+            C2S_LeaveRoomReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
 
-                // broadcast event with S2C_LeaveRoomNtfMsg
-                BroadcastLeaveRoom(usersInRoom, roomName, userName);
-            } else {
+            uint32 userId = SessionUserId(socket);
+            if (userId == kINVALID_ID || !RoomExists(req.roomId)) {
                 // respond with S2C_LeaveRoomAckMsg FAILURE
-                AckLeaveRoom(socket, MessageStatus::kFAILURE, roomName, userName);
+                AckLeaveRoom(socket, MessageStatus::kFAILURE, req.roomId);
+                break;
             }
 
+            // the room's shard removes the user, acks and broadcasts S2C_LeaveRoomNtfMsg
+            RoomCommand* command = new RoomCommand;
+            command->type = MessageType::kLEAVE_ROOM_REQ;
+            command->roomId = req.roomId;
+            command->userId = userId;
+            PostRoomCommand(command);
         } break;
 
         // received C2S_ChatInRoomReqMsg
         case MessageType::kCHAT_IN_ROOM_REQ: {
-            uint32 roomNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string roomName = m_RecvBuf.ReadString(roomNameLength);
-            uint32 userNameLength = m_RecvBuf.ReadUInt32LE();
-            std::string userName = m_RecvBuf.ReadString(userNameLength);
-            uint32 chatLength = m_RecvBuf.ReadUInt32LE();
-            std::string chat = m_RecvBuf.ReadString(chatLength);
+            C2S_ChatInRoomReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
 
-            printf("'%s' - #%s: %s.\n", userName.c_str(), roomName.c_str(), chat.c_str());
+            uint32 userId = SessionUserId(socket);
+            if (userId == kINVALID_ID || !RoomExists(req.roomId)) {
+                // respond with S2C_ChatInRoomAckMsg FAILURE
+                AckChatInRoom(socket, MessageStatus::kFAILURE, req.roomId);
+                break;
+            }
 
-            std::map<std::string, std::set<std::string>>::iterator it = m_RoomMap.find(roomName);
-            if (it != m_RoomMap.end()) {
-                // respond with S2C_ChatInRoomAckMsg SUCCESS
-                AckChatInRoom(socket, MessageStatus::kSUCCESS, roomName, userName);
+            // the room's shard checks the membership, acks and broadcasts S2C_ChatInRoomNtfMsg
+            RoomCommand* command = new RoomCommand;
+            command->type = MessageType::kCHAT_IN_ROOM_REQ;
+            command->roomId = req.roomId;
+            command->userId = userId;
+            command->chat = std::move(req.chat);
+            PostRoomCommand(command);
+        } break;
 
-                // broadcast event with S2C_ChatInRoomNtfMsg
-                std::set<std::string>& usersInRoom = it->second;
-                BroadcastChatInRoom(usersInRoom, roomName, userName, chat);
+        // received C2S_ListMembersReqMsg
+        case MessageType::kLIST_MEMBERS_REQ: {
+            C2S_ListMembersReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
 
-            } else {
-                // respond with S2C_ChatInRoomAckMsg FAILURE
-                AckChatInRoom(socket, MessageStatus::kFAILURE, roomName, userName);
+            uint32 userId = SessionUserId(socket);
+            if (userId == kINVALID_ID || !RoomExists(req.roomId)) {
+                AckListMembers(socket, MessageStatus::kFAILURE, req.roomId);
+                break;
             }
 
+            uint32 pageSize = req.pageSize == 0 ? RoomShard::kMEMBER_PAGE_SIZE : req.pageSize;
+            if (pageSize > RoomShard::kMAX_MEMBER_PAGE_SIZE) {
+                pageSize = RoomShard::kMAX_MEMBER_PAGE_SIZE;
+            }
+
+            // the room's shard checks the membership and acks with the page
+            RoomCommand* command = new RoomCommand;
+            command->type = MessageType::kLIST_MEMBERS_REQ;
+            command->roomId = req.roomId;
+            command->userId = userId;
+            command->cursor = req.cursor;
+            command->pageSize = pageSize;
+            PostRoomCommand(command);
+        } break;
+
+        // received C2S_CreateRoomReqMsg
+        // the room is only registered here, its shard allocates the state on the first join
+        case MessageType::kCREATE_ROOM_REQ: {
+            C2S_CreateRoomReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
+
+            uint32 userId = SessionUserId(socket);
+            if (userId == kINVALID_ID || req.roomName.empty() || req.roomName.size() > kMAX_ROOM_NAME_SIZE ||
+                m_RoomIds.find(req.roomName) != m_RoomIds.end()) {
+                AckCreateRoom(socket, MessageStatus::kFAILURE, kINVALID_ID, req.roomName);
+                break;
+            }
+
+            uint32 roomId = AddRoom(req.roomName);
+            printf("'%s' has created #%s.\n", m_UserNames[userId].c_str(), req.roomName.c_str());
+            AckCreateRoom(socket, MessageStatus::kSUCCESS, roomId, req.roomName);
+        } break;
+
+        // received C2S_DeleteRoomReqMsg
+        case MessageType::kDELETE_ROOM_REQ: {
+            C2S_DeleteRoomReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
+
+            uint32 userId = SessionUserId(socket);
+            if (userId == kINVALID_ID || !RoomExists(req.roomId)) {
+                AckDeleteRoom(socket, MessageStatus::kFAILURE, req.roomId);
+                break;
+            }
+
+            // the room's shard checks it is empty, frees its state and acks
+            RoomCommand* command = new RoomCommand;
+            command->type = MessageType::kDELETE_ROOM_REQ;
+            command->roomId = req.roomId;
+            command->userId = userId;
+            PostRoomCommand(command);
+        } break;
+
+        // received C2S_RoomHistoryReqMsg
+        // served from the chat log partition of the room's shard, on the shard's thread
+        case MessageType::kROOM_HISTORY_REQ: {
+            C2S_RoomHistoryReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
+
+            uint32 userId = SessionUserId(socket);
+            if (userId == kINVALID_ID || !RoomExists(req.roomId)) {
+                AckRoomHistory(socket, MessageStatus::kFAILURE, req.roomId);
+                break;
+            }
+
+            uint32 pageSize = req.pageSize == 0 ? RoomShard::kLOG_PAGE_SIZE : req.pageSize;
+            if (pageSize > RoomShard::kMAX_LOG_PAGE_SIZE) {
+                pageSize = RoomShard::kMAX_LOG_PAGE_SIZE;
+            }
+
+            // the room's shard checks the membership and acks with the page
+            RoomCommand* command = new RoomCommand;
+            command->type = MessageType::kROOM_HISTORY_REQ;
+            command->roomId = req.roomId;
+            command->userId = userId;
+            command->history.roomId = req.roomId;
+            command->history.beforeSequence = req.beforeSequence;
+            command->history.afterSequence = req.afterSequence;
+            command->history.fromTimeMs = req.fromTimeMs;
+            command->history.toTimeMs = req.toTimeMs;
+            command->history.maxCount = pageSize;
+            command->history.maxBytes = RoomShard::kMAX_LOG_PAGE_BYTES;
+            PostRoomCommand(command);
+        } break;
+
+        // received C2S_SearchRoomReqMsg
+        // searched in the index of the room's shard, on the shard's thread
+        case MessageType::kSEARCH_ROOM_REQ: {
+            C2S_SearchRoomReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
+
+            uint32 userId = SessionUserId(socket);
+            if (userId == kINVALID_ID || !RoomExists(req.roomId)) {
+                AckSearchRoom(socket, MessageStatus::kFAILURE, req.roomId);
+                break;
+            }
+
+            uint32 pageSize = req.pageSize == 0 ? RoomShard::kLOG_PAGE_SIZE : req.pageSize;
+            if (pageSize > RoomShard::kMAX_LOG_PAGE_SIZE) {
+                pageSize = RoomShard::kMAX_LOG_PAGE_SIZE;
+            }
+
+            // the room's shard checks the membership and acks with the hits
+            RoomCommand* command = new RoomCommand;
+            command->type = MessageType::kSEARCH_ROOM_REQ;
+            command->roomId = req.roomId;
+            command->userId = userId;
+            command->searchText = std::move(req.text);
+            command->history.roomId = req.roomId;
+            command->history.beforeSequence = req.beforeSequence;
+            command->history.maxCount = pageSize;
+            command->history.maxBytes = RoomShard::kMAX_LOG_PAGE_BYTES;
+            PostRoomCommand(command);
+        } break;
+
+        // received C2S_DirectMessageReqMsg
+        // the busiest path, so it skips the shards: both ends are found in O(1) (the session table, then the
+        // userId -> SOCKET table) and the ntf is sent right away
+        case MessageType::kDIRECT_MESSAGE_REQ: {
+            C2S_DirectMessageReqMsg& req = m_DirectMessageReq;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
+
+            uint32 userId = SessionUserId(socket);
+            if (userId == kINVALID_ID || req.toUserId >= m_UserNames.size()) {
+                AckDirectMessage(socket, MessageStatus::kFAILURE, req.toUserId);
+                break;
+            }
+
+            NotifyDirectMessage(userId, req.toUserId, req.chat);
+            AckDirectMessage(socket, MessageStatus::kSUCCESS, req.toUserId);
+        } break;
+
+        // received C2S_NegotiateProtocolReqMsg
+        case MessageType::kNEGOTIATE_PROTOCOL_REQ: {
+            C2S_NegotiateProtocolReqMsg req;
+            if (!Deserialize(m_RecvBuf, req)) {
+                printf("malformed message.\n");
+                break;
+            }
+            uint32 accepted = req.features & kSUPPORTED_FEATURES;
+            FlushOutboxOf(socket);  // what was queued is encoded for the previous features
+            m_ClientFeatures[socket] = accepted;
+            uint32 userId = SessionUserId(socket);
+            if (userId != kINVALID_ID) {
+                m_UserPacketVariants[userId] = PacketVariant(socket);
+            }
+
+            printf("negotiated protocol features 0x%x for socket %llu.\n", accepted, (uint64)socket);
+            AckNegotiateProtocol(socket, accepted);
+        } break;
+
+        // received the link setup answer from AuthServer
+        case MessageType::kNEGOTIATE_PROTOCOL_ACK: {
+            S2C_NegotiateProtocolAckMsg ack;
+            if (!Deserialize(m_RecvBuf, ack)) {
+                printf("malformed message.\n");
+                break;
+            }
+            m_AuthFeatures = ack.features & kSUPPORTED_AUTH_FEATURES;
+            printf("negotiated AuthServer link features 0x%x.\n", m_AuthFeatures);
+        } break;
+
+        // received a kBATCH packet, every nested packet is handled as if it had arrived alone
+        case MessageType::kBATCH: {
+            // m_RecvBuf is reused by each nested packet, so keep the payload aside
+            std::string payload(static_cast<const char*>(payloadHead), payloadSize);
+            BatchReader reader(payload.data(), payloadSize);
+
+            const char* frame = nullptr;
+            uint32 frameSize = 0;
+            while (reader.NextFrame(frame, frameSize)) {
+                if (!LoadPacket(m_RecvBuf, frame, frameSize)) {
+                    printf("malformed packet.\n");
+                    continue;
+                }
+                uint32 packetSize = 0;
+                MessageType nestedType = ReadPacketHeader(m_RecvBuf, packetSize);
+                if (nestedType != MessageType::kBATCH) {
+                    HandleMessage(nestedType, socket);
+                }
+            }
+
+            if (reader.IsCorrupted()) {
+                printf("malformed batch.\n");
+            }
         } break;
 
         default:
@@ -434,7 +878,7 @@ void ChatServer::HandleMessage(network::MessageType msgType, SOCKET socket) {
 }
 
 int ChatServer::ReqCreateAccountWeb(SOCKET chatClientSocket, const std::string& email, const std::string& password) {
-    auth::CreateAccountWeb msg;
+    auth::CreateAccountWeb& msg = m_CreateAccountWebReq;
     msg.set_requestid(chatClientSocket);
     msg.set_email(email);
     msg.set_plaintextpassword(password);
@@ -450,12 +894,12 @@ int ChatServer::ReqCreateAccountWeb(SOCKET chatClientSocket, const std::string&
     char* payloadHead = m_SendBuf.Data() + headerSize;
     msg.SerializeToArray(payloadHead, payloadSize);
 
-    return SendMsg(m_AuthConn.authSocket, packetSize);
+    return QueueAuthReq(packetSize);
 }
 
 int ChatServer::ReqAuthenticateAccountWeb(SOCKET chatClientSocket, const std::string& email,
                                           const std::string& password) {
-    auth::AuthenticateWeb msg;
+    auth::AuthenticateWeb& msg = m_AuthenticateWebReq;
     msg.set_requestid(chatClientSocket);
     msg.set_email(email);
     msg.set_plaintextpassword(password);
@@ -471,110 +915,593 @@ int ChatServer::ReqAuthenticateAccountWeb(SOCKET chatClientSocket, const std::st
     char* payloadHead = m_SendBuf.Data() + headerSize;
     msg.SerializeToArray(payloadHead, payloadSize);
 
-    return SendMsg(m_AuthConn.authSocket, packetSize);
+    return QueueAuthReq(packetSize);
+}
+
+// Set how many auth requests are accumulated, and for how long at most, before they are sent to AuthServer.
+// A maxCount of 1 sends every request right away.
+void ChatServer::SetAuthBatching(uint32 maxCount, uint32 windowMs) {
+    m_AuthBatchMaxCount = maxCount > 0 ? maxCount : 1;
+    m_AuthBatchWindowMs = windowMs;
+    FlushAuthBatch();
+}
+
+// The new capacity applies to a room on its next join
+void ChatServer::SetHistoryCapacity(uint32 capacity) {
+    m_HistoryCapacity = capacity < RoomShard::kMAX_HISTORY_CAPACITY ? capacity : RoomShard::kMAX_HISTORY_CAPACITY;
+}
+
+void ChatServer::SetRoomHistoryCapacity(const std::string& roomName, uint32 capacity) {
+    std::map<std::string, uint32>::iterator it = m_RoomIds.find(roomName);
+    if (it == m_RoomIds.end()) {
+        printf("unknown room #%s.\n", roomName.c_str());
+        return;
+    }
+    m_RoomHistoryCapacities[it->second] =
+        capacity < RoomShard::kMAX_HISTORY_CAPACITY ? capacity : RoomShard::kMAX_HISTORY_CAPACITY;
+}
+
+// Each shard gets an equal share of the budget, the RunLoop thread must not be running the shards
+void ChatServer::SetHistoryBudget(size_t bytes) {
+    for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+        shard->SetHistoryBudget(bytes / m_RoomShards.size());
+    }
+}
+
+void ChatServer::SetPresenceTick(uint32 tickMs) { m_PresenceTickMs = tickMs; }
+
+// The held notifications go out with the next flush
+void ChatServer::SetOutboundBatching(uint32 holdMs, size_t flushBytes) {
+    m_OutboundHoldMs = holdMs;
+    m_OutboundFlushBytes = flushBytes;
+    for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+        shard->SetHoldOutboxes(holdMs > 0);
+    }
+}
+
+// Each shard gets an equal share of the budget, the RunLoop thread must not be running the shards
+void ChatServer::SetInboxCapacity(uint32 capacity, size_t maxBytes, size_t budget) {
+    for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+        shard->SetInboxCapacity(capacity, maxBytes, budget / m_RoomShards.size());
+    }
+}
+
+// Queue the auth request encoded in m_SendBuf, the queue is flushed when it is full or its window expires
+int ChatServer::QueueAuthReq(uint32 packetSize) {
+    if (!(m_AuthFeatures & ProtocolFeature::kFEATURE_BATCH)) {
+        return SendBytes(m_AuthConn.authSocket, m_SendBuf.ConstData(), packetSize);
+    }
+
+    if (m_AuthBatch.Count() == 0) {
+        m_AuthBatch.Begin();
+        m_AuthBatchStart = std::chrono::steady_clock::now();
+    }
+    m_AuthBatch.AddPacket(m_SendBuf.ConstData(), packetSize);
+
+    if (m_AuthBatch.Count() >= m_AuthBatchMaxCount) {
+        return FlushAuthBatch();
+    }
+    return 0;
+}
+
+// Send the queued auth requests to AuthServer in one kBATCH packet
+int ChatServer::FlushAuthBatch() {
+    uint32 count = m_AuthBatch.Count();
+    if (count == 0) {
+        return 0;
+    }
+
+    // a lone request is sent as is, without the batch header
+    uint32 packetSize = m_AuthBatch.Finish();
+    uint32 skip = (count == 1) ? static_cast<uint32>(sizeof(PacketHeader)) : 0;
+    int result = SendBytes(m_AuthConn.authSocket, m_AuthBatchBuf.ConstData() + skip, packetSize - skip);
+
+    m_AuthBatch.Begin();
+    return result;
+}
+
+// Milliseconds until the pending auth requests must be sent
+uint32 ChatServer::AuthBatchTimeLeftMs() const {
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - m_AuthBatchStart;
+    long long elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+    if (elapsedMs >= m_AuthBatchWindowMs) {
+        return 0;
+    }
+    return static_cast<uint32>(m_AuthBatchWindowMs - elapsedMs);
+}
+
+// Milliseconds until the shards must notify the membership changes
+uint32 ChatServer::PresenceTimeLeftMs() const {
+    std::chrono::steady_clock::duration left = m_NextPresenceFlush - std::chrono::steady_clock::now();
+    long long leftMs = std::chrono::duration_cast<std::chrono::milliseconds>(left).count();
+    return leftMs > 0 ? static_cast<uint32>(leftMs) : 0;
+}
+
+// Run the room requests posted during this loop iteration, each shard on its own fan-out thread.
+// The RunLoop thread waits for them, so the shards can read the user tables.
+// Every kROOM_SWEEP_INTERVAL_MS the shards also reclaim the state of their idle rooms, and every presence tick they
+// notify the membership changes. The tick starts with the first change, so a lone join waits at most one tick.
+void ChatServer::RunRoomShards() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    bool sweep = now >= m_NextRoomSweep;
+    bool presence = m_PresenceTickMs == 0 || (m_PresencePending && now >= m_NextPresenceFlush);
+    if (!m_RoomCommandsPosted && !sweep && !(presence && m_PresencePending)) {
+        return;
+    }
+    m_RoomCommandsPosted = false;
+    if (sweep) {
+        m_NextRoomSweep = now + std::chrono::milliseconds(kROOM_SWEEP_INTERVAL_MS);
+    }
+
+    m_FanOutPool.Run(m_RoomShards.size(), [this, now, sweep, presence](size_t worker, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            m_RoomShards[i]->Drain(now);
+            if (sweep) {
+                m_RoomShards[i]->ReclaimIdleRooms(now);
+            }
+            if (presence) {
+                m_RoomShards[i]->FlushPresence();
+            }
+        }
+    });
+
+    bool pending = false;
+    for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+        pending = pending || shard->HasPendingPresence();
+    }
+    if (pending && !m_PresencePending) {
+        m_NextPresenceFlush = now + std::chrono::milliseconds(m_PresenceTickMs);
+    }
+    m_PresencePending = pending;
+
+    // the deleted rooms leave the registry, their names can be reused
+    for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+        for (uint32 roomId : shard->DeletedRooms()) {
+            m_RoomIds.erase(m_RoomNames[roomId]);
+            std::string().swap(m_RoomNames[roomId]);
+            m_RoomHistoryCapacities.erase(roomId);
+            AppendRegistry(Registry::kROOM_DELETED, roomId, std::string());
+        }
+        shard->ClearDeleted();
+    }
+}
+
+// Hand a room request to the shard that owns the room
+void ChatServer::PostRoomCommand(RoomCommand* command) {
+    command->sequence = m_NextSequence++;
+    m_RoomShards[command->roomId % m_RoomShards.size()]->Post(command);
+    m_RoomCommandsPosted = true;
+}
+
+// Send every packet the shards queued, one scatter-gather call per recipient, but the notifications held by the
+// outbound batching. A large fan-out is split across the worker pool. Each recipient is listed once and flushed by
+// one thread, and the loop waits for all of them, so the order of the packets of a room is kept.
+void ChatServer::FlushOutboxes() {
+    for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+        for (uint32 userId : shard->PendingUsers()) {
+            if (!m_UserPending[userId]) {
+                m_UserPending[userId] = 1;
+                m_PendingUsers.push_back(userId);
+            }
+        }
+    }
+    for (uint32 userId : m_HeldUsers) {
+        if (!m_UserPending[userId]) {
+            m_UserPending[userId] = 1;
+            m_PendingUsers.push_back(userId);
+        }
+    }
+    m_HeldUsers.clear();
+
+    if (m_OutboundHoldMs > 0) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        size_t sendCount = 0;
+        for (uint32 userId : m_PendingUsers) {
+            if (HoldOutbox(userId, now)) {
+                m_UserPending[userId] = 0;
+                m_HeldUsers.push_back(userId);
+                std::chrono::steady_clock::time_point deadline =
+                    m_HoldStarts[userId] + std::chrono::milliseconds(m_OutboundHoldMs);
+                if (m_HeldUsers.size() == 1 || deadline < m_NextHoldDeadline) {
+                    m_NextHoldDeadline = deadline;
+                }
+            } else {
+                m_PendingUsers[sendCount++] = userId;
+            }
+        }
+        m_PendingUsers.resize(sendCount);
+    }
+
+    if (m_PendingUsers.size() < kPARALLEL_FAN_OUT_THRESHOLD) {
+        for (uint32 userId : m_PendingUsers) {
+            FlushOutbox(userId, m_SendWsaBufs);
+        }
+    } else {
+        m_FanOutPool.Run(m_PendingUsers.size(), [this](size_t worker, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                FlushOutbox(m_PendingUsers[i], m_FanOutWsaBufs[worker]);
+            }
+        });
+    }
+
+    for (uint32 userId : m_PendingUsers) {
+        m_UserPending[userId] = 0;
+    }
+    m_PendingUsers.clear();
+    for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+        shard->ClearPending();
+    }
+}
+
+// Send the packets queued for a user by every shard, wsaBufs is the scratch space of the calling thread
+int ChatServer::FlushOutbox(uint32 userId, std::vector<WSABUF>& wsaBufs) {
+    wsaBufs.clear();
+    for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+        if (!shard->HasOutbox(userId)) {
+            continue;
+        }
+        std::vector<RoomShard::SharedPacket>& outbox = shard->Outbox(userId);
+        for (const RoomShard::SharedPacket& packet : outbox) {
+            WSABUF wsaBuf;
+            wsaBuf.buf = const_cast<char*>(packet->data());
+            wsaBuf.len = static_cast<ULONG>(packet->size());
+            wsaBufs.push_back(wsaBuf);
+        }
+    }
+
+    SOCKET sock = m_UserSockets[userId];
+    if (sock != INVALID_SOCKET && !wsaBufs.empty()) {
+        DWORD bytesSent = 0;
+        int sendResult =
+            WSASend(sock, wsaBufs.data(), static_cast<DWORD>(wsaBufs.size()), &bytesSent, 0, NULL, NULL);
+        if (sendResult == SOCKET_ERROR) {
+            printf("WSASend failed with error %d\n", WSAGetLastError());
+        }
+    }
+
+    // the WSABUFs point into the packets, release them only after the send
+    for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+        if (shard->HasOutbox(userId)) {
+            shard->ClearOutbox(userId);
+        }
+    }
+    return 0;
+}
+
+// Send what the shards queued for the user of a connection ahead of a direct send to it, or before its connection
+// or its encoding changes, so its packets keep their order and are read with the features they were encoded for.
+// The shards are not running, the RunLoop thread only runs them from RunRoomShards.
+void ChatServer::FlushOutboxOf(SOCKET clientSocket) {
+    uint32 userId = SessionUserId(clientSocket);
+    if (userId != kINVALID_ID && m_UserSockets[userId] == clientSocket) {
+        FlushOutbox(userId, m_SendWsaBufs);
+        m_HoldStarts[userId] = std::chrono::steady_clock::time_point();  // a held outbox went out with it
+    }
+}
+
+// Whether a user's packets may wait for more: none of them is a reply, they are below the byte threshold and the
+// oldest has been held for less than the hold time. The outbox of a user who went offline was already emptied by
+// UnbindSession, and one already sent by a direct send (see FlushOutboxOf) is not held any longer.
+bool ChatServer::HoldOutbox(uint32 userId, std::chrono::steady_clock::time_point now) {
+    size_t bytes = 0;
+    bool urgent = m_UserSockets[userId] == INVALID_SOCKET;
+    for (size_t i = 0; i < m_RoomShards.size() && !urgent; i++) {
+        urgent = m_RoomShards[i]->IsUrgent(userId);
+        bytes += m_RoomShards[i]->OutboxBytes(userId);
+    }
+    if (bytes == 0) {
+        m_HoldStarts[userId] = std::chrono::steady_clock::time_point();
+        return false;
+    }
+
+    std::chrono::steady_clock::time_point& start = m_HoldStarts[userId];
+    if (start == std::chrono::steady_clock::time_point()) {
+        start = now;
+    }
+    if (urgent || bytes >= m_OutboundFlushBytes || now - start >= std::chrono::milliseconds(m_OutboundHoldMs)) {
+        start = std::chrono::steady_clock::time_point();
+        return false;
+    }
+    return true;
+}
+
+// Milliseconds until the first held notifications must be sent
+uint32 ChatServer::OutboundTimeLeftMs() const {
+    std::chrono::steady_clock::duration left = m_NextHoldDeadline - std::chrono::steady_clock::now();
+    long long leftMs = std::chrono::duration_cast<std::chrono::milliseconds>(left).count();
+    return leftMs > 0 ? static_cast<uint32>(leftMs) : 0;
+}
+
+// The broadcast variant (wire format x compression) a connection gets, plus whether it takes kBATCH packets
+uint32 ChatServer::PacketVariant(SOCKET clientSocket) const {
+    uint32 features = ClientFeatures(clientSocket);
+    uint32 variant = 0;
+    if (features & ProtocolFeature::kFEATURE_COMPACT_WIRE) {
+        variant |= RoomShard::kVARIANT_COMPACT;
+    }
+    if (features & ProtocolFeature::kFEATURE_COMPRESSION) {
+        variant |= RoomShard::kVARIANT_COMPRESSED;
+    }
+    if (features & ProtocolFeature::kFEATURE_BATCH) {
+        variant |= RoomShard::kVARIANT_BATCH;
+    }
+    return variant;
 }
 
 // [send] S2C_CreateAccountSuccessAckMsg
 int ChatServer::AckCreateAccountSuccess(SOCKET clientSocket, const std::string& email, uint64 userId) {
     S2C_CreateAccountSuccessAckMsg msg{email, userId};
-    msg.Serialize(m_SendBuf);
-    return SendMsg(clientSocket, msg.header.packetSize);
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
 }
 
 // [send] S2C_CreateAccountFailureAckMsg
 int ChatServer::AckCreateAccountFailure(SOCKET clientSocket, uint16 reason, const std::string& email) {
     S2C_CreateAccountFailureAckMsg msg{reason, email};
-    msg.Serialize(m_SendBuf);
-    return SendMsg(clientSocket, msg.header.packetSize);
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
 }
 
 // [send] S2C_AuthenticateAccountSuccessAckMsg
 int ChatServer::AckAuthenticateAccountSuccess(SOCKET clientSocket, const std::string& email,
                                               const std::vector<std::string>& roomNames) {
     S2C_AuthenticateAccountSuccessAckMsg msg{email, roomNames};
-    msg.Serialize(m_SendBuf);
-    return SendMsg(clientSocket, msg.header.packetSize);
+    Serialize(msg, m_SendChain, ClientWireFormat(clientSocket));
+    return SendChain(clientSocket, m_SendChain);
 }
 
 // [send] S2C_AuthenticateAccountFailureAckMsg
 int ChatServer::AckAuthenticateAccountFailure(SOCKET clientSocket, uint16 reason, const std::string& email) {
     S2C_AuthenticateAccountFailureAckMsg msg{reason, email};
-    msg.Serialize(m_SendBuf);
-    return SendMsg(clientSocket, msg.header.packetSize);
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
 }
 
 // [send] S2C_JoinRoomAckMsg
-int ChatServer::AckJoinRoom(SOCKET clientSocket, network::MessageStatus status, const std::string& roomName,
-                            std::vector<std::string>& userNames) {
-    S2C_JoinRoomAckMsg msg{static_cast<uint16>(status), roomName, userNames};
-    msg.Serialize(m_SendBuf);
-    return SendMsg(clientSocket, msg.header.packetSize);
-}
-
-// [send] S2C_JoinRoomNtfMsg
-int ChatServer::BroadcastJoinRoom(const std::set<std::string>& usersInRoom, const std::string& roomName,
-                                  const std::string& userName) {
-    for (const std::string& name : usersInRoom) {
-        if (name != userName) {
-            std::map<std::string, SOCKET>::iterator it = m_UserName2ClientSocketMap.find(name);
-            if (it != m_UserName2ClientSocketMap.end()) {
-                S2C_JoinRoomNtfMsg msg{roomName, userName};
-                msg.Serialize(m_SendBuf);
-                SendMsg(it->second, msg.header.packetSize);
-            }
-        }
+// the successful acks are sent by the room's shard, see RoomShard::JoinRoom
+int ChatServer::AckJoinRoom(SOCKET clientSocket, network::MessageStatus status, const std::string& roomName) {
+    S2C_JoinRoomAckMsg msg{static_cast<uint16>(status), kINVALID_ID, roomName};
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
+}
+
+// [send] S2C_LeaveRoomAckMsg
+int ChatServer::AckLeaveRoom(SOCKET clientSocket, network::MessageStatus status, uint32 roomId) {
+    S2C_LeaveRoomAckMsg msg{static_cast<uint16>(status), roomId};
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
+}
+
+// [send] S2C_ChatInRoomAckMsg
+int ChatServer::AckChatInRoom(SOCKET clientSocket, network::MessageStatus status, uint32 roomId) {
+    S2C_ChatInRoomAckMsg msg{static_cast<uint16>(status), roomId};
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
+}
+
+// [send] S2C_ListMembersAckMsg
+// the successful acks are sent by the room's shard, see RoomShard::ListMembers
+int ChatServer::AckListMembers(SOCKET clientSocket, network::MessageStatus status, uint32 roomId) {
+    S2C_ListMembersAckMsg msg{static_cast<uint16>(status), roomId};
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
+}
+
+// [send] S2C_CreateRoomAckMsg
+int ChatServer::AckCreateRoom(SOCKET clientSocket, network::MessageStatus status, uint32 roomId,
+                              const std::string& roomName) {
+    S2C_CreateRoomAckMsg msg{static_cast<uint16>(status), roomId, roomName};
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
+}
+
+// [send] S2C_DeleteRoomAckMsg
+// the other acks are sent by the room's shard, see RoomShard::DeleteRoom
+int ChatServer::AckDeleteRoom(SOCKET clientSocket, network::MessageStatus status, uint32 roomId) {
+    S2C_DeleteRoomAckMsg msg{static_cast<uint16>(status), roomId};
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
+}
+
+// [send] S2C_RoomHistoryAckMsg
+// the other acks are sent by the room's shard, see RoomShard::RoomHistory
+int ChatServer::AckRoomHistory(SOCKET clientSocket, network::MessageStatus status, uint32 roomId) {
+    S2C_RoomHistoryAckMsg msg{static_cast<uint16>(status), roomId};
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
+}
+
+// [send] S2C_SearchRoomAckMsg
+// the other acks are sent by the room's shard, see RoomShard::SearchRoom
+int ChatServer::AckSearchRoom(SOCKET clientSocket, network::MessageStatus status, uint32 roomId) {
+    S2C_SearchRoomAckMsg msg{static_cast<uint16>(status), roomId};
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
+}
+
+// [send] S2C_DirectMessageAckMsg
+int ChatServer::AckDirectMessage(SOCKET clientSocket, network::MessageStatus status, uint32 toUserId) {
+    S2C_DirectMessageAckMsg msg{static_cast<uint16>(status), toUserId};
+    uint32 packetSize = Serialize(msg, m_SendBuf, ClientWireFormat(clientSocket));
+    return SendMsg(clientSocket, packetSize);
+}
+
+// [send] S2C_DirectMessageNtfMsg
+// an offline recipient gets the plain encoding in the inbox of its shard (toUserId % shard count), so any client
+// can read it on login, stamped like the room requests so it is merged with the chats of its rooms in order.
+// The shards are not running, the RunLoop thread only runs them from RunRoomShards.
+int ChatServer::NotifyDirectMessage(uint32 fromUserId, uint32 toUserId, const std::string& chat) {
+    S2C_DirectMessageNtfMsg& ntf = m_DirectMessageNtf;  // reused, so its strings keep their capacity
+    ntf.fromUserId = fromUserId;
+    ntf.fromUserName = m_UserNames[fromUserId];
+    ntf.chat = chat;
+
+    SOCKET recipientSocket = m_UserSockets[toUserId];
+    if (recipientSocket != INVALID_SOCKET) {
+        uint32 packetSize = Serialize(ntf, m_SendBuf, ClientWireFormat(recipientSocket));
+        return SendMsg(recipientSocket, packetSize);
     }
+
+    uint32 packetSize = Serialize(ntf, m_SendBuf);
+    RoomShard::SharedPacket packet = std::make_shared<const std::string>(m_SendBuf.ConstData(), packetSize);
+    m_RoomShards[toUserId % m_RoomShards.size()]->StoreInbox(toUserId, m_NextSequence++, packet);
     return 0;
 }
 
-// [send] S2C_LeaveRoomAckMsg
-int ChatServer::AckLeaveRoom(SOCKET clientSocket, network::MessageStatus status, const std::string& roomName,
-                             const std::string& userName) {
-    S2C_LeaveRoomAckMsg msg{static_cast<uint16>(status), roomName, userName};
-    msg.Serialize(m_SendBuf);
-    return SendMsg(clientSocket, msg.header.packetSize);
-}
-
-// [send] S2C_LeaveRoomNtfMsg
-int ChatServer::BroadcastLeaveRoom(const std::set<std::string>& usersInRoom, const std::string& roomName,
-                                   const std::string& userName) {
-    for (const std::string& name : usersInRoom) {
-        std::map<std::string, SOCKET>::iterator it = m_UserName2ClientSocketMap.find(name);
-        if (it != m_UserName2ClientSocketMap.end()) {
-            S2C_LeaveRoomNtfMsg msg{roomName, userName};
-            msg.Serialize(m_SendBuf);
-            SendMsg(it->second, msg.header.packetSize);
+// [send] S2C_NegotiateProtocolAckMsg
+int ChatServer::AckNegotiateProtocol(SOCKET clientSocket, uint32 features) {
+    S2C_NegotiateProtocolAckMsg msg{features};
+    uint32 packetSize = Serialize(msg, m_SendBuf);
+    return SendMsg(clientSocket, packetSize);
+}
+
+// The wire format negotiated with a client, clients that never negotiated get the original fixed format
+WireFormat ChatServer::ClientWireFormat(SOCKET clientSocket) const {
+    if (ClientFeatures(clientSocket) & ProtocolFeature::kFEATURE_COMPACT_WIRE) {
+        return WireFormat::kCOMPACT;
+    }
+    return WireFormat::kFIXED;
+}
+
+// The ProtocolFeature flags negotiated with a client (none for the AuthServer socket)
+uint32 ChatServer::ClientFeatures(SOCKET clientSocket) const {
+    std::unordered_map<SOCKET, uint32>::const_iterator it = m_ClientFeatures.find(clientSocket);
+    return it != m_ClientFeatures.end() ? it->second : 0;
+}
+
+// Register a room, returns its id. Its state is allocated by its shard on the first join.
+uint32 ChatServer::AddRoom(const std::string& roomName) {
+    uint32 roomId = static_cast<uint32>(m_RoomNames.size());
+    m_RoomIds[roomName] = roomId;
+    m_RoomNames.push_back(roomName);
+    AppendRegistry(Registry::kROOM, roomId, roomName);
+    return roomId;
+}
+
+// Whether a roomId names a registered room, the ids of deleted rooms are not reused
+bool ChatServer::RoomExists(uint32 roomId) const { return roomId < m_RoomNames.size() && !m_RoomNames[roomId].empty(); }
+
+// The number of chats a room keeps, its own setting or the default
+uint32 ChatServer::RoomHistoryCapacity(uint32 roomId) const {
+    std::map<uint32, uint32>::const_iterator it = m_RoomHistoryCapacities.find(roomId);
+    return it != m_RoomHistoryCapacities.end() ? it->second : m_HistoryCapacity;
+}
+
+// Fill the names of the registered rooms, dormant ones included, up to kMAX_LISTED_ROOMS. The oldest rooms come
+// first, the deleted ones are skipped.
+void ChatServer::ListRoomNames(std::vector<std::string>& outRoomNames) const {
+    outRoomNames.clear();
+    for (size_t roomId = 0; roomId < m_RoomNames.size() && outRoomNames.size() < kMAX_LISTED_ROOMS; roomId++) {
+        if (!m_RoomNames[roomId].empty()) {
+            outRoomNames.push_back(m_RoomNames[roomId]);
         }
     }
-    return 0;
 }
 
-// [send] S2C_ChatInRoomAckMsg
-int ChatServer::AckChatInRoom(SOCKET clientSocket, network::MessageStatus status, const std::string& roomName,
-                              const std::string& userName) {
-    S2C_ChatInRoomAckMsg msg{MessageStatus::kSUCCESS, roomName, userName};
-    msg.Serialize(m_SendBuf);
-    return SendMsg(clientSocket, msg.header.packetSize);
-}
-
-// [send] S2C_ChatInRoomNtfMsg
-int ChatServer::BroadcastChatInRoom(const std::set<std::string>& usersInRoom, const std::string& roomName,
-                                    const std::string& userName, const std::string& chat) {
-    for (const std::string& name : usersInRoom) {
-        std::map<std::string, SOCKET>::iterator it = m_UserName2ClientSocketMap.find(name);
-        if (it != m_UserName2ClientSocketMap.end()) {
-            S2C_ChatInRoomNtfMsg msg{roomName, userName, chat};
-            msg.Serialize(m_SendBuf);
-            SendMsg(it->second, msg.header.packetSize);
+// Queue the chats a user missed while offline, they go out after the authentication ack with the rest of this
+// loop iteration. Each shard keeps the chats of its rooms and the direct messages of its users, in sequence order,
+// so merging them gives the order they were sent in. The shards are not running, the RunLoop thread only runs
+// them from RunRoomShards.
+void ChatServer::DeliverInbox(uint32 userId) {
+    if (m_UserSockets[userId] == INVALID_SOCKET) {
+        return;
+    }
+
+    m_InboxEntries.clear();
+    uint32 dropped = 0;
+    for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+        size_t middle = m_InboxEntries.size();
+        dropped += shard->TakeInbox(userId, m_InboxEntries);
+        std::inplace_merge(m_InboxEntries.begin(), m_InboxEntries.begin() + middle, m_InboxEntries.end(),
+                           [](const OfflineInbox::Entry& a, const OfflineInbox::Entry& b) {
+                               return a.sequence < b.sequence;
+                           });
+    }
+    if (m_InboxEntries.empty()) {
+        return;
+    }
+
+    printf("'%s' missed %u chats (%u more were dropped).\n", m_UserNames[userId].c_str(),
+           static_cast<uint32>(m_InboxEntries.size()), dropped);
+    m_RoomShards[userId % m_RoomShards.size()]->EnqueueInbox(userId, m_InboxEntries);
+    m_InboxEntries.clear();
+}
+
+// Give a user the next userId, offline
+uint32 ChatServer::InternUser(const std::string& userName) {
+    uint32 userId = static_cast<uint32>(m_UserNames.size());
+    m_UserNames.push_back(userName);
+    m_UserSockets.push_back(INVALID_SOCKET);
+    m_UserPacketVariants.push_back(0);
+    m_UserPending.push_back(0);
+    m_HoldStarts.push_back(std::chrono::steady_clock::time_point());
+    m_UserIds[userName] = userId;
+    return userId;
+}
+
+// Bind an authenticated user to its connection, interning the user on first sight. Returns the userId.
+uint32 ChatServer::BindSession(SOCKET clientSocket, const std::string& userName) {
+    uint32 userId = kINVALID_ID;
+    std::map<std::string, uint32>::iterator it = m_UserIds.find(userName);
+    if (it != m_UserIds.end()) {
+        userId = it->second;
+    } else {
+        userId = InternUser(userName);
+        AppendRegistry(Registry::kUSER, userId, userName);
+    }
+
+    UnbindSession(clientSocket);            // the connection may have been someone else before
+    FlushOutboxOf(m_UserSockets[userId]);  // what was queued for the previous connection goes to it
+    m_UserSockets[userId] = clientSocket;
+    m_UserPacketVariants[userId] = PacketVariant(clientSocket);
+    m_Sessions[clientSocket] = userId;
+    return userId;
+}
+
+// Forget the session and any pending auth request of a connection, the user keeps its id and room memberships.
+// The chats still queued for it go back to the inbox, it gets them on its next login.
+void ChatServer::UnbindSession(SOCKET clientSocket) {
+    m_ClientSocket2UserNameMap.erase(clientSocket);
+
+    std::unordered_map<SOCKET, uint32>::iterator it = m_Sessions.find(clientSocket);
+    if (it == m_Sessions.end()) {
+        return;
+    }
+    // the user may have logged in again from another connection
+    uint32 userId = it->second;
+    if (m_UserSockets[userId] == clientSocket) {
+        for (const std::unique_ptr<RoomShard>& shard : m_RoomShards) {
+            shard->StashOutbox(userId);
         }
+        m_HoldStarts[userId] = std::chrono::steady_clock::time_point();
+        m_UserSockets[userId] = INVALID_SOCKET;
     }
-    return 0;
+    m_Sessions.erase(it);
 }
 
-// Send message
+// The userId authenticated on a connection, kINVALID_ID if none
+uint32 ChatServer::SessionUserId(SOCKET clientSocket) const {
+    std::unordered_map<SOCKET, uint32>::const_iterator it = m_Sessions.find(clientSocket);
+    return it != m_Sessions.end() ? it->second : kINVALID_ID;
+}
+
+// Send the message serialized in m_SendBuf, compressed if the client negotiated it and it is worth it
 int ChatServer::SendMsg(SOCKET sock, uint32 packetSize) {
+    if (ClientFeatures(sock) & ProtocolFeature::kFEATURE_COMPRESSION) {
+        uint32 compressedSize = CompressPacket(m_SendBuf.ConstData(), packetSize, m_CompressBuf);
+        if (compressedSize > 0) {
+            return SendBytes(sock, m_CompressBuf.ConstData(), compressedSize);
+        }
+    }
+    return SendBytes(sock, m_SendBuf.ConstData(), packetSize);
+}
+
+// Send an encoded packet
+int ChatServer::SendBytes(SOCKET sock, const char* data, uint32 size) {
+    FlushOutboxOf(sock);
+
     // https://learn.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-send
-    int sendResult = send(sock, m_SendBuf.ConstData(), packetSize, 0);
+    int sendResult = send(sock, data, size, 0);
     if (sendResult == SOCKET_ERROR) {
         printf("send failed with error %d\n", WSAGetLastError());
         WSACleanup();
@@ -582,6 +1509,38 @@ int ChatServer::SendMsg(SOCKET sock, uint32 packetSize) {
     return 0;
 }
 
+// Send a segment chain with a single scatter-gather call
+int ChatServer::SendChain(SOCKET sock, const ChainBuffer& chain) {
+    FlushOutboxOf(sock);
+
+    // a compressed packet is much smaller, it is simpler to flatten the chain first
+    if ((ClientFeatures(sock) & ProtocolFeature::kFEATURE_COMPRESSION) &&
+        chain.Size() >= sizeof(PacketHeader) + kCOMPRESSION_THRESHOLD) {
+        std::string packet = chain.Flatten();
+        uint32 compressedSize = CompressPacket(packet.data(), static_cast<uint32>(packet.size()), m_CompressBuf);
+        if (compressedSize > 0) {
+            return SendBytes(sock, m_CompressBuf.ConstData(), compressedSize);
+        }
+    }
+
+    chain.GetIoVecs(m_SendIoVecs);
+
+    m_SendWsaBufs.resize(m_SendIoVecs.size());
+    for (size_t i = 0; i < m_SendIoVecs.size(); i++) {
+        m_SendWsaBufs[i].buf = const_cast<char*>(m_SendIoVecs[i].base);
+        m_SendWsaBufs[i].len = static_cast<ULONG>(m_SendIoVecs[i].len);
+    }
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/winsock2/nf-winsock2-wsasend
+    DWORD bytesSent = 0;
+    int sendResult = WSASend(sock, m_SendWsaBufs.data(), static_cast<DWORD>(m_SendWsaBufs.size()), &bytesSent, 0,
+                             NULL, NULL);
+    if (sendResult == SOCKET_ERROR) {
+        printf("WSASend failed with error %d\n", WSAGetLastError());
+    }
+    return 0;
+}
+
 // Shutdown and cleanup
 void ChatServer::Shutdown() {
     printf("shutting down server ...\n");
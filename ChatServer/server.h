@@ -3,13 +3,26 @@
 #define WIN32_LEAN_AND_MEAN
 #include <WinSock2.h>
 
+#include <chrono>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "auth.pb.h"
+#include "batch.h"
 #include "buffer.h"
+#include "chain_buffer.h"
+#include "chat_log.h"
+#include "chat_room.h"
+#include "frame_reader.h"
 #include "message.h"
+#include "registry.h"
+#include "room_shard.h"
+#include "search_index.h"
+#include "worker_pool.h"
 
 // ChatClient connection related info
 struct ChatConnectionInfo {
@@ -34,6 +47,26 @@ public:
     ~ChatServer();
 
     int RunLoop();
+    void SetAuthBatching(uint32 maxCount, uint32 windowMs);
+
+    // the number of chats replayed to the users who join, for every room / for one room, and the memory they may
+    // use in total, the oldest chats of the rooms go first when it is exceeded
+    void SetHistoryCapacity(uint32 capacity);
+    void SetRoomHistoryCapacity(const std::string& roomName, uint32 capacity);
+    void SetHistoryBudget(size_t bytes);
+
+    // how often the members of a room are told of its membership changes, in one frame per room. 0 notifies them
+    // at the end of each loop iteration.
+    void SetPresenceTick(uint32 tickMs);
+
+    // Hold the notifications queued for a connection for up to holdMs, or until flushBytes are waiting, so a chatty
+    // room costs one send per connection and hold. Replies to a request and direct messages are never held.
+    // A holdMs of 0 (the default) sends everything at the end of each loop iteration.
+    void SetOutboundBatching(uint32 holdMs, size_t flushBytes);
+
+    // the chats kept for each offline user and the memory they may use in total, the oldest chats go first.
+    // A user gets at most capacity chats and maxBytes from the rooms of each shard on login.
+    void SetInboxCapacity(uint32 capacity, size_t maxBytes, size_t budget);
 
     // Requests (to AuthServer)
     int ReqCreateAccountWeb(SOCKET chatClientSocket, const std::string& email, const std::string& password);
@@ -45,24 +78,52 @@ public:
     int AckAuthenticateAccountSuccess(SOCKET clientSocket, const std::string& email,
                                       const std::vector<std::string>& roomNames);
     int AckAuthenticateAccountFailure(SOCKET clientSocket, uint16 reason, const std::string& email);
-    int AckJoinRoom(SOCKET clientSocket, network::MessageStatus status, const std::string& roomName,
-                    std::vector<std::string>& userNames);
-    int BroadcastJoinRoom(const std::set<std::string>& usersInRoom, const std::string& roomName,
-                          const std::string& userName);
-    int AckLeaveRoom(SOCKET clientSocket, network::MessageStatus status, const std::string& roomName,
-                     const std::string& userName);
-    int BroadcastLeaveRoom(const std::set<std::string>& usersInRoom, const std::string& roomName,
-                           const std::string& userName);
-    int AckChatInRoom(SOCKET clientSocket, network::MessageStatus status, const std::string& roomName,
-                      const std::string& userName);
-    int BroadcastChatInRoom(const std::set<std::string>& usersInRoom, const std::string& roomName,
-                            const std::string& userName, const std::string& chat);
+    int AckJoinRoom(SOCKET clientSocket, network::MessageStatus status, const std::string& roomName);
+    int AckLeaveRoom(SOCKET clientSocket, network::MessageStatus status, uint32 roomId);
+    int AckChatInRoom(SOCKET clientSocket, network::MessageStatus status, uint32 roomId);
+    int AckListMembers(SOCKET clientSocket, network::MessageStatus status, uint32 roomId);
+    int AckCreateRoom(SOCKET clientSocket, network::MessageStatus status, uint32 roomId, const std::string& roomName);
+    int AckDeleteRoom(SOCKET clientSocket, network::MessageStatus status, uint32 roomId);
+    int AckRoomHistory(SOCKET clientSocket, network::MessageStatus status, uint32 roomId);
+    int AckSearchRoom(SOCKET clientSocket, network::MessageStatus status, uint32 roomId);
+    int AckDirectMessage(SOCKET clientSocket, network::MessageStatus status, uint32 toUserId);
+    int NotifyDirectMessage(uint32 fromUserId, uint32 toUserId, const std::string& chat);
+    int AckNegotiateProtocol(SOCKET clientSocket, uint32 features);
 
 private:
     int InitChatService(uint16 port);
     int InitAuthConn(const std::string& ip, uint16 port);
+    void InitChatLog();
+    void AppendRegistry(Registry::Kind kind, uint32 id, const std::string& name);
     int SendMsg(SOCKET socket, uint32 packetSize);  // the name SendMessage is already taken by Windows
+    int SendBytes(SOCKET socket, const char* data, uint32 size);
+    int SendChain(SOCKET socket, const network::ChainBuffer& chain);
+    int QueueAuthReq(uint32 packetSize);
+    int FlushAuthBatch();
+    uint32 AuthBatchTimeLeftMs() const;
+    uint32 PresenceTimeLeftMs() const;
     void HandleMessage(network::MessageType msgType, SOCKET clientSocket);
+    network::WireFormat ClientWireFormat(SOCKET clientSocket) const;
+    uint32 ClientFeatures(SOCKET clientSocket) const;
+    void PostRoomCommand(RoomCommand* command);
+    void RunRoomShards();
+    void FlushOutboxes();
+    int FlushOutbox(uint32 userId, std::vector<WSABUF>& wsaBufs);
+    void FlushOutboxOf(SOCKET clientSocket);
+    bool HoldOutbox(uint32 userId, std::chrono::steady_clock::time_point now);
+    uint32 OutboundTimeLeftMs() const;
+    uint32 PacketVariant(SOCKET clientSocket) const;
+    uint32 AddRoom(const std::string& roomName);
+    bool RoomExists(uint32 roomId) const;
+    uint32 RoomHistoryCapacity(uint32 roomId) const;
+    void ListRoomNames(std::vector<std::string>& outRoomNames) const;
+    void DeliverInbox(uint32 userId);
+
+    // a session binds an authenticated user to its connection
+    uint32 InternUser(const std::string& userName);
+    uint32 BindSession(SOCKET clientSocket, const std::string& userName);
+    void UnbindSession(SOCKET clientSocket);
+    uint32 SessionUserId(SOCKET clientSocket) const;
     void Shutdown();
 
 private:
@@ -77,10 +138,113 @@ private:
 
     static constexpr int kSEND_BUF_SIZE = 512;
     network::Buffer m_SendBuf{kSEND_BUF_SIZE};
+    network::Buffer m_CompressBuf{kSEND_BUF_SIZE};  // the compressed form of the packet being sent
+
+    // large messages (room/user lists) are assembled in a segment chain and sent with one scatter-gather call
+    network::ChainBuffer m_SendChain;
+    std::vector<network::IoVec> m_SendIoVecs;
+    std::vector<WSABUF> m_SendWsaBufs;
+
+    // the AuthServer messages are reused, so their strings keep their capacity between requests
+    auth::CreateAccountWeb m_CreateAccountWebReq;
+    auth::AuthenticateWeb m_AuthenticateWebReq;
+    auth::CreateAccountWebSuccess m_CreateAccountWebSuccess;
+    auth::CreateAccountWebFailure m_CreateAccountWebFailure;
+    auth::AuthenticateWebSuccess m_AuthenticateWebSuccess;
+    auth::AuthenticateWebFailure m_AuthenticateWebFailure;
+
+    // so are the direct messages, the busiest path
+    network::C2S_DirectMessageReqMsg m_DirectMessageReq;
+    network::S2C_DirectMessageNtfMsg m_DirectMessageNtf;
+
+    // the protocol features this server asks AuthServer for when the link is set up, and those it accepted
+    static constexpr uint32 kSUPPORTED_AUTH_FEATURES =
+        network::ProtocolFeature::kFEATURE_BATCH | network::ProtocolFeature::kFEATURE_FIXED_LAYOUT;
+    uint32 m_AuthFeatures = network::ProtocolFeature::kFEATURE_NONE;
+
+    // auth requests are sent to AuthServer in batches, so a reconnect storm costs one packet per batch
+    static constexpr uint32 kAUTH_BATCH_MAX_COUNT = 32;
+    static constexpr uint32 kAUTH_BATCH_WINDOW_MS = 5;
+    network::Buffer m_AuthBatchBuf{kSEND_BUF_SIZE};
+    network::BatchWriter m_AuthBatch{m_AuthBatchBuf};
+    std::chrono::steady_clock::time_point m_AuthBatchStart;  // when the first pending request was queued
+    uint32 m_AuthBatchMaxCount = kAUTH_BATCH_MAX_COUNT;
+    uint32 m_AuthBatchWindowMs = kAUTH_BATCH_WINDOW_MS;
+
+    // reassembles packets that span several recv() calls, per socket (including the AuthServer socket)
+    std::map<SOCKET, network::FrameReader> m_FrameReaders;
+
+    // the protocol features this server can enable for a client
+    static constexpr uint32 kSUPPORTED_FEATURES = network::ProtocolFeature::kFEATURE_COMPACT_WIRE |
+                                                  network::ProtocolFeature::kFEATURE_BATCH |
+                                                  network::ProtocolFeature::kFEATURE_COMPRESSION;
+
+    // Server cache, the connection tables are hashed since every request looks them up
+    std::unordered_map<SOCKET, uint32> m_ClientFeatures;       // SOCKET -> negotiated ProtocolFeature flags
+    std::map<SOCKET, std::string> m_ClientSocket2UserNameMap;  // SOCKET -> userName (string), pending auth
+    std::unordered_map<SOCKET, uint32> m_Sessions;             // SOCKET -> authenticated userId
+
+    // interned users and rooms, the ids on the wire index these arrays
+    std::vector<std::string> m_UserNames;     // userId -> userName
+    std::vector<SOCKET> m_UserSockets;        // userId -> SOCKET, INVALID_SOCKET when offline
+    std::vector<uint8> m_UserPacketVariants;  // userId -> broadcast variant of its connection
+    std::map<std::string, uint32> m_UserIds;  // userName -> userId, only used when binding a session
+    std::map<std::string, uint32> m_RoomIds;  // roomName -> roomId, only used by JoinRoom and CreateRoom
+    std::vector<std::string> m_RoomNames;     // roomId -> roomName, empty once deleted
+
+    // the room state lives in the shards, only for the active rooms (see RoomShard)
+    static constexpr size_t kMAX_ROOM_NAME_SIZE = 64;
+    static constexpr size_t kMAX_LISTED_ROOMS = 100;                 // sent with the authentication ack
+    static constexpr long long kROOM_SWEEP_INTERVAL_MS = 10 * 1000;  // how often the idle rooms are reclaimed
+    std::chrono::steady_clock::time_point m_NextRoomSweep;
+    std::vector<std::string> m_ListedRoomNames;
+
+    // the history capacity of the rooms, and the rooms configured otherwise
+    uint32 m_HistoryCapacity = RoomShard::kHISTORY_CAPACITY;
+    std::map<uint32, uint32> m_RoomHistoryCapacities;  // roomId -> capacity
+
+    // the users the shards queued packets for during a loop iteration, sent at its end
+    std::vector<uint8> m_UserPending;    // userId -> 1 if listed in m_PendingUsers
+    std::vector<uint32> m_PendingUsers;  // each listed once
+
+    // the outbound batching: the users whose notifications are held, since when, and when the first hold expires
+    static constexpr size_t kOUTBOUND_FLUSH_BYTES = 16 * 1024;
+    uint32 m_OutboundHoldMs = 0;
+    size_t m_OutboundFlushBytes = kOUTBOUND_FLUSH_BYTES;
+    std::vector<uint32> m_HeldUsers;
+    std::vector<std::chrono::steady_clock::time_point> m_HoldStarts;  // userId -> when its hold began, or the epoch
+    std::chrono::steady_clock::time_point m_NextHoldDeadline;
+
+    // the room shards and the outboxes run on the fan-out threads
+    static constexpr size_t kPARALLEL_FAN_OUT_THRESHOLD = 1024;
+    static constexpr size_t kMAX_FAN_OUT_THREADS = 7;
+    WorkerPool m_FanOutPool;
+    std::vector<std::vector<WSABUF>> m_FanOutWsaBufs;  // per fan-out thread scratch space
+
+    // room requests go to the shard owning the room (roomId % kROOM_SHARDS). The count does not follow the cores: each
+    // shard appends to its own chat log partition, so a data directory only finds its rooms' chats with the same count.
+    // The fan-out threads run the shards in contiguous chunks, several per thread on a machine with fewer cores.
+    static constexpr size_t kROOM_SHARDS = kMAX_FAN_OUT_THREADS + 1;
+    std::vector<std::unique_ptr<RoomShard>> m_RoomShards;
+    bool m_RoomCommandsPosted = false;  // some shard has requests to run
+    uint64 m_NextSequence = 0;          // stamps the room requests and the direct messages, in the order they came
+
+    // scratch space of DeliverInbox, the inboxes of a user in every shard merged by sequence
+    std::vector<OfflineInbox::Entry> m_InboxEntries;
+
+    // the membership changes are notified by the shards every presence tick
+    uint32 m_PresenceTickMs = RoomShard::kPRESENCE_TICK_MS;
+    std::chrono::steady_clock::time_point m_NextPresenceFlush;
+    bool m_PresencePending = false;  // some shard has changes to notify
+
+    // the persistent chat log, one partition per room shard, flushed by the committer thread, and the ids its records
+    // name (m_UserNames and m_RoomNames)
+    static constexpr const char* kCHAT_LOG_DIRECTORY = "chatlog";
+    std::unique_ptr<Registry> m_Registry;
+    std::vector<std::unique_ptr<ChatLog>> m_ChatLogs;
+    std::unique_ptr<ChatLogCommitter> m_ChatLogCommitter;  // declared after the logs, so it stops before they close
 
-    // Server cache
-    std::map<std::string, SOCKET> m_UserName2ClientSocketMap;  // userName (string) -> SOCKET
-    std::map<SOCKET, std::string> m_ClientSocket2UserNameMap;  // SOCKET -> userName (string)
-    std::map<std::string, std::set<std::string>> m_RoomMap;    // roomName (string) -> userNames (set of string)
-    std::vector<std::string> m_RoomNames;                      // all the keys of m_RoomMap
+    // the full-text index of each chat log partition, compressed and merged by the merger thread
+    std::vector<std::unique_ptr<SearchIndex>> m_SearchIndexes;
+    std::unique_ptr<SearchIndexMerger> m_SearchIndexMerger;  // declared after the indexes, like the committer
 };
@@ -0,0 +1,71 @@
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(size_t threadCount)
+    : m_Job(nullptr), m_Count(0), m_Generation(0), m_Running(0), m_Stop(false) {
+    for (size_t i = 0; i < threadCount; i++) {
+        m_Threads.emplace_back(&WorkerPool::WorkerLoop, this, i + 1);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stop = true;
+    }
+    m_JobReady.notify_all();
+    for (std::thread& thread : m_Threads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::Run(size_t count, const Job& job) {
+    size_t chunks = Concurrency();
+    if (chunks == 1 || count < chunks) {
+        job(0, 0, count);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Job = &job;
+        m_Count = count;
+        m_Running = m_Threads.size();
+        m_Generation++;
+    }
+    m_JobReady.notify_all();
+
+    job(0, 0, count / chunks);
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_JobDone.wait(lock, [this] { return m_Running == 0; });
+    m_Job = nullptr;
+}
+
+size_t WorkerPool::Concurrency() const { return m_Threads.size() + 1; }
+
+void WorkerPool::WorkerLoop(size_t worker) {
+    uint64 seenGeneration = 0;
+    while (true) {
+        const Job* job = nullptr;
+        size_t count = 0;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_JobReady.wait(lock, [this, seenGeneration] { return m_Stop || m_Generation != seenGeneration; });
+            if (m_Stop) {
+                return;
+            }
+            seenGeneration = m_Generation;
+            job = m_Job;
+            count = m_Count;
+        }
+
+        size_t chunks = Concurrency();
+        (*job)(worker, count * worker / chunks, count * (worker + 1) / chunks);
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Running--;
+        }
+        m_JobDone.notify_one();
+    }
+}
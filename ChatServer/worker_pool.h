@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+// A fixed set of threads running one data-parallel job at a time.
+// Run splits [0, count) into one contiguous chunk per thread, the calling thread takes the first chunk,
+// and returns once every chunk is done. A pool of 0 threads runs the whole job on the caller.
+class WorkerPool {
+public:
+    // worker is the index of the thread running the chunk (0 = caller), to pick per-thread scratch space
+    typedef std::function<void(size_t worker, size_t begin, size_t end)> Job;
+
+    explicit WorkerPool(size_t threadCount);
+    ~WorkerPool();
+
+    void Run(size_t count, const Job& job);
+
+    // the number of chunks a job is split into, including the caller's
+    size_t Concurrency() const;
+
+private:
+    void WorkerLoop(size_t worker);
+
+private:
+    std::vector<std::thread> m_Threads;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_JobReady;
+    std::condition_variable m_JobDone;
+
+    // the current job, guarded by m_Mutex
+    const Job* m_Job;
+    size_t m_Count;
+    uint64 m_Generation;  // bumped for every job, so a worker runs each job once
+    size_t m_Running;     // workers that have not finished their chunk yet
+    bool m_Stop;
+};
@@ -0,0 +1,60 @@
+#include "batch.h"
+
+namespace network {
+BatchWriter::BatchWriter(Buffer& buf) : m_Buf(buf), m_PacketSize(0), m_Count(0) {}
+
+BatchWriter::~BatchWriter() {}
+
+void BatchWriter::Begin() {
+    m_Buf.Reset();
+    m_Buf.SetWireFormat(WireFormat::kFIXED);
+    m_Buf.WriteUInt32LE(0);  // patched by Finish
+    m_Buf.WriteUInt32LE(static_cast<uint32>(MessageType::kBATCH));
+    m_PacketSize = sizeof(PacketHeader);
+    m_Count = 0;
+}
+
+void BatchWriter::AddPacket(const char* packet, uint32 packetSize) {
+    m_Buf.Append(packet, packetSize);
+    m_PacketSize += packetSize;
+    m_Count++;
+}
+
+uint32 BatchWriter::Finish() {
+    m_Buf.WriteUInt32LE(0, m_PacketSize);
+    return m_PacketSize;
+}
+
+uint32 BatchWriter::Count() const { return m_Count; }
+
+BatchReader::BatchReader(const char* payload, uint32 payloadSize)
+    : m_Payload(payload), m_PayloadSize(payloadSize), m_ReadIndex(0), m_Corrupted(false) {}
+
+BatchReader::~BatchReader() {}
+
+bool BatchReader::NextFrame(const char*& outFrame, uint32& outFrameSize) {
+    if (m_Corrupted || m_ReadIndex == m_PayloadSize) {
+        return false;
+    }
+
+    uint32 available = m_PayloadSize - m_ReadIndex;
+    if (available < sizeof(PacketHeader)) {
+        m_Corrupted = true;
+        return false;
+    }
+
+    const uint8* head = reinterpret_cast<const uint8*>(m_Payload + m_ReadIndex);
+    uint32 packetSize = head[0] | (head[1] << 8) | (head[2] << 16) | (static_cast<uint32>(head[3]) << 24);
+    if (packetSize < sizeof(PacketHeader) || packetSize > available) {
+        m_Corrupted = true;
+        return false;
+    }
+
+    outFrame = m_Payload + m_ReadIndex;
+    outFrameSize = packetSize;
+    m_ReadIndex += packetSize;
+    return true;
+}
+
+bool BatchReader::IsCorrupted() const { return m_Corrupted; }
+}  // namespace network
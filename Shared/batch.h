@@ -0,0 +1,61 @@
+#pragma once
+
+#include "buffer.h"
+#include "message.h"
+#include "serializer.h"
+
+namespace network {
+// Packs several messages into a single kBATCH packet, so the header, the send() call and the dispatch
+// are paid once for the whole batch. Each nested message keeps its own header and wire format.
+// Batches are not nested.
+class BatchWriter {
+public:
+    explicit BatchWriter(Buffer& buf);
+    ~BatchWriter();
+
+    // Start a new batch, discarding the content of the buffer
+    void Begin();
+
+    template <typename Msg>
+    void Add(const Msg& msg, WireFormat format) {
+        m_PacketSize += SerializeAppend(msg, m_Buf, format);
+        m_Count++;
+    }
+
+    // Add a packet that is already encoded (header + payload), e.g. a protobuf message
+    void AddPacket(const char* packet, uint32 packetSize);
+
+    // Patch the batch header, returns the packet size
+    uint32 Finish();
+
+    uint32 Count() const;
+
+private:
+    Buffer& m_Buf;
+    uint32 m_PacketSize;
+    uint32 m_Count;
+};
+
+// Iterates the packets nested in the payload of a kBATCH packet.
+class BatchReader {
+public:
+    BatchReader(const char* payload, uint32 payloadSize);
+    ~BatchReader();
+
+    // Get the next nested packet (header + payload), returns false at the end of the batch
+    // or when a nested packet size is invalid.
+    bool NextFrame(const char*& outFrame, uint32& outFrameSize);
+
+    // true if a nested packet size does not fit in the batch
+    bool IsCorrupted() const;
+
+private:
+    const char* m_Payload;
+    uint32 m_PayloadSize;
+
+    // The index of the next nested packet
+    uint32 m_ReadIndex;
+
+    bool m_Corrupted;
+};
+}  // namespace network
@@ -1,14 +1,35 @@
 #include "buffer.h"
 
 #include <algorithm>
+#include <cstring>
+
+#include "byte_order.h"
 
 namespace network {
-Buffer::Buffer(uint32 size) : m_WriteIndex(0), m_ReadIndex(0) { m_Data.resize(size, 0); }
+Buffer::Buffer(uint32 size) : m_WriteIndex(0), m_ReadIndex(0), m_WireFormat(WireFormat::kFIXED) {
+    m_Data.resize(size, 0);
+}
 
-Buffer::Buffer(const char* rawBuf, uint32 len) { Set(rawBuf, len); }
+Buffer::Buffer(const char* rawBuf, uint32 len) : m_WireFormat(WireFormat::kFIXED) { Set(rawBuf, len); }
 
 Buffer::~Buffer() { m_Data.clear(); }
 
+// Grow the buffer so that it can hold at least requiredSize bytes.
+// The capacity is doubled (at least kGROW_SIZE) rather than increased by a fixed step,
+// so serializing a large message costs O(n) copies instead of O(n^2).
+void Buffer::Grow(size_t requiredSize) {
+    size_t oldSize = m_Data.size();
+    if (requiredSize <= oldSize) {
+        return;
+    }
+
+    size_t newSize = std::max(oldSize * 2, oldSize + kGROW_SIZE);
+    if (newSize < requiredSize) {
+        newSize = requiredSize;
+    }
+    m_Data.resize(newSize);
+}
+
 void Buffer::WriteUInt64LE(uint64 value) {
     WriteUInt64LE(m_WriteIndex, value);
     m_WriteIndex += 8;
@@ -16,32 +37,18 @@ void Buffer::WriteUInt64LE(uint64 value) {
 
 void Buffer::WriteUInt64LE(size_t index, uint64 value) {
     // grow when serializing past the write index
-    size_t oldSize = m_Data.size();
-    if (index + sizeof(value) > oldSize) {
-        m_Data.resize(oldSize + kGROW_SIZE);
-    }
+    Grow(index + sizeof(value));
 
-    m_Data[index] = value;
-    m_Data[index + 1] = value >> 8;
-    m_Data[index + 2] = value >> 16;
-    m_Data[index + 3] = value >> 24;
-    m_Data[index + 4] = value >> 32;
-    m_Data[index + 5] = value >> 40;
-    m_Data[index + 6] = value >> 48;
-    m_Data[index + 7] = value >> 56;
+    uint64 wireValue = HostToLE64(value);
+    memcpy(&m_Data[index], &wireValue, sizeof(wireValue));
 }
 
 void Buffer::WriteUInt32LE(size_t index, uint32 value) {
     // grow when serializing past the write index
-    size_t oldSize = m_Data.size();
-    if (index + sizeof(value) > oldSize) {
-        m_Data.resize(oldSize + kGROW_SIZE);
-    }
+    Grow(index + sizeof(value));
 
-    m_Data[index] = value;
-    m_Data[index + 1] = value >> 8;
-    m_Data[index + 2] = value >> 16;
-    m_Data[index + 3] = value >> 24;
+    uint32 wireValue = HostToLE32(value);
+    memcpy(&m_Data[index], &wireValue, sizeof(wireValue));
 }
 
 void Buffer::WriteUInt32LE(uint32 value) {
@@ -51,13 +58,10 @@ void Buffer::WriteUInt32LE(uint32 value) {
 
 void Buffer::WriteUInt16LE(size_t index, uint16 value) {
     // grow when serializing past the write index
-    size_t oldSize = m_Data.size();
-    if (index + sizeof(value) > oldSize) {
-        m_Data.resize(oldSize + kGROW_SIZE);
-    }
+    Grow(index + sizeof(value));
 
-    m_Data[index] = value;
-    m_Data[index + 1] = value >> 8;
+    uint16 wireValue = HostToLE16(value);
+    memcpy(&m_Data[index], &wireValue, sizeof(wireValue));
 }
 
 void Buffer::WriteUInt16LE(uint16 value) {
@@ -65,17 +69,33 @@ void Buffer::WriteUInt16LE(uint16 value) {
     m_WriteIndex += 2;
 }
 
-void Buffer::WriteString(size_t index, const std::string& str, uint32 strLen) {
+void Buffer::WriteUInt32Array(size_t index, const uint32* values, uint32 count) {
     // grow when serializing past the write index
-    size_t oldSize = m_Data.size();
-    if (index + strLen > oldSize) {
-        size_t newSize = oldSize + kGROW_SIZE;
-        while (newSize < index + strLen) {
-            newSize += kGROW_SIZE;
-        }
-        m_Data.resize(newSize);
+    size_t bytes = sizeof(uint32) * count;
+    Grow(index + bytes);
+    if (count == 0) {
+        return;
     }
 
+    if (kHOST_LITTLE_ENDIAN) {
+        memcpy(&m_Data[index], values, bytes);
+    } else {
+        // m_Data is not necessarily 4-byte aligned, swap into an aligned scratch first
+        std::vector<uint32> swapped(count);
+        ByteSwap32Array(swapped.data(), values, count);
+        memcpy(&m_Data[index], swapped.data(), bytes);
+    }
+}
+
+void Buffer::WriteUInt32Array(const uint32* values, uint32 count) {
+    WriteUInt32Array(m_WriteIndex, values, count);
+    m_WriteIndex += sizeof(uint32) * count;
+}
+
+void Buffer::WriteString(size_t index, const std::string& str, uint32 strLen) {
+    // grow when serializing past the write index
+    Grow(index + strLen);
+
     str.copy((char*)&m_Data[index], strLen);
 }
 
@@ -84,6 +104,15 @@ void Buffer::WriteString(const std::string& str, uint32 strLen) {
     m_WriteIndex += str.size();
 }
 
+void Buffer::Append(const void* data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    Grow(m_WriteIndex + len);
+    memcpy(&m_Data[m_WriteIndex], data, len);
+    m_WriteIndex += static_cast<uint32>(len);
+}
+
 uint64 Buffer::ReadUInt64LE() {
     uint64 newValue = ReadUInt64LE(m_ReadIndex);
     m_ReadIndex += 8;
@@ -92,27 +121,17 @@ uint64 Buffer::ReadUInt64LE() {
 }
 
 uint64 Buffer::ReadUInt64LE(size_t index) {
-    uint64 newValue = 0;
-    newValue |= m_Data[index];
-    newValue |= m_Data[index + 1] << 8;
-    newValue |= m_Data[index + 2] << 16;
-    newValue |= m_Data[index + 3] << 24;
-    newValue |= m_Data[index + 4] << 32;
-    newValue |= m_Data[index + 5] << 40;
-    newValue |= m_Data[index + 6] << 48;
-    newValue |= m_Data[index + 7] << 56;
+    uint64 wireValue = 0;
+    memcpy(&wireValue, &m_Data[index], sizeof(wireValue));
 
-    return newValue;
+    return HostToLE64(wireValue);
 }
 
 uint32 Buffer::ReadUInt32LE(size_t index) {
-    uint32 newValue = 0;
-    newValue |= m_Data[index];
-    newValue |= m_Data[index + 1] << 8;
-    newValue |= m_Data[index + 2] << 16;
-    newValue |= m_Data[index + 3] << 24;
+    uint32 wireValue = 0;
+    memcpy(&wireValue, &m_Data[index], sizeof(wireValue));
 
-    return newValue;
+    return HostToLE32(wireValue);
 }
 
 uint32 Buffer::ReadUInt32LE() {
@@ -123,11 +142,10 @@ uint32 Buffer::ReadUInt32LE() {
 }
 
 uint16 Buffer::ReadUInt16LE(size_t index) {
-    uint16 newValue = 0;
-    newValue |= m_Data[index];
-    newValue |= m_Data[index + 1] << 8;
+    uint16 wireValue = 0;
+    memcpy(&wireValue, &m_Data[index], sizeof(wireValue));
 
-    return newValue;
+    return HostToLE16(wireValue);
 }
 
 uint16 Buffer::ReadUInt16LE() {
@@ -137,6 +155,22 @@ uint16 Buffer::ReadUInt16LE() {
     return newValue;
 }
 
+void Buffer::ReadUInt32Array(size_t index, uint32* outValues, uint32 count) {
+    if (count == 0) {
+        return;
+    }
+
+    memcpy(outValues, &m_Data[index], sizeof(uint32) * count);
+    if (!kHOST_LITTLE_ENDIAN) {
+        ByteSwap32Array(outValues, outValues, count);
+    }
+}
+
+void Buffer::ReadUInt32Array(uint32* outValues, uint32 count) {
+    ReadUInt32Array(m_ReadIndex, outValues, count);
+    m_ReadIndex += sizeof(uint32) * count;
+}
+
 std::string Buffer::ReadString(size_t index, uint32 strLen) {
     std::string newStr{""};
     newStr.assign((const char*)&m_Data[index], strLen);
@@ -150,12 +184,78 @@ std::string Buffer::ReadString(uint32 strLen) {
     return newStr;
 }
 
+void Buffer::WriteVarUInt32(uint32 value) {
+    // grow when serializing past the write index
+    Grow(m_WriteIndex + kMAX_VARINT32_SIZE);
+    m_WriteIndex += EncodeVarUInt32(value, &m_Data[m_WriteIndex]);
+}
+
+uint32 Buffer::ReadVarUInt32() {
+    uint32 value = 0;
+    for (uint32 i = 0; i < kMAX_VARINT32_SIZE && m_ReadIndex < m_Data.size(); i++) {
+        uint8 byte = m_Data[m_ReadIndex++];
+        value |= static_cast<uint32>(byte & 0x7F) << (7 * i);
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    return value;
+}
+
+void Buffer::WriteLength(uint32 length) {
+    if (m_WireFormat == WireFormat::kCOMPACT) {
+        WriteVarUInt32(length);
+    } else {
+        WriteUInt32LE(length);
+    }
+}
+
+uint32 Buffer::ReadLength() { return m_WireFormat == WireFormat::kCOMPACT ? ReadVarUInt32() : ReadUInt32LE(); }
+
+void Buffer::WriteLengthArray(const uint32* lengths, uint32 count) {
+    if (m_WireFormat == WireFormat::kCOMPACT) {
+        for (uint32 i = 0; i < count; i++) {
+            WriteVarUInt32(lengths[i]);
+        }
+    } else {
+        WriteUInt32Array(lengths, count);
+    }
+}
+
+void Buffer::ReadLengthArray(uint32* outLengths, uint32 count) {
+    if (m_WireFormat == WireFormat::kCOMPACT) {
+        for (uint32 i = 0; i < count; i++) {
+            outLengths[i] = ReadVarUInt32();
+        }
+    } else {
+        ReadUInt32Array(outLengths, count);
+    }
+}
+
+void Buffer::WriteEnum16(uint16 value) {
+    if (m_WireFormat == WireFormat::kCOMPACT) {
+        WriteVarUInt32(value);
+    } else {
+        WriteUInt16LE(value);
+    }
+}
+
+uint16 Buffer::ReadEnum16() {
+    return m_WireFormat == WireFormat::kCOMPACT ? static_cast<uint16>(ReadVarUInt32()) : ReadUInt16LE();
+}
+
+void Buffer::SetWireFormat(WireFormat format) { m_WireFormat = format; }
+
+WireFormat Buffer::GetWireFormat() const { return m_WireFormat; }
+
 const char* Buffer::ConstData() { return (const char*)m_Data.data(); }
 
 char* Buffer::Data() { return (char*)m_Data.data(); }
 
 size_t Buffer::Size() const { return m_Data.size(); }
 
+size_t Buffer::ReadableBytes() const { return m_WriteIndex > m_ReadIndex ? m_WriteIndex - m_ReadIndex : 0; }
+
 void Buffer::Set(const char* rawBuf, uint32 len) {
     m_Data.resize(len, 0);
     std::fill(m_Data.begin(), m_Data.end(), 0);
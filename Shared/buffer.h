@@ -1,13 +1,15 @@
 #pragma once
 
 #include "common.h"
+#include "wire_format.h"
 
 #include <vector>
 #include <string>
 
 namespace network {
-// A buffer capable of serializing/deserializing uint16, uint32, uint64 and string, and
-// grow when serializing overflows.
+// A buffer capable of serializing/deserializing uint16, uint32, uint64, uint32 arrays, varints and string, and
+// grow when serializing overflows. Integers are stored little-endian regardless of the host byte order.
+// Length prefixes and status codes go through WriteLength/WriteEnum16, which follow the buffer's WireFormat.
 class Buffer {
 public:
     Buffer(uint32 size = 512);
@@ -17,25 +19,44 @@ public:
     void WriteUInt64LE(uint64 value);
     void WriteUInt32LE(uint32 value);
     void WriteUInt16LE(uint16 value);
+    void WriteUInt32Array(const uint32* values, uint32 count);
     void WriteString(const std::string& str, uint32 strLen);
+    void WriteVarUInt32(uint32 value);
+    void WriteLength(uint32 length);
+    void WriteLengthArray(const uint32* lengths, uint32 count);
+    void WriteEnum16(uint16 value);
+    void Append(const void* data, size_t len);
     uint64 ReadUInt64LE();
     uint32 ReadUInt32LE();
     uint16 ReadUInt16LE();
+    void ReadUInt32Array(uint32* outValues, uint32 count);
     std::string ReadString(uint32 strLen);
+    uint32 ReadVarUInt32();
+    uint32 ReadLength();
+    void ReadLengthArray(uint32* outLengths, uint32 count);
+    uint16 ReadEnum16();
+    void SetWireFormat(WireFormat format);
+    WireFormat GetWireFormat() const;
     const char* ConstData();
     char* Data();
     size_t Size() const;
+    size_t ReadableBytes() const;  // bytes written but not read yet
     void Set(const char* rawBuf, uint32 len);
     void Reset();
 
+    // overwrite 4 bytes already written, e.g. a size only known once the payload is written
+    void WriteUInt32LE(size_t index, uint32 value);
+
 private:
+    void Grow(size_t requiredSize);
     void WriteUInt64LE(size_t index, uint64 value);
-    void WriteUInt32LE(size_t index, uint32 value);
     void WriteUInt16LE(size_t index, uint16 value);
+    void WriteUInt32Array(size_t index, const uint32* values, uint32 count);
     void WriteString(size_t index, const std::string& str, uint32 strLen);
     uint64 ReadUInt64LE(size_t index);
     uint32 ReadUInt32LE(size_t index);
     uint16 ReadUInt16LE(size_t index);
+    void ReadUInt32Array(size_t index, uint32* outValues, uint32 count);
     std::string ReadString(size_t index, uint32 strLen);
 
 private:
@@ -48,7 +69,10 @@ private:
     // The index to read the next byte of data from the buffer
     uint32 m_ReadIndex;
 
-    // the size (in bytes) to grow when serializing past the write index
+    // the encoding of lengths and status codes, kept across Set/Reset
+    WireFormat m_WireFormat;
+
+    // the minimum size (in bytes) to grow when serializing past the write index
     static constexpr uint32 kGROW_SIZE = 256;
 };
 }  // namespace network
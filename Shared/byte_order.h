@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define NETWORK_HAS_SSE2 1
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define NETWORK_HAS_NEON 1
+#endif
+
+// Host byte order, detected at compile time.
+// The wire format is little-endian, so on little-endian hosts (all Windows targets) encoding is a plain copy.
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define NETWORK_LITTLE_ENDIAN 1
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define NETWORK_LITTLE_ENDIAN 0
+#else
+#error "unable to detect the host byte order"
+#endif
+
+namespace network {
+constexpr bool kHOST_LITTLE_ENDIAN = NETWORK_LITTLE_ENDIAN;
+
+inline uint16 ByteSwap16(uint16 value) {
+#if defined(_MSC_VER)
+    return _byteswap_ushort(value);
+#else
+    return __builtin_bswap16(value);
+#endif
+}
+
+inline uint32 ByteSwap32(uint32 value) {
+#if defined(_MSC_VER)
+    return _byteswap_ulong(value);
+#else
+    return __builtin_bswap32(value);
+#endif
+}
+
+inline uint64 ByteSwap64(uint64 value) {
+#if defined(_MSC_VER)
+    return _byteswap_uint64(value);
+#else
+    return __builtin_bswap64(value);
+#endif
+}
+
+// convert between host order and the little-endian wire order (the same operation both ways)
+inline uint16 HostToLE16(uint16 value) { return kHOST_LITTLE_ENDIAN ? value : ByteSwap16(value); }
+inline uint32 HostToLE32(uint32 value) { return kHOST_LITTLE_ENDIAN ? value : ByteSwap32(value); }
+inline uint64 HostToLE64(uint64 value) { return kHOST_LITTLE_ENDIAN ? value : ByteSwap64(value); }
+
+// Byte swap count uint32 values from src to dst (dst may equal src), 4 values per SIMD step.
+inline void ByteSwap32Array(uint32* dst, const uint32* src, size_t count) {
+    size_t i = 0;
+#if defined(NETWORK_HAS_SSE2)
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        // swap the 16-bit halves of each lane, then the bytes of each half
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+    }
+#elif defined(NETWORK_HAS_NEON)
+    for (; i + 4 <= count; i += 4) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(src + i));
+        vst1q_u8(reinterpret_cast<uint8_t*>(dst + i), vrev32q_u8(v));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = ByteSwap32(src[i]);
+    }
+}
+}  // namespace network
@@ -0,0 +1,139 @@
+#include "chain_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "byte_order.h"
+
+namespace network {
+ChainBuffer::ChainBuffer() : m_Size(0), m_WireFormat(WireFormat::kFIXED) {}
+
+ChainBuffer::~ChainBuffer() { m_Slices.clear(); }
+
+void ChainBuffer::WriteUInt64LE(uint64 value) {
+    uint64 wireValue = HostToLE64(value);
+    Append(&wireValue, sizeof(wireValue));
+}
+
+void ChainBuffer::WriteUInt32LE(uint32 value) {
+    uint32 wireValue = HostToLE32(value);
+    Append(&wireValue, sizeof(wireValue));
+}
+
+void ChainBuffer::WriteUInt16LE(uint16 value) {
+    uint16 wireValue = HostToLE16(value);
+    Append(&wireValue, sizeof(wireValue));
+}
+
+void ChainBuffer::WriteUInt32Array(const uint32* values, uint32 count) {
+    if (kHOST_LITTLE_ENDIAN) {
+        Append(values, sizeof(uint32) * count);
+    } else {
+        std::vector<uint32> swapped(count);
+        ByteSwap32Array(swapped.data(), values, count);
+        Append(swapped.data(), sizeof(uint32) * count);
+    }
+}
+
+void ChainBuffer::WriteString(const std::string& str, uint32 strLen) { Append(str.data(), strLen); }
+
+void ChainBuffer::WriteVarUInt32(uint32 value) {
+    uint8 bytes[kMAX_VARINT32_SIZE];
+    Append(bytes, EncodeVarUInt32(value, bytes));
+}
+
+void ChainBuffer::WriteLength(uint32 length) {
+    if (m_WireFormat == WireFormat::kCOMPACT) {
+        WriteVarUInt32(length);
+    } else {
+        WriteUInt32LE(length);
+    }
+}
+
+void ChainBuffer::WriteLengthArray(const uint32* lengths, uint32 count) {
+    if (m_WireFormat == WireFormat::kCOMPACT) {
+        for (uint32 i = 0; i < count; i++) {
+            WriteVarUInt32(lengths[i]);
+        }
+    } else {
+        WriteUInt32Array(lengths, count);
+    }
+}
+
+void ChainBuffer::WriteEnum16(uint16 value) {
+    if (m_WireFormat == WireFormat::kCOMPACT) {
+        WriteVarUInt32(value);
+    } else {
+        WriteUInt16LE(value);
+    }
+}
+
+void ChainBuffer::SetWireFormat(WireFormat format) { m_WireFormat = format; }
+
+WireFormat ChainBuffer::GetWireFormat() const { return m_WireFormat; }
+
+void ChainBuffer::Append(const void* data, size_t len) {
+    const uint8* src = static_cast<const uint8*>(data);
+    while (len > 0) {
+        uint32 freeBytes = 0;
+        uint8* tail = WritableTail(freeBytes);
+        uint32 n = static_cast<uint32>(std::min<size_t>(len, freeBytes));
+        memcpy(tail, src, n);
+        m_Slices.back().end += n;
+        m_Size += n;
+        src += n;
+        len -= n;
+    }
+}
+
+uint8* ChainBuffer::WritableTail(uint32& outFree) {
+    // only write into the last segment if nobody else references it,
+    // otherwise we could overwrite bytes that were spliced into another chain
+    if (!m_Slices.empty()) {
+        Slice& tail = m_Slices.back();
+        if (tail.segment.use_count() == 1 && tail.end < Segment::kCAPACITY) {
+            outFree = Segment::kCAPACITY - tail.end;
+            return tail.segment->data + tail.end;
+        }
+    }
+
+    m_Slices.push_back(Slice{std::shared_ptr<Segment>(new Segment), 0, 0});
+    outFree = Segment::kCAPACITY;
+    return m_Slices.back().segment->data;
+}
+
+void ChainBuffer::Splice(const ChainBuffer& other) {
+    for (const Slice& slice : other.m_Slices) {
+        m_Slices.push_back(slice);
+    }
+    m_Size += other.m_Size;
+}
+
+size_t ChainBuffer::GetIoVecs(std::vector<IoVec>& out) const {
+    out.clear();
+    out.reserve(m_Slices.size());
+    for (const Slice& slice : m_Slices) {
+        if (slice.end > slice.begin) {
+            out.push_back(IoVec{reinterpret_cast<const char*>(slice.segment->data + slice.begin),
+                                static_cast<size_t>(slice.end - slice.begin)});
+        }
+    }
+    return out.size();
+}
+
+std::string ChainBuffer::Flatten() const {
+    std::string flat;
+    flat.reserve(m_Size);
+    for (const Slice& slice : m_Slices) {
+        flat.append(reinterpret_cast<const char*>(slice.segment->data + slice.begin), slice.end - slice.begin);
+    }
+    return flat;
+}
+
+size_t ChainBuffer::Size() const { return m_Size; }
+
+void ChainBuffer::Reset() {
+    m_Slices.clear();
+    m_Size = 0;
+}
+}  // namespace network
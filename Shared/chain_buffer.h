@@ -0,0 +1,77 @@
+#pragma once
+
+#include "common.h"
+#include "wire_format.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace network {
+// A fixed-size chunk of memory, the unit a ChainBuffer grows by.
+struct Segment {
+    static constexpr uint32 kCAPACITY = 4096;
+    uint8 data[kCAPACITY];
+};
+
+// One contiguous piece of a ChainBuffer, laid out so it maps 1:1 onto iovec (writev/sendmsg) or WSABUF (WSASend).
+struct IoVec {
+    const char* base;
+    size_t len;
+};
+
+// A buffer made of a chain of fixed-size segments.
+// Unlike Buffer, appending never moves the bytes already written, so building a large message is O(n).
+// Segments are reference counted, which allows splicing the same bytes into several chains without copying.
+class ChainBuffer {
+public:
+    ChainBuffer();
+    ~ChainBuffer();
+
+    void WriteUInt64LE(uint64 value);
+    void WriteUInt32LE(uint32 value);
+    void WriteUInt16LE(uint16 value);
+    void WriteUInt32Array(const uint32* values, uint32 count);
+    void WriteString(const std::string& str, uint32 strLen);
+    void WriteVarUInt32(uint32 value);
+    void WriteLength(uint32 length);
+    void WriteLengthArray(const uint32* lengths, uint32 count);
+    void WriteEnum16(uint16 value);
+    void Append(const void* data, size_t len);
+
+    void SetWireFormat(WireFormat format);
+    WireFormat GetWireFormat() const;
+
+    // Append the content of another chain by sharing its segments (no copy).
+    void Splice(const ChainBuffer& other);
+
+    // Fill out with one IoVec per piece of the chain, returns the number of pieces
+    size_t GetIoVecs(std::vector<IoVec>& out) const;
+
+    // Copy the whole chain into one contiguous string (for callers that cannot scatter-gather)
+    std::string Flatten() const;
+
+    size_t Size() const;
+    void Reset();
+
+private:
+    // returns a writable tail with at least 1 free byte, starting a new segment when needed
+    uint8* WritableTail(uint32& outFree);
+
+private:
+    // A [begin, end) range inside a (possibly shared) segment
+    struct Slice {
+        std::shared_ptr<Segment> segment;
+        uint32 begin;
+        uint32 end;
+    };
+
+    std::vector<Slice> m_Slices;
+
+    // total number of bytes in the chain
+    size_t m_Size;
+
+    // the encoding of lengths and status codes, see Buffer
+    WireFormat m_WireFormat;
+};
+}  // namespace network
@@ -0,0 +1,251 @@
+#include "compression.h"
+
+#include <cstring>
+#include <vector>
+
+#include "byte_order.h"
+#include "frame_reader.h"
+#include "message.h"
+
+namespace network {
+// LZ4 block format parameters
+static constexpr uint32 kMIN_MATCH = 4;
+static constexpr uint32 kMAX_OFFSET = 65535;
+static constexpr uint32 kLAST_LITERALS = 5;  // the last bytes are always literals
+static constexpr uint32 kMF_LIMIT = 12;      // no match may start in the last kMF_LIMIT bytes
+static constexpr uint32 kHASH_LOG = 12;
+
+// compressed packet = header + raw payload size
+static constexpr uint32 kCOMPRESSED_HEADER_SIZE = sizeof(PacketHeader) + sizeof(uint32);
+
+static uint32 Read32(const uint8* p) {
+    uint32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32 Hash(uint32 sequence) { return (sequence * 2654435761u) >> (32 - kHASH_LOG); }
+
+// Write a length continuation (the part above the 15 that fits in the token), returns nullptr on overflow
+static uint8* WriteLengthBytes(uint8* out, const uint8* outEnd, uint32 length) {
+    while (length >= 255) {
+        if (out >= outEnd) {
+            return nullptr;
+        }
+        *out++ = 255;
+        length -= 255;
+    }
+    if (out >= outEnd) {
+        return nullptr;
+    }
+    *out++ = static_cast<uint8>(length);
+    return out;
+}
+
+// Write one sequence: literals followed by a match (matchLength 0 for the last, literals only sequence)
+static uint8* WriteSequence(uint8* out, const uint8* outEnd, const uint8* literals, uint32 literalLength,
+                            uint32 offset, uint32 matchLength) {
+    if (out >= outEnd) {
+        return nullptr;
+    }
+    uint8* token = out++;
+    *token = static_cast<uint8>((literalLength >= 15 ? 15 : literalLength) << 4);
+    if (literalLength >= 15 && !(out = WriteLengthBytes(out, outEnd, literalLength - 15))) {
+        return nullptr;
+    }
+    if (literalLength > static_cast<size_t>(outEnd - out)) {
+        return nullptr;
+    }
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+
+    if (matchLength == 0) {
+        return out;
+    }
+    if (outEnd - out < 2) {
+        return nullptr;
+    }
+    *out++ = static_cast<uint8>(offset);
+    *out++ = static_cast<uint8>(offset >> 8);
+
+    uint32 extra = matchLength - kMIN_MATCH;
+    *token |= static_cast<uint8>(extra >= 15 ? 15 : extra);
+    if (extra >= 15 && !(out = WriteLengthBytes(out, outEnd, extra - 15))) {
+        return nullptr;
+    }
+    return out;
+}
+
+uint32 Compress(const char* src, uint32 srcSize, char* dst, uint32 dstCapacity) {
+    const uint8* in = reinterpret_cast<const uint8*>(src);
+    uint8* out = reinterpret_cast<uint8*>(dst);
+    const uint8* outEnd = out + dstCapacity;
+
+    // position + 1 of the last occurrence of each hashed 4-byte sequence, 0 = none
+    std::vector<uint32> table(1 << kHASH_LOG, 0);
+
+    uint32 anchor = 0;  // the first byte not emitted yet
+    uint32 pos = 0;
+    if (srcSize > kMF_LIMIT) {
+        uint32 matchLimit = srcSize - kLAST_LITERALS;
+        uint32 searchLimit = srcSize - kMF_LIMIT;
+        while (pos < searchLimit) {
+            uint32 sequence = Read32(in + pos);
+            uint32& slot = table[Hash(sequence)];
+            uint32 candidate = slot;
+            slot = pos + 1;
+            if (candidate == 0 || pos - (candidate - 1) > kMAX_OFFSET || Read32(in + candidate - 1) != sequence) {
+                pos++;
+                continue;
+            }
+
+            uint32 ref = candidate - 1;
+            uint32 matchLength = kMIN_MATCH;
+            while (pos + matchLength < matchLimit && in[ref + matchLength] == in[pos + matchLength]) {
+                matchLength++;
+            }
+
+            out = WriteSequence(out, outEnd, in + anchor, pos - anchor, pos - ref, matchLength);
+            if (!out) {
+                return 0;
+            }
+            pos += matchLength;
+            anchor = pos;
+        }
+    }
+
+    out = WriteSequence(out, outEnd, in + anchor, srcSize - anchor, 0, 0);
+    if (!out) {
+        return 0;
+    }
+    return static_cast<uint32>(out - reinterpret_cast<uint8*>(dst));
+}
+
+bool Decompress(const char* src, uint32 srcSize, char* dst, uint32 dstSize) {
+    const uint8* in = reinterpret_cast<const uint8*>(src);
+    const uint8* inEnd = in + srcSize;
+    uint8* out = reinterpret_cast<uint8*>(dst);
+    uint8* outStart = out;
+    uint8* outEnd = out + dstSize;
+
+    while (in < inEnd) {
+        uint8 token = *in++;
+
+        uint32 literalLength = token >> 4;
+        if (literalLength == 15) {
+            uint8 b = 0;
+            do {
+                if (in >= inEnd) {
+                    return false;
+                }
+                b = *in++;
+                literalLength += b;
+            } while (b == 255);
+        }
+        if (literalLength > static_cast<size_t>(inEnd - in) || literalLength > static_cast<size_t>(outEnd - out)) {
+            return false;
+        }
+        memcpy(out, in, literalLength);
+        in += literalLength;
+        out += literalLength;
+
+        if (in == inEnd) {
+            break;  // the last sequence has no match
+        }
+
+        if (inEnd - in < 2) {
+            return false;
+        }
+        uint32 offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > static_cast<size_t>(out - outStart)) {
+            return false;
+        }
+
+        uint32 matchLength = token & 15;
+        if (matchLength == 15) {
+            uint8 b = 0;
+            do {
+                if (in >= inEnd) {
+                    return false;
+                }
+                b = *in++;
+                matchLength += b;
+            } while (b == 255);
+        }
+        matchLength += kMIN_MATCH;
+        if (matchLength > static_cast<size_t>(outEnd - out)) {
+            return false;
+        }
+
+        // the match may overlap the bytes it produces, so copy forward one byte at a time
+        const uint8* match = out - offset;
+        for (uint32 i = 0; i < matchLength; i++) {
+            out[i] = match[i];
+        }
+        out += matchLength;
+    }
+    return out == outEnd;
+}
+
+uint32 CompressPacket(const char* packet, uint32 packetSize, Buffer& out) {
+    if (packetSize < sizeof(PacketHeader) + kCOMPRESSION_THRESHOLD) {
+        return 0;
+    }
+
+    uint32 payloadSize = packetSize - sizeof(PacketHeader);
+    std::vector<char> block(CompressBound(payloadSize));
+    uint32 blockSize =
+        Compress(packet + sizeof(PacketHeader), payloadSize, block.data(), static_cast<uint32>(block.size()));
+    if (blockSize == 0 || blockSize + sizeof(uint32) >= payloadSize) {
+        return 0;
+    }
+
+    uint32 messageType = 0;
+    memcpy(&messageType, packet + sizeof(uint32), sizeof(uint32));
+    messageType = HostToLE32(messageType);
+
+    uint32 compressedSize = kCOMPRESSED_HEADER_SIZE + blockSize;
+    out.Reset();
+    out.WriteUInt32LE(compressedSize);
+    out.WriteUInt32LE(messageType | kMESSAGE_FLAG_COMPRESSED);
+    out.WriteUInt32LE(payloadSize);
+    out.Append(block.data(), blockSize);
+    return compressedSize;
+}
+
+bool LoadPacket(Buffer& buf, const char* packet, uint32 packetSize) {
+    uint32 messageType = 0;
+    memcpy(&messageType, packet + sizeof(uint32), sizeof(uint32));
+    messageType = HostToLE32(messageType);
+    if (!(messageType & kMESSAGE_FLAG_COMPRESSED)) {
+        buf.Set(packet, packetSize);
+        return true;
+    }
+
+    if (packetSize < kCOMPRESSED_HEADER_SIZE) {
+        return false;
+    }
+    uint32 payloadSize = 0;
+    memcpy(&payloadSize, packet + sizeof(PacketHeader), sizeof(uint32));
+    payloadSize = HostToLE32(payloadSize);
+    if (payloadSize > FrameReader::kMAX_PACKET_SIZE - sizeof(PacketHeader)) {
+        return false;
+    }
+
+    // rebuild the original packet: header (size and flag fixed up) + inflated payload
+    uint32 rawSize = sizeof(PacketHeader) + payloadSize;
+    std::vector<char> raw(rawSize);
+    uint32 wireSize = HostToLE32(rawSize);
+    uint32 wireType = HostToLE32(messageType & ~kMESSAGE_FLAG_COMPRESSED);
+    memcpy(raw.data(), &wireSize, sizeof(uint32));
+    memcpy(raw.data() + sizeof(uint32), &wireType, sizeof(uint32));
+    if (!Decompress(packet + kCOMPRESSED_HEADER_SIZE, packetSize - kCOMPRESSED_HEADER_SIZE,
+                    raw.data() + sizeof(PacketHeader), payloadSize)) {
+        return false;
+    }
+
+    buf.Set(raw.data(), rawSize);
+    return true;
+}
+}  // namespace network
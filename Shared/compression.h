@@ -0,0 +1,29 @@
+#pragma once
+
+#include "buffer.h"
+#include "common.h"
+
+namespace network {
+// Per-packet payload compression, enabled per connection with kFEATURE_COMPRESSION.
+// A compressed packet is: header (messageType | kMESSAGE_FLAG_COMPRESSED) + raw payload size (uint32) + LZ4 block.
+// The header itself is never compressed, so FrameReader and the dispatchers still see the real packet size.
+
+// payloads smaller than this are sent as is, they rarely shrink enough to pay for the extra work
+constexpr uint32 kCOMPRESSION_THRESHOLD = 256;
+
+// The max size of the compressed form of srcSize bytes
+inline constexpr uint32 CompressBound(uint32 srcSize) { return srcSize + srcSize / 255 + 16; }
+
+// Compress src with the LZ4 block format into dst, returns the compressed size, or 0 if it does not fit
+uint32 Compress(const char* src, uint32 srcSize, char* dst, uint32 dstCapacity);
+
+// Decompress an LZ4 block into exactly dstSize bytes, returns false if the block is malformed
+bool Decompress(const char* src, uint32 srcSize, char* dst, uint32 dstSize);
+
+// Write the compressed form of a whole packet into out. Returns the compressed packet size,
+// or 0 if the payload is below kCOMPRESSION_THRESHOLD or does not shrink (send the original then).
+uint32 CompressPacket(const char* packet, uint32 packetSize, Buffer& out);
+
+// Copy a received packet into buf, inflating it if it was compressed. Returns false if it is malformed.
+bool LoadPacket(Buffer& buf, const char* packet, uint32 packetSize);
+}  // namespace network
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "byte_order.h"
+#include "common.h"
+
+namespace network {
+// Fixed-layout encoding of the A2S acks, enabled on the ChatServer <-> AuthServer link by kFEATURE_FIXED_LAYOUT.
+// The payload is the struct itself (little-endian, no padding), so the receiver reads the fields in place
+// instead of parsing a protobuf message. The S2A requests carry strings and stay protobuf.
+#pragma pack(push, 1)
+struct A2S_CreateAccountWebSuccessLayout {
+    uint64 requestId;
+    uint64 userId;
+};
+
+struct A2S_CreateAccountWebFailureLayout {
+    uint64 requestId;
+    uint32 reason;  // CreateAccountFailureReason
+};
+
+struct A2S_AuthenticateWebSuccessLayout {
+    uint64 requestId;
+    uint64 userId;
+};
+
+struct A2S_AuthenticateWebFailureLayout {
+    uint64 requestId;
+    uint32 reason;  // AuthenticateAccountFailureReason
+};
+
+// The header of a chat log record, followed by the chat bytes. The ChatServer stores chats this way and sends
+// them back as they are in S2C_RoomHistoryAckMsg::records.
+// crc covers everything after it (the rest of the header and the chat), a record that fails it ends the log.
+struct ChatLogRecordHeader {
+    uint32 recordSize;  // header + chat, 0 marks the end of the segment
+    uint32 crc;
+    uint64 sequence;  // per partition, from 1, without gaps
+    uint64 timeMs;    // wall clock, milliseconds since the Unix epoch
+    uint32 roomId;
+    uint32 userId;
+};
+#pragma pack(pop)
+
+// View a payload as a layout, returns nullptr if the payload size does not match
+template <typename Layout>
+const Layout* LayoutOf(const void* payload, uint32 payloadSize) {
+    return payloadSize == sizeof(Layout) ? static_cast<const Layout*>(payload) : nullptr;
+}
+}  // namespace network
@@ -0,0 +1,53 @@
+#include "frame_reader.h"
+
+namespace network {
+// packet header = packetSize(uint32) + messageType(uint32)
+static constexpr uint32 kHEADER_SIZE = sizeof(uint32) * 2;
+
+FrameReader::FrameReader() : m_ReadIndex(0), m_Corrupted(false) {}
+
+FrameReader::~FrameReader() { m_Data.clear(); }
+
+void FrameReader::Append(const char* data, uint32 len) {
+    // drop the consumed bytes before appending, so the buffer does not grow forever
+    if (m_ReadIndex > 0) {
+        m_Data.erase(m_Data.begin(), m_Data.begin() + m_ReadIndex);
+        m_ReadIndex = 0;
+    }
+    m_Data.insert(m_Data.end(), data, data + len);
+}
+
+bool FrameReader::NextFrame(const char*& outFrame, uint32& outFrameSize) {
+    if (m_Corrupted) {
+        return false;
+    }
+
+    size_t available = m_Data.size() - m_ReadIndex;
+    if (available < kHEADER_SIZE) {
+        return false;
+    }
+
+    const uint8* head = reinterpret_cast<const uint8*>(m_Data.data() + m_ReadIndex);
+    uint32 packetSize = head[0] | (head[1] << 8) | (head[2] << 16) | (static_cast<uint32>(head[3]) << 24);
+    if (packetSize < kHEADER_SIZE || packetSize > kMAX_PACKET_SIZE) {
+        m_Corrupted = true;
+        return false;
+    }
+    if (available < packetSize) {
+        return false;
+    }
+
+    outFrame = m_Data.data() + m_ReadIndex;
+    outFrameSize = packetSize;
+    m_ReadIndex += packetSize;
+    return true;
+}
+
+bool FrameReader::IsCorrupted() const { return m_Corrupted; }
+
+void FrameReader::Reset() {
+    m_Data.clear();
+    m_ReadIndex = 0;
+    m_Corrupted = false;
+}
+}  // namespace network
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace network {
+// Reassembles packets from a TCP byte stream.
+// recv() may return a partial packet or several packets at once, so the received bytes are
+// accumulated here and handed out one complete packet (header + payload) at a time.
+class FrameReader {
+public:
+    FrameReader();
+    ~FrameReader();
+
+    // Append freshly received bytes
+    void Append(const char* data, uint32 len);
+
+    // Get the next complete packet, returns false when more bytes are needed.
+    // The returned pointer stays valid until the next call to Append.
+    bool NextFrame(const char*& outFrame, uint32& outFrameSize);
+
+    // true if the stream contained a packet with an invalid size, the connection should be dropped
+    bool IsCorrupted() const;
+
+    void Reset();
+
+    // the largest packet we accept
+    static constexpr uint32 kMAX_PACKET_SIZE = 16 * 1024 * 1024;
+
+private:
+    std::vector<char> m_Data;
+
+    // The index of the first byte not consumed yet
+    size_t m_ReadIndex;
+
+    bool m_Corrupted;
+};
+}  // namespace network
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include "common.h"
+#include "wire_format.h"
 
 namespace network {
 // forward declaration
@@ -46,9 +48,41 @@ enum MessageType {
     kCHAT_IN_ROOM_REQ,
     kCHAT_IN_ROOM_ACK,
     kCHAT_IN_ROOM_NTF,
+    kNEGOTIATE_PROTOCOL_REQ,  // C2S, and S2A at link setup
+    kNEGOTIATE_PROTOCOL_ACK,  // S2C, and A2S at link setup
+    kBATCH,                   // C2S/S2C/S2A/A2S, the payload is a sequence of complete packets, see batch.h
+    kLIST_MEMBERS_REQ,        // C2S
+    kLIST_MEMBERS_ACK,        // S2C
+    kCREATE_ROOM_REQ,         // C2S
+    kCREATE_ROOM_ACK,         // S2C
+    kDELETE_ROOM_REQ,         // C2S
+    kDELETE_ROOM_ACK,         // S2C
+    kROOM_HISTORY_REQ,        // C2S
+    kROOM_HISTORY_ACK,        // S2C
+    kSEARCH_ROOM_REQ,         // C2S
+    kSEARCH_ROOM_ACK,         // S2C
+    kDIRECT_MESSAGE_REQ,      // C2S
+    kDIRECT_MESSAGE_ACK,      // S2C
+    kDIRECT_MESSAGE_NTF,      // S2C
+    kPRESENCE_NTF,            // S2C
 
 };
 
+// PacketHeader::messageType on the wire = MessageType | flags
+constexpr uint32 kMESSAGE_TYPE_MASK = 0x0000FFFF;
+constexpr uint32 kMESSAGE_FLAG_COMPACT = 0x80000000;     // the payload is encoded with WireFormat::kCOMPACT
+constexpr uint32 kMESSAGE_FLAG_COMPRESSED = 0x40000000;  // the payload is compressed, see compression.h
+
+// Optional protocol features, a client asks for them with kNEGOTIATE_PROTOCOL_REQ
+// and the server acknowledges the subset it supports
+enum ProtocolFeature : uint32 {
+    kFEATURE_NONE = 0,
+    kFEATURE_COMPACT_WIRE = 1 << 0,  // the peer understands kMESSAGE_FLAG_COMPACT packets
+    kFEATURE_BATCH = 1 << 1,         // the peer unpacks kBATCH packets
+    kFEATURE_COMPRESSION = 1 << 2,   // the peer understands kMESSAGE_FLAG_COMPRESSED packets
+    kFEATURE_FIXED_LAYOUT = 1 << 3,  // ChatServer <-> AuthServer only: the A2S acks use fixed_layout.h
+};
+
 // The message status code
 enum MessageStatus {
     kSUCCESS = 200,
@@ -56,6 +90,12 @@ enum MessageStatus {
     kERROR = 500,
 };
 
+// How S2C_JoinRoomAckMsg describes the room membership
+enum MembershipSync {
+    kSYNC_SNAPSHOT = 0,  // the full member list
+    kSYNC_DELTA = 1,     // the changes since the version the client sent
+};
+
 // must match the protobuf enum definition
 enum class CreateAccountFailureReason {
     kSUCCESS = 0,
@@ -71,190 +111,478 @@ enum class AuthenticateAccountFailureReason {
     kINTERNAL_SERVER_ERROR = 2,
 };
 
+// Rooms and users are interned by the server, messages refer to them by these 32-bit ids
+constexpr uint32 kINVALID_ID = 0xFFFFFFFF;
+
+// Member list pages are addressed by opaque cursors, this one means there is no next page
+constexpr uint32 kEND_CURSOR = 0xFFFFFFFF;
+
 // The fixed-length packet header
 struct PacketHeader {
     uint32 packetSize;
     uint32 messageType;
 };
 
-// the Message (aka. protocol) base class
-struct Message {
-    PacketHeader header;
-    virtual void Serialize(Buffer& buf);
-};
+// Read the packet header from buf, and set buf to the wire format the payload was encoded with
+MessageType ReadPacketHeader(Buffer& buf, uint32& outPacketSize);
+
+// Messages are plain structs. Each one lists its fields once, in wire order, in Fields();
+// serializer.h generates the exact packet size, the encoder and the decoder from that list.
+// Field encodings:
+//   uint16                   status/reason code, WriteEnum16 (varint in compact mode)
+//   uint32, uint64           fixed little-endian integer
+//   std::string              length prefix + bytes
+//   std::vector<uint32>      count + fixed little-endian integers
+//   std::vector<std::string> count + all lengths + all bytes
 
 // CreateAccount req message
-struct C2S_CreateAccountReqMsg : public Message {
-    uint32 emailLength;
+struct C2S_CreateAccountReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kCREATE_ACCOUNT_REQ;
+
     std::string email;
-    uint32 passwordLength;
     std::string password;
 
-    C2S_CreateAccountReqMsg(const std::string& strEmail, const std::string& strPassword);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&C2S_CreateAccountReqMsg::email, &C2S_CreateAccountReqMsg::password);
+    }
 };
 
 // CreateAccountSuccess ack message
-struct S2C_CreateAccountSuccessAckMsg : public Message {
-    uint32 emailLength;
+struct S2C_CreateAccountSuccessAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kCREATE_ACCOUNT_SUCCESS_ACK;
+
     std::string email;
-    uint64 userId;
+    uint64 userId = 0;
 
-    S2C_CreateAccountSuccessAckMsg(const std::string& strEmail, uint64 lUserId);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_CreateAccountSuccessAckMsg::email, &S2C_CreateAccountSuccessAckMsg::userId);
+    }
 };
 
 // CreateAccountFailure ack message
-struct S2C_CreateAccountFailureAckMsg : public Message {
-    uint16 failureReason;
-    uint32 emailLength;
+struct S2C_CreateAccountFailureAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kCREATE_ACCOUNT_FAILURE_ACK;
+
+    uint16 failureReason = 0;
     std::string email;
 
-    S2C_CreateAccountFailureAckMsg(uint16 iReason, const std::string& strEmail);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_CreateAccountFailureAckMsg::failureReason, &S2C_CreateAccountFailureAckMsg::email);
+    }
 };
 
 // AuthenticateAccount req message
-struct C2S_AuthenticateAccountReqMsg : public Message {
-    uint32 emailLength;
+struct C2S_AuthenticateAccountReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kAUTHENTICATE_ACCOUNT_REQ;
+
     std::string email;
-    uint32 passwordLength;
     std::string password;
 
-    C2S_AuthenticateAccountReqMsg(const std::string& strEmail, const std::string& strPassword);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&C2S_AuthenticateAccountReqMsg::email, &C2S_AuthenticateAccountReqMsg::password);
+    }
 };
 
 // AuthenticateAccountSuccess ack message
-struct S2C_AuthenticateAccountSuccessAckMsg : public Message {
-    uint32 emailLength;
+struct S2C_AuthenticateAccountSuccessAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kAUTHENTICATE_ACCOUNT_SUCCESS_ACK;
+
     std::string email;
-    uint32 roomListLength;
-    std::vector<uint32> roomNameLengths;
     std::vector<std::string> roomNames;
 
-    S2C_AuthenticateAccountSuccessAckMsg(const std::string& strEmail, const std::vector<std::string>& vecRoomNames);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_AuthenticateAccountSuccessAckMsg::email,
+                               &S2C_AuthenticateAccountSuccessAckMsg::roomNames);
+    }
 };
 
 // AuthenticateAccountFailure ack message
-struct S2C_AuthenticateAccountFailureAckMsg : public Message {
-    uint16 failureReason;
-    uint32 emailLength;
+struct S2C_AuthenticateAccountFailureAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kAUTHENTICATE_ACCOUNT_FAILURE_ACK;
+
+    uint16 failureReason = 0;
     std::string email;
 
-    S2C_AuthenticateAccountFailureAckMsg(uint16 iReason, const std::string& strEmail);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_AuthenticateAccountFailureAckMsg::failureReason,
+                               &S2C_AuthenticateAccountFailureAckMsg::email);
+    }
 };
 
 // JoinRoom req message
-struct C2S_JoinRoomReqMsg : public Message {
-    uint32 userNameLength;
-    std::string userName;
-    uint32 roomNameLength;
+// the user is the one authenticated on the connection.
+// knownVersion is the last membership version the client has for this room (0 = none), see S2C_JoinRoomAckMsg
+struct C2S_JoinRoomReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kJOIN_ROOM_REQ;
+
     std::string roomName;
+    uint32 knownVersion = 0;
 
-    C2S_JoinRoomReqMsg(const std::string& strUserName, const std::string& strRoomName);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&C2S_JoinRoomReqMsg::roomName, &C2S_JoinRoomReqMsg::knownVersion);
+    }
 };
 
 // JoinRoom ack message
-struct S2C_JoinRoomAckMsg : public Message {
-    uint16 joinStatus;
-    uint32 roomNameLength;
+// carries the room id used by every later message about the room, and the membership at version:
+// kSYNC_SNAPSHOT: userIds/userNames are the first page of members (userIds[i] is userNames[i]),
+//                 the rest is fetched with C2S_ListMembersReqMsg from nextCursor
+// kSYNC_DELTA:    userIds/userNames joined and leftUserIds left since the client's knownVersion
+struct S2C_JoinRoomAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kJOIN_ROOM_ACK;
+
+    uint16 joinStatus = 0;
+    uint32 roomId = kINVALID_ID;
     std::string roomName;
-    uint32 userListLength;
-    std::vector<uint32> userNameLengths;
+    uint16 syncMode = MembershipSync::kSYNC_SNAPSHOT;
+    uint32 version = 0;
+    uint32 memberCount = 0;
+    std::vector<uint32> userIds;
     std::vector<std::string> userNames;
-
-    S2C_JoinRoomAckMsg(uint16 iStatus, const std::string& strRoomName, const std::vector<std::string>& vecUserNames);
-    void Serialize(Buffer& buf) override;
+    std::vector<uint32> leftUserIds;
+    uint32 nextCursor = kEND_CURSOR;
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_JoinRoomAckMsg::joinStatus, &S2C_JoinRoomAckMsg::roomId,
+                               &S2C_JoinRoomAckMsg::roomName, &S2C_JoinRoomAckMsg::syncMode,
+                               &S2C_JoinRoomAckMsg::version, &S2C_JoinRoomAckMsg::memberCount,
+                               &S2C_JoinRoomAckMsg::userIds, &S2C_JoinRoomAckMsg::userNames,
+                               &S2C_JoinRoomAckMsg::leftUserIds, &S2C_JoinRoomAckMsg::nextCursor);
+    }
 };
 
 // JoinRoom ntf message
-// to broadcast the event that someone has joined the room
-struct S2C_JoinRoomNtfMsg : public Message {
-    uint32 roomNameLength;
-    std::string roomName;
-    uint32 userNameLength;
+// to broadcast the event that someone has joined the room, the name comes once so the members can map the id.
+// version is the membership version after the join.
+struct S2C_JoinRoomNtfMsg {
+    static constexpr MessageType kTYPE = MessageType::kJOIN_ROOM_NTF;
+
+    uint32 roomId = kINVALID_ID;
+    uint32 version = 0;
+    uint32 userId = kINVALID_ID;
     std::string userName;
 
-    S2C_JoinRoomNtfMsg(const std::string& strRoomName, const std::string& strUserName);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_JoinRoomNtfMsg::roomId, &S2C_JoinRoomNtfMsg::version, &S2C_JoinRoomNtfMsg::userId,
+                               &S2C_JoinRoomNtfMsg::userName);
+    }
 };
 
 // LeaveRoom req message
-struct C2S_LeaveRoomReqMsg : public Message {
-    uint32 roomNameLength;
-    std::string roomName;
-    uint32 userNameLength;
-    std::string userName;
+struct C2S_LeaveRoomReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kLEAVE_ROOM_REQ;
+
+    uint32 roomId = kINVALID_ID;
 
-    C2S_LeaveRoomReqMsg(const std::string& strRoomName, const std::string& strUserName);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() { return std::make_tuple(&C2S_LeaveRoomReqMsg::roomId); }
 };
 
 // LeaveRoom ack message
-struct S2C_LeaveRoomAckMsg : public Message {
-    uint16 leaveStatus;
-    uint32 roomNameLength;
-    std::string roomName;
-    uint32 userNameLength;
-    std::string userName;
+struct S2C_LeaveRoomAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kLEAVE_ROOM_ACK;
+
+    uint16 leaveStatus = 0;
+    uint32 roomId = kINVALID_ID;
 
-    S2C_LeaveRoomAckMsg(uint16 iStatus, const std::string& strRoomName, const std::string& strUserName);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_LeaveRoomAckMsg::leaveStatus, &S2C_LeaveRoomAckMsg::roomId);
+    }
 };
 
 // LeaveRoom ntf message
-// to broadcast the event that someone has left the room
-struct S2C_LeaveRoomNtfMsg : public Message {
-    uint32 roomNameLength;
-    std::string roomName;
-    uint32 userNameLength;
-    std::string userName;
-
-    S2C_LeaveRoomNtfMsg(const std::string& strRoomName, const std::string& strUserName);
-    void Serialize(Buffer& buf) override;
+// to broadcast the event that someone has left the room, version is the membership version after the leave
+struct S2C_LeaveRoomNtfMsg {
+    static constexpr MessageType kTYPE = MessageType::kLEAVE_ROOM_NTF;
+
+    uint32 roomId = kINVALID_ID;
+    uint32 version = 0;
+    uint32 userId = kINVALID_ID;
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_LeaveRoomNtfMsg::roomId, &S2C_LeaveRoomNtfMsg::version,
+                               &S2C_LeaveRoomNtfMsg::userId);
+    }
 };
 
 // ChatInRoom req message
-struct C2S_ChatInRoomReqMsg : public Message {
-    uint32 roomNameLength;
-    std::string roomName;
-    uint32 userNameLength;
-    std::string userName;
-    uint32 chatLength;
+struct C2S_ChatInRoomReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kCHAT_IN_ROOM_REQ;
+
+    uint32 roomId = kINVALID_ID;
     std::string chat;
 
-    C2S_ChatInRoomReqMsg(const std::string& strRoomName, const std::string& strUserName, const std::string& strChat);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&C2S_ChatInRoomReqMsg::roomId, &C2S_ChatInRoomReqMsg::chat);
+    }
 };
 
 // ChatInRoom ack message
-struct S2C_ChatInRoomAckMsg : public Message {
-    uint16 chatStatus;
-    uint32 roomNameLength;
-    std::string roomName;
-    uint32 userNameLength;
-    std::string userName;
+struct S2C_ChatInRoomAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kCHAT_IN_ROOM_ACK;
+
+    uint16 chatStatus = 0;
+    uint32 roomId = kINVALID_ID;
 
-    S2C_ChatInRoomAckMsg(uint16 iStatus, const std::string& strRoomName, const std::string& strUserName);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_ChatInRoomAckMsg::chatStatus, &S2C_ChatInRoomAckMsg::roomId);
+    }
 };
 
 // ChatInRoom ntf message
 // to broadcast someone's chat in a room
-struct S2C_ChatInRoomNtfMsg : public Message {
-    uint32 roomNameLength;
+struct S2C_ChatInRoomNtfMsg {
+    static constexpr MessageType kTYPE = MessageType::kCHAT_IN_ROOM_NTF;
+
+    uint32 roomId = kINVALID_ID;
+    uint32 userId = kINVALID_ID;
+    std::string chat;
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_ChatInRoomNtfMsg::roomId, &S2C_ChatInRoomNtfMsg::userId,
+                               &S2C_ChatInRoomNtfMsg::chat);
+    }
+};
+
+// ListMembers req message
+// one page of a room's members, starting at cursor (0 = the first page, then the nextCursor of the previous ack)
+struct C2S_ListMembersReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kLIST_MEMBERS_REQ;
+
+    uint32 roomId = kINVALID_ID;
+    uint32 cursor = 0;
+    uint32 pageSize = 0;  // 0 = the server's default, capped by the server
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&C2S_ListMembersReqMsg::roomId, &C2S_ListMembersReqMsg::cursor,
+                               &C2S_ListMembersReqMsg::pageSize);
+    }
+};
+
+// ListMembers ack message
+// nextCursor is kEND_CURSOR after the last page
+struct S2C_ListMembersAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kLIST_MEMBERS_ACK;
+
+    uint16 listStatus = 0;
+    uint32 roomId = kINVALID_ID;
+    uint32 version = 0;
+    uint32 memberCount = 0;
+    std::vector<uint32> userIds;
+    std::vector<std::string> userNames;
+    uint32 nextCursor = kEND_CURSOR;
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_ListMembersAckMsg::listStatus, &S2C_ListMembersAckMsg::roomId,
+                               &S2C_ListMembersAckMsg::version, &S2C_ListMembersAckMsg::memberCount,
+                               &S2C_ListMembersAckMsg::userIds, &S2C_ListMembersAckMsg::userNames,
+                               &S2C_ListMembersAckMsg::nextCursor);
+    }
+};
+
+// NegotiateProtocol req message
+// the client sends it before anything has been negotiated, so it only uses fixed-size fields
+struct C2S_NegotiateProtocolReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kNEGOTIATE_PROTOCOL_REQ;
+
+    uint32 features = 0;  // ProtocolFeature flags the client supports
+
+    static constexpr auto Fields() { return std::make_tuple(&C2S_NegotiateProtocolReqMsg::features); }
+};
+
+// NegotiateProtocol ack message
+struct S2C_NegotiateProtocolAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kNEGOTIATE_PROTOCOL_ACK;
+
+    uint32 features = 0;  // ProtocolFeature flags enabled for this connection
+
+    static constexpr auto Fields() { return std::make_tuple(&S2C_NegotiateProtocolAckMsg::features); }
+};
+
+// CreateRoom req message
+// the room is only registered, its state is allocated when the first user joins
+struct C2S_CreateRoomReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kCREATE_ROOM_REQ;
+
     std::string roomName;
-    uint32 userNameLength;
-    std::string userName;
-    uint32 chatLength;
+
+    static constexpr auto Fields() { return std::make_tuple(&C2S_CreateRoomReqMsg::roomName); }
+};
+
+// CreateRoom ack message
+struct S2C_CreateRoomAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kCREATE_ROOM_ACK;
+
+    uint16 createStatus = 0;
+    uint32 roomId = kINVALID_ID;
+    std::string roomName;
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_CreateRoomAckMsg::createStatus, &S2C_CreateRoomAckMsg::roomId,
+                               &S2C_CreateRoomAckMsg::roomName);
+    }
+};
+
+// DeleteRoom req message
+// only an empty room can be deleted, its name can then be reused
+struct C2S_DeleteRoomReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kDELETE_ROOM_REQ;
+
+    uint32 roomId = kINVALID_ID;
+
+    static constexpr auto Fields() { return std::make_tuple(&C2S_DeleteRoomReqMsg::roomId); }
+};
+
+// DeleteRoom ack message
+struct S2C_DeleteRoomAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kDELETE_ROOM_ACK;
+
+    uint16 deleteStatus = 0;
+    uint32 roomId = kINVALID_ID;
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_DeleteRoomAckMsg::deleteStatus, &S2C_DeleteRoomAckMsg::roomId);
+    }
+};
+
+// RoomHistory req message
+// a page of the logged chats of a room: the newest ones in the range, the page before is at nextBeforeSequence.
+// The sequence bounds are exclusive, the time bounds (milliseconds since the Unix epoch) inclusive, 0 for none.
+struct C2S_RoomHistoryReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kROOM_HISTORY_REQ;
+
+    uint32 roomId = kINVALID_ID;
+    uint64 beforeSequence = 0;
+    uint64 afterSequence = 0;
+    uint64 fromTimeMs = 0;
+    uint64 toTimeMs = 0;
+    uint32 pageSize = 0;  // 0 for the server's default
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&C2S_RoomHistoryReqMsg::roomId, &C2S_RoomHistoryReqMsg::beforeSequence,
+                               &C2S_RoomHistoryReqMsg::afterSequence, &C2S_RoomHistoryReqMsg::fromTimeMs,
+                               &C2S_RoomHistoryReqMsg::toTimeMs, &C2S_RoomHistoryReqMsg::pageSize);
+    }
+};
+
+// RoomHistory ack message
+// records holds recordCount chat log records oldest first, each a ChatLogRecordHeader and the chat (see
+// fixed_layout.h), with the names of their authors. nextBeforeSequence is 0 after the oldest page.
+struct S2C_RoomHistoryAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kROOM_HISTORY_ACK;
+
+    uint16 historyStatus = 0;
+    uint32 roomId = kINVALID_ID;
+    uint32 recordCount = 0;
+    std::string records;
+    std::vector<uint32> userIds;
+    std::vector<std::string> userNames;
+    uint64 nextBeforeSequence = 0;
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_RoomHistoryAckMsg::historyStatus, &S2C_RoomHistoryAckMsg::roomId,
+                               &S2C_RoomHistoryAckMsg::recordCount, &S2C_RoomHistoryAckMsg::records,
+                               &S2C_RoomHistoryAckMsg::userIds, &S2C_RoomHistoryAckMsg::userNames,
+                               &S2C_RoomHistoryAckMsg::nextBeforeSequence);
+    }
+};
+
+// SearchRoom req message
+// the newest chats of a room that hold every word of text, the page before is at nextBeforeSequence
+struct C2S_SearchRoomReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kSEARCH_ROOM_REQ;
+
+    uint32 roomId = kINVALID_ID;
+    std::string text;
+    uint64 beforeSequence = 0;  // exclusive, 0 to start from the newest
+    uint32 pageSize = 0;        // 0 for the server's default
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&C2S_SearchRoomReqMsg::roomId, &C2S_SearchRoomReqMsg::text,
+                               &C2S_SearchRoomReqMsg::beforeSequence, &C2S_SearchRoomReqMsg::pageSize);
+    }
+};
+
+// SearchRoom ack message
+// the same page layout as S2C_RoomHistoryAckMsg
+struct S2C_SearchRoomAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kSEARCH_ROOM_ACK;
+
+    uint16 searchStatus = 0;
+    uint32 roomId = kINVALID_ID;
+    uint32 recordCount = 0;
+    std::string records;
+    std::vector<uint32> userIds;
+    std::vector<std::string> userNames;
+    uint64 nextBeforeSequence = 0;
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_SearchRoomAckMsg::searchStatus, &S2C_SearchRoomAckMsg::roomId,
+                               &S2C_SearchRoomAckMsg::recordCount, &S2C_SearchRoomAckMsg::records,
+                               &S2C_SearchRoomAckMsg::userIds, &S2C_SearchRoomAckMsg::userNames,
+                               &S2C_SearchRoomAckMsg::nextBeforeSequence);
+    }
+};
+
+// DirectMessage req message
+// a chat to one user, addressed by the userId the room messages carry
+struct C2S_DirectMessageReqMsg {
+    static constexpr MessageType kTYPE = MessageType::kDIRECT_MESSAGE_REQ;
+
+    uint32 toUserId = kINVALID_ID;
+    std::string chat;
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&C2S_DirectMessageReqMsg::toUserId, &C2S_DirectMessageReqMsg::chat);
+    }
+};
+
+// DirectMessage ack message
+// a success means the chat was sent to the recipient, or kept until it logs in
+struct S2C_DirectMessageAckMsg {
+    static constexpr MessageType kTYPE = MessageType::kDIRECT_MESSAGE_ACK;
+
+    uint16 directStatus = 0;
+    uint32 toUserId = kINVALID_ID;
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_DirectMessageAckMsg::directStatus, &S2C_DirectMessageAckMsg::toUserId);
+    }
+};
+
+// DirectMessage ntf message
+// to deliver someone's chat to its recipient, with the sender's name since they may share no room
+struct S2C_DirectMessageNtfMsg {
+    static constexpr MessageType kTYPE = MessageType::kDIRECT_MESSAGE_NTF;
+
+    uint32 fromUserId = kINVALID_ID;
+    std::string fromUserName;
     std::string chat;
 
-    S2C_ChatInRoomNtfMsg(const std::string& strRoomName, const std::string& strUserName, const std::string& strChat);
-    void Serialize(Buffer& buf) override;
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_DirectMessageNtfMsg::fromUserId, &S2C_DirectMessageNtfMsg::fromUserName,
+                               &S2C_DirectMessageNtfMsg::chat);
+    }
+};
+
+// Presence ntf message
+// the membership changes of a room over one presence tick, sent instead of a S2C_JoinRoomNtfMsg/S2C_LeaveRoomNtfMsg
+// per change. A join and a leave of the same user in a tick cancel out. version is the membership version after the
+// changes. A member may be listed in the changes it already knows of (its own join, say), applying them again is
+// harmless.
+struct S2C_PresenceNtfMsg {
+    static constexpr MessageType kTYPE = MessageType::kPRESENCE_NTF;
+
+    uint32 roomId = kINVALID_ID;
+    uint32 version = 0;
+    std::vector<uint32> joinedUserIds;
+    std::vector<std::string> joinedUserNames;  // joinedUserNames[i] is joinedUserIds[i]
+    std::vector<uint32> leftUserIds;
+
+    static constexpr auto Fields() {
+        return std::make_tuple(&S2C_PresenceNtfMsg::roomId, &S2C_PresenceNtfMsg::version,
+                               &S2C_PresenceNtfMsg::joinedUserIds, &S2C_PresenceNtfMsg::joinedUserNames,
+                               &S2C_PresenceNtfMsg::leftUserIds);
+    }
 };
 
 }  // end of namespace network
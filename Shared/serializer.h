@@ -0,0 +1,228 @@
+#pragma once
+
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "buffer.h"
+#include "message.h"
+#include "wire_format.h"
+
+namespace network {
+// How each field type is sized, written and read (see the field encodings in message.h).
+// Write is a template so the same code serializes into a Buffer or a ChainBuffer.
+// Read returns false if the payload is truncated or a length is out of range.
+template <typename T>
+struct FieldCodec;
+
+template <>
+struct FieldCodec<uint16> {
+    static uint32 Size(uint16 value, WireFormat format) { return EnumFieldSize(value, format); }
+
+    template <typename Sink>
+    static void Write(Sink& buf, uint16 value) {
+        buf.WriteEnum16(value);
+    }
+
+    static bool Read(Buffer& buf, uint16& outValue) {
+        if (buf.ReadableBytes() < EnumFieldSize(0, buf.GetWireFormat())) {
+            return false;
+        }
+        outValue = buf.ReadEnum16();
+        return true;
+    }
+};
+
+template <>
+struct FieldCodec<uint32> {
+    static uint32 Size(uint32 value, WireFormat format) { return sizeof(uint32); }
+
+    template <typename Sink>
+    static void Write(Sink& buf, uint32 value) {
+        buf.WriteUInt32LE(value);
+    }
+
+    static bool Read(Buffer& buf, uint32& outValue) {
+        if (buf.ReadableBytes() < sizeof(uint32)) {
+            return false;
+        }
+        outValue = buf.ReadUInt32LE();
+        return true;
+    }
+};
+
+template <>
+struct FieldCodec<uint64> {
+    static uint32 Size(uint64 value, WireFormat format) { return sizeof(uint64); }
+
+    template <typename Sink>
+    static void Write(Sink& buf, uint64 value) {
+        buf.WriteUInt64LE(value);
+    }
+
+    static bool Read(Buffer& buf, uint64& outValue) {
+        if (buf.ReadableBytes() < sizeof(uint64)) {
+            return false;
+        }
+        outValue = buf.ReadUInt64LE();
+        return true;
+    }
+};
+
+template <>
+struct FieldCodec<std::string> {
+    static uint32 Size(const std::string& value, WireFormat format) {
+        uint32 length = static_cast<uint32>(value.size());
+        return LengthFieldSize(length, format) + length;
+    }
+
+    template <typename Sink>
+    static void Write(Sink& buf, const std::string& value) {
+        uint32 length = static_cast<uint32>(value.size());
+        buf.WriteLength(length);
+        buf.WriteString(value, length);
+    }
+
+    static bool Read(Buffer& buf, std::string& outValue) {
+        if (buf.ReadableBytes() < LengthFieldSize(0, buf.GetWireFormat())) {
+            return false;
+        }
+        uint32 length = buf.ReadLength();
+        if (buf.ReadableBytes() < length) {
+            return false;
+        }
+        outValue = buf.ReadString(length);
+        return true;
+    }
+};
+
+template <>
+struct FieldCodec<std::vector<uint32>> {
+    static uint32 Size(const std::vector<uint32>& values, WireFormat format) {
+        return LengthFieldSize(static_cast<uint32>(values.size()), format) +
+               static_cast<uint32>(sizeof(uint32) * values.size());
+    }
+
+    template <typename Sink>
+    static void Write(Sink& buf, const std::vector<uint32>& values) {
+        uint32 count = static_cast<uint32>(values.size());
+        buf.WriteLength(count);
+        buf.WriteUInt32Array(values.data(), count);
+    }
+
+    static bool Read(Buffer& buf, std::vector<uint32>& outValues) {
+        if (buf.ReadableBytes() < LengthFieldSize(0, buf.GetWireFormat())) {
+            return false;
+        }
+        uint32 count = buf.ReadLength();
+        if (count > buf.ReadableBytes() / sizeof(uint32)) {
+            return false;
+        }
+        outValues.resize(count);
+        buf.ReadUInt32Array(outValues.data(), count);
+        return true;
+    }
+};
+
+// all the lengths are written before all the strings, so they can be moved as one array
+template <>
+struct FieldCodec<std::vector<std::string>> {
+    static uint32 Size(const std::vector<std::string>& values, WireFormat format) {
+        uint32 size = LengthFieldSize(static_cast<uint32>(values.size()), format);
+        for (const std::string& value : values) {
+            uint32 length = static_cast<uint32>(value.size());
+            size += LengthFieldSize(length, format) + length;
+        }
+        return size;
+    }
+
+    template <typename Sink>
+    static void Write(Sink& buf, const std::vector<std::string>& values) {
+        uint32 count = static_cast<uint32>(values.size());
+        std::vector<uint32> lengths(count);
+        for (uint32 i = 0; i < count; i++) {
+            lengths[i] = static_cast<uint32>(values[i].size());
+        }
+
+        buf.WriteLength(count);
+        buf.WriteLengthArray(lengths.data(), count);
+        for (uint32 i = 0; i < count; i++) {
+            buf.WriteString(values[i], lengths[i]);
+        }
+    }
+
+    static bool Read(Buffer& buf, std::vector<std::string>& outValues) {
+        uint32 minLengthSize = LengthFieldSize(0, buf.GetWireFormat());
+        if (buf.ReadableBytes() < minLengthSize) {
+            return false;
+        }
+        uint32 count = buf.ReadLength();
+        if (count > buf.ReadableBytes() / minLengthSize) {
+            return false;
+        }
+
+        std::vector<uint32> lengths(count);
+        buf.ReadLengthArray(lengths.data(), count);
+
+        outValues.clear();
+        outValues.reserve(count);
+        for (uint32 i = 0; i < count; i++) {
+            if (buf.ReadableBytes() < lengths[i]) {
+                return false;
+            }
+            outValues.push_back(buf.ReadString(lengths[i]));
+        }
+        return true;
+    }
+};
+
+// the codec of the field a member pointer refers to
+template <typename Msg, typename MemberPtr>
+using FieldCodecOf = FieldCodec<std::decay_t<decltype(std::declval<const Msg&>().*std::declval<MemberPtr>())>>;
+
+// The exact size (header included) of msg once serialized in the given format
+template <typename Msg>
+uint32 PacketSize(const Msg& msg, WireFormat format) {
+    uint32 packetSize = sizeof(PacketHeader);
+    std::apply(
+        [&](auto... members) {
+            ((packetSize += FieldCodecOf<Msg, decltype(members)>::Size(msg.*members, format)), ...);
+        },
+        Msg::Fields());
+    return packetSize;
+}
+
+// Append msg (header + fields) to what buf already holds. Returns the packet size.
+template <typename Msg, typename Sink>
+uint32 SerializeAppend(const Msg& msg, Sink& buf, WireFormat format) {
+    uint32 packetSize = PacketSize(msg, format);
+    uint32 messageType = static_cast<uint32>(Msg::kTYPE);
+    if (format == WireFormat::kCOMPACT) {
+        messageType |= kMESSAGE_FLAG_COMPACT;
+    }
+
+    buf.SetWireFormat(format);
+    buf.WriteUInt32LE(packetSize);
+    buf.WriteUInt32LE(messageType);
+    std::apply([&](auto... members) { (FieldCodecOf<Msg, decltype(members)>::Write(buf, msg.*members), ...); },
+               Msg::Fields());
+    return packetSize;
+}
+
+// Serialize msg (header + fields) into buf, a Buffer or a ChainBuffer. Returns the packet size.
+template <typename Msg, typename Sink>
+uint32 Serialize(const Msg& msg, Sink& buf, WireFormat format = WireFormat::kFIXED) {
+    buf.Reset();
+    return SerializeAppend(msg, buf, format);
+}
+
+// Deserialize the fields of msg from buf, the header must have been consumed by ReadPacketHeader.
+// Returns false if the payload is malformed.
+template <typename Msg>
+bool Deserialize(Buffer& buf, Msg& outMsg) {
+    return std::apply(
+        [&](auto... members) { return (FieldCodecOf<Msg, decltype(members)>::Read(buf, outMsg.*members) && ...); },
+        Msg::Fields());
+}
+}  // namespace network
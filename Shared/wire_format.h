@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+
+namespace network {
+// How the payload of a packet is encoded.
+// kFIXED:   lengths are uint32, status/reason codes are uint16 (the original protocol)
+// kCOMPACT: lengths and status/reason codes are LEB128 varints, small values take a single byte
+// The packet header (packetSize, messageType) is always fixed-size, see kMESSAGE_FLAG_COMPACT.
+enum class WireFormat : uint8 {
+    kFIXED = 0,
+    kCOMPACT = 1,
+};
+
+// the max number of bytes of a LEB128 encoded uint32
+constexpr uint32 kMAX_VARINT32_SIZE = 5;
+
+// The number of bytes value takes when encoded as a LEB128 varint
+inline constexpr uint32 VarUInt32Size(uint32 value) {
+    uint32 size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+// The number of bytes a length prefix takes in the given format
+inline constexpr uint32 LengthFieldSize(uint32 length, WireFormat format) {
+    return format == WireFormat::kCOMPACT ? VarUInt32Size(length) : sizeof(uint32);
+}
+
+// The number of bytes a status/reason code takes in the given format
+inline constexpr uint32 EnumFieldSize(uint16 value, WireFormat format) {
+    return format == WireFormat::kCOMPACT ? VarUInt32Size(value) : sizeof(uint16);
+}
+
+// Encode value as a LEB128 varint into out (at least kMAX_VARINT32_SIZE bytes), returns the bytes written
+inline uint32 EncodeVarUInt32(uint32 value, uint8* out) {
+    uint32 size = 0;
+    while (value >= 0x80) {
+        out[size++] = static_cast<uint8>(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = static_cast<uint8>(value);
+    return size;
+}
+}  // namespace network